@@ -1,6 +1,7 @@
 #ifndef B654B613_A379_4ACC_AF2D_8F6CA201E044
 #define B654B613_A379_4ACC_AF2D_8F6CA201E044
 
+#include <cassert>
 #include <cstdint>
 #include <type_traits>
 #include <utility>
@@ -38,7 +39,29 @@ class Optional {
            typename = typename std::enable_if<
                std::is_constructible<TType, TArgs...>::value, bool>::type>
   Optional(TArgs&&... args) {
-    data_ptr_ = CreateStackPtr<TType>(data_, std::forward(args)...);
+    data_ptr_ = CreateStackPtr<TType>(data_, std::forward<TArgs>(args)...);
+  }
+
+  // NOTE: |data_ptr_| points into |data_|, so the implicitly generated move
+  // operations (which would copy the bytes and steal the pointer) must not be
+  // used.
+  Optional(Optional&& other) {
+    if (other.data_ptr_) {
+      data_ptr_ = CreateStackPtr<TType>(data_, std::move(*other.data_ptr_));
+      other.data_ptr_.reset();
+    }
+  }
+  Optional& operator=(Optional&& other) {
+    if (this == &other) {
+      return *this;
+    }
+
+    data_ptr_.reset();
+    if (other.data_ptr_) {
+      data_ptr_ = CreateStackPtr<TType>(data_, std::move(*other.data_ptr_));
+      other.data_ptr_.reset();
+    }
+    return *this;
   }
 
   // Moves |other| instance to this one if it supports a move ctor.
@@ -55,6 +78,7 @@ class Optional {
            typename = typename std::enable_if<
                std::is_constructible<TType, U&&>::value, bool>::type>
   Optional& operator=(Optional<U>&& other) {
+    data_ptr_.reset();
     if (other.data_ptr_) {
       data_ptr_ = CreateStackPtr<TType>(data_, std::move(*other.data_ptr_));
       other.data_ptr_.reset();
@@ -82,6 +106,11 @@ class Optional {
            typename = typename std::enable_if<
                std::is_constructible<TType, const U&>::value, bool>::type>
   Optional& operator=(const Optional<TType>& other) {
+    if (this == &other) {
+      return *this;
+    }
+
+    data_ptr_.reset();
     if (other.data_ptr_) {
       data_ptr_ = CreateStackPtr<TType>(data_, *other.data_ptr_);
     }
@@ -91,7 +120,8 @@ class Optional {
            typename = typename std::enable_if<
                std::is_constructible<TType, const U&>::value, bool>::type>
   Optional& operator=(const TType& other) {
-    data_ptr_ = CreateStackPtr<TType>(data_, *other.data_ptr_);
+    data_ptr_.reset();
+    data_ptr_ = CreateStackPtr<TType>(data_, other);
     return *this;
   }
   
@@ -122,7 +152,7 @@ class Optional {
 
   TType&& operator*() && {
     assert(!!data_ptr_);
-    return *data_ptr_;
+    return std::move(*data_ptr_);
   }
 
   bool has_value() const {
@@ -138,7 +168,7 @@ class Optional {
   }
 
   TType&& value() && {
-    return *data_ptr_;
+    return std::move(*data_ptr_);
   }
 
   void reset() {
@@ -146,7 +176,8 @@ class Optional {
   }
 
  private:
-  uint8_t data_[sizeof(TType)];
+  // Aligned for TType, which may be over-aligned (e.g. OnceClosure).
+  alignas(TType) unsigned char data_[sizeof(TType)];
   StackPtr<TType> data_ptr_;
 };
 
@@ -1,9 +1,11 @@
 #ifndef CCE09B41_4016_4075_AB48_C0F1FD2ADB64
 #define CCE09B41_4016_4075_AB48_C0F1FD2ADB64
 
+#include <cstdint>
+#include <memory>
+#include <new>
 #include <type_traits>
 #include <utility>
-#include <cstdint>
 
 namespace util{
 
@@ -0,0 +1,181 @@
+#include "threading/include/cpu_topology.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <cstdlib>
+#include <fstream>
+#include <thread>
+#include <utility>
+
+#if defined(__linux__)
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+namespace util {
+
+namespace {
+
+const char kNodeDirectory[] = "/sys/devices/system/node";
+
+// Returns the ids of the NUMA nodes listed in |kNodeDirectory|, in increasing
+// order.
+std::vector<int> ReadNodeIds() {
+  std::vector<int> node_ids;
+#if defined(__linux__)
+  DIR* directory = opendir(kNodeDirectory);
+  if (!directory) {
+    return node_ids;
+  }
+
+  while (const dirent* entry = readdir(directory)) {
+    const std::string name(entry->d_name);
+    if (name.compare(0, 4, "node") != 0 || name.size() == 4 ||
+        name.find_first_not_of("0123456789", 4) != std::string::npos) {
+      continue;
+    }
+    node_ids.push_back(std::atoi(name.c_str() + 4));
+  }
+  closedir(directory);
+
+  std::sort(node_ids.begin(), node_ids.end());
+#endif
+  return node_ids;
+}
+
+}  // namespace
+
+// static
+CpuTopology CpuTopology::Detect() {
+  std::vector<int> allowed_cpus = GetCurrentThreadAffinity();
+
+  std::vector<NumaNode> nodes;
+  for (int node_id : ReadNodeIds()) {
+    std::ifstream file(std::string(kNodeDirectory) + "/node" +
+                       std::to_string(node_id) + "/cpulist");
+    std::string cpu_list;
+    if (!std::getline(file, cpu_list)) {
+      continue;
+    }
+
+    NumaNode node{node_id, {}};
+    for (int cpu : ParseCpuList(cpu_list)) {
+      if (std::binary_search(allowed_cpus.begin(), allowed_cpus.end(), cpu)) {
+        node.cpus.push_back(cpu);
+      }
+    }
+    if (!node.cpus.empty()) {
+      nodes.push_back(std::move(node));
+    }
+  }
+
+  if (nodes.empty()) {
+    nodes.push_back(NumaNode{0, std::move(allowed_cpus)});
+  }
+  return CpuTopology(std::move(nodes));
+}
+
+CpuTopology::CpuTopology(std::vector<NumaNode> nodes)
+    : nodes_(std::move(nodes)) {
+  assert(!nodes_.empty());
+}
+
+int CpuTopology::NodeIndexOfCpu(int cpu) const {
+  for (size_t i = 0; i < nodes_.size(); i++) {
+    const std::vector<int>& cpus = nodes_[i].cpus;
+    if (std::find(cpus.begin(), cpus.end(), cpu) != cpus.end()) {
+      return static_cast<int>(i);
+    }
+  }
+
+  return -1;
+}
+
+std::vector<int> ParseCpuList(const std::string& cpu_list) {
+  std::vector<int> cpus;
+  const char* position = cpu_list.c_str();
+  while (*position && *position != '\n') {
+    char* end;
+    const long first = std::strtol(position, &end, 10);
+    if (end == position) {
+      return {};
+    }
+    position = end;
+
+    long last = first;
+    if (*position == '-') {
+      last = std::strtol(++position, &end, 10);
+      if (end == position) {
+        return {};
+      }
+      position = end;
+    }
+
+    if (first < 0 || last < first) {
+      return {};
+    }
+    for (long cpu = first; cpu <= last; cpu++) {
+      cpus.push_back(static_cast<int>(cpu));
+    }
+
+    if (*position == ',') {
+      position++;
+    }
+  }
+
+  std::sort(cpus.begin(), cpus.end());
+  cpus.erase(std::unique(cpus.begin(), cpus.end()), cpus.end());
+  return cpus;
+}
+
+std::vector<int> GetCurrentThreadAffinity() {
+  std::vector<int> cpus;
+#if defined(__linux__)
+  cpu_set_t cpu_set;
+  CPU_ZERO(&cpu_set);
+  if (sched_getaffinity(0, sizeof(cpu_set), &cpu_set) == 0) {
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+      if (CPU_ISSET(cpu, &cpu_set)) {
+        cpus.push_back(cpu);
+      }
+    }
+    return cpus;
+  }
+#endif
+
+  const int cpu_count =
+      std::max(static_cast<int>(std::thread::hardware_concurrency()), 1);
+  for (int cpu = 0; cpu < cpu_count; cpu++) {
+    cpus.push_back(cpu);
+  }
+  return cpus;
+}
+
+bool SetCurrentThreadAffinity(const std::vector<int>& cpus) {
+#if defined(__linux__)
+  cpu_set_t cpu_set;
+  CPU_ZERO(&cpu_set);
+  for (int cpu : cpus) {
+    if (cpu < 0 || cpu >= CPU_SETSIZE) {
+      return false;
+    }
+    CPU_SET(cpu, &cpu_set);
+  }
+
+  return !cpus.empty() &&
+         pthread_setaffinity_np(pthread_self(), sizeof(cpu_set), &cpu_set) == 0;
+#else
+  return false;
+#endif
+}
+
+bool SetCurrentThreadName(const std::string& name) {
+#if defined(__linux__)
+  return pthread_setname_np(pthread_self(), name.substr(0, 15).c_str()) == 0;
+#else
+  return false;
+#endif
+}
+
+}  // namespace util
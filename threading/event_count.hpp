@@ -0,0 +1,127 @@
+#ifndef DAD9F73C_97F3_4DCD_9EFF_BA17E6FB5E8C
+#define DAD9F73C_97F3_4DCD_9EFF_BA17E6FB5E8C
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+
+namespace util {
+
+// Lets threads sleep until some lock-free condition, such as "a queue is not
+// empty", may have become true, without adding any locking to the code which
+// makes it true.
+//
+// Waiters must use the following protocol, such that a notification sent
+// between checking the condition and going to sleep is never lost:
+//
+//   EventCount::Key key = event_count.PrepareWait();
+//   if (condition_is_true) {
+//     event_count.CancelWait();
+//   } else {
+//     event_count.Wait(key);
+//   }
+//
+// Notifiers make the condition true, then call NotifyOne() or NotifyAll().
+// When no thread is waiting, notifying costs a fence and a load, and never
+// touches the mutex.
+class EventCount {
+ public:
+  using Key = uint64_t;
+
+  EventCount() = default;
+  ~EventCount() = default;
+
+  EventCount(const EventCount& other) = delete;
+  EventCount(EventCount&& other) = delete;
+
+  Key PrepareWait() {
+    waiters_.fetch_add(1, std::memory_order_relaxed);
+
+    // Pairs with the fence in Notify(), such that either the waiter sees the
+    // condition made true before the notification, or the notifier sees the
+    // waiter.
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    return epoch_.load(std::memory_order_relaxed);
+  }
+
+  void CancelWait() {
+    waiters_.fetch_sub(1, std::memory_order_relaxed);
+  }
+
+  // Blocks until a notification is sent after the PrepareWait() call which
+  // returned |key|. Returns immediately if one already was.
+  void Wait(Key key) {
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      while (epoch_.load(std::memory_order_relaxed) == key) {
+        condition_.wait(lock);
+      }
+    }
+    waiters_.fetch_sub(1, std::memory_order_relaxed);
+  }
+
+  // As Wait(), but gives up at |deadline|. Returns false if it did.
+  template<typename TClock, typename TDuration>
+  bool WaitUntil(Key key,
+                 const std::chrono::time_point<TClock, TDuration>& deadline) {
+    bool is_notified = true;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      while (epoch_.load(std::memory_order_relaxed) == key) {
+        if (condition_.wait_until(lock, deadline) == std::cv_status::timeout) {
+          is_notified = epoch_.load(std::memory_order_relaxed) != key;
+          break;
+        }
+      }
+    }
+    waiters_.fetch_sub(1, std::memory_order_relaxed);
+    return is_notified;
+  }
+
+  // Wakes up one or all waiting threads. Returns false if no thread was
+  // waiting, in which case nothing else was done.
+  bool NotifyOne() {
+    return Notify(false);
+  }
+
+  bool NotifyAll() {
+    return Notify(true);
+  }
+
+ private:
+  bool Notify(bool notify_all) {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (waiters_.load(std::memory_order_relaxed) == 0) {
+      return false;
+    }
+
+    {
+      // Changed under the lock, such that a waiter cannot check |epoch_| and
+      // then miss the notification before it starts waiting.
+      std::lock_guard<std::mutex> lock(mutex_);
+      epoch_.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    if (notify_all) {
+      condition_.notify_all();
+    } else {
+      condition_.notify_one();
+    }
+    return true;
+  }
+
+  // Number of threads between PrepareWait() and the end of the wait.
+  std::atomic<uint32_t> waiters_{0};
+
+  // Incremented by every notification which found a waiter.
+  std::atomic<Key> epoch_{0};
+
+  std::mutex mutex_;
+  std::condition_variable condition_;
+};
+
+}  // namespace util
+
+#endif /* DAD9F73C_97F3_4DCD_9EFF_BA17E6FB5E8C */
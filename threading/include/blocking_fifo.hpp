@@ -0,0 +1,187 @@
+#ifndef B8AC09B5_0DEB_49CB_983C_C26497169CBE
+#define B8AC09B5_0DEB_49CB_983C_C26497169CBE
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <utility>
+
+#include "memory/include/optional.hpp"
+#include "threading/event_count.hpp"
+#include "threading/include/nearly_lockless_fifo.hpp"
+#include "threading/include/queue_policies.hpp"
+
+namespace util {
+
+// A NearlyLocklessFifo whose consumers may block until an element is available,
+// for consumers which have nothing else to do meanwhile, such as a logging
+// thread. The template parameters are those of NearlyLocklessFifo.
+//
+// Consumers sleep on an EventCount, which producers notify after each push. As
+// long as no consumer is waiting, notifying costs producers a fence and a load,
+// and never takes a lock. A consumer which found the FIFO empty announces
+// itself as a waiter, then checks the FIFO again before going to sleep, such
+// that either it sees any element pushed meanwhile, or the producer of that
+// element sees it waiting and wakes it up. No wake-up is ever missed.
+//
+// Once closed, pushes are rejected, and blocked consumers return as soon as the
+// FIFO is empty. Close() is meant to be called once producers are done, as an
+// element pushed concurrently with Close() may be accepted after consumers
+// observed the FIFO as closed and empty.
+//
+// This is separate from NearlyLocklessFifo, such that the queues of the task
+// runners, which have wake-up schemes of their own, do not pay for notifying.
+template<typename TDataType,
+         size_t TFifoElementCount = 1024,
+         typename TLayoutPolicy = PaddedCountersLayout,
+         typename TProducerPolicy = MultiProducer,
+         typename TConsumerPolicy = MultiConsumer>
+class BlockingFifo {
+ public:
+  BlockingFifo() = default;
+  ~BlockingFifo() = default;
+
+  BlockingFifo(const BlockingFifo& other) = delete;
+  BlockingFifo(BlockingFifo&& other) = delete;
+
+  // Pushes |data|, and returns true, unless the FIFO is closed, in which case
+  // |data| is left untouched.
+  bool Push(TDataType&& data) {
+    if (is_closed_.load(std::memory_order_relaxed)) {
+      return false;
+    }
+
+    fifo_.Enqueue(std::move(data));
+    not_empty_.NotifyOne();
+    return true;
+  }
+
+  // As Push(), for all elements in [|first|, |last|).
+  template<typename TIterator>
+  bool PushBulk(TIterator first, TIterator last) {
+    if (is_closed_.load(std::memory_order_relaxed)) {
+      return false;
+    }
+
+    fifo_.EnqueueBulk(first, last);
+    not_empty_.NotifyAll();
+    return true;
+  }
+
+  // Never blocks. May spuriously report the FIFO as empty, as described in
+  // nearly_lockless_fifo.hpp.
+  Optional<TDataType> TryPop() {
+    return fifo_.Dequeue();
+  }
+
+  // Blocks until an element is available, and returns it. Returns nullopt
+  // only once the FIFO is closed and empty.
+  Optional<TDataType> Pop() {
+    while (true) {
+      Optional<TDataType> data = fifo_.Dequeue();
+      if (!!data || !WaitForElements()) {
+        return data;
+      }
+    }
+  }
+
+  // As Pop(), but gives up after |timeout|, in which case it returns nullopt.
+  template<typename TRep, typename TPeriod>
+  Optional<TDataType> TryPopFor(
+      const std::chrono::duration<TRep, TPeriod>& timeout) {
+    const auto deadline = std::chrono::steady_clock::now() + timeout;
+    while (true) {
+      Optional<TDataType> data = fifo_.Dequeue();
+      if (!!data || !WaitForElementsUntil(deadline)) {
+        return data;
+      }
+    }
+  }
+
+  // Blocks until elements are available, then writes up to |max| of them to
+  // |out|, and returns how many were written. Returns zero only once the FIFO
+  // is closed and empty.
+  template<typename TOutputIterator>
+  size_t PopBulk(TOutputIterator out, size_t max) {
+    while (true) {
+      const size_t count = fifo_.DequeueBulk(out, max);
+      if (count || !WaitForElements()) {
+        return count;
+      }
+    }
+  }
+
+  // Rejects any further push, and wakes up all blocked consumers.
+  void Close() {
+    is_closed_.store(true, std::memory_order_release);
+    not_empty_.NotifyAll();
+  }
+
+  bool is_closed() const {
+    return is_closed_.load(std::memory_order_acquire);
+  }
+
+  bool is_empty() const {
+    return fifo_.is_empty();
+  }
+
+  // NOTE: Snapshot, which may be stale by the time it returns.
+  size_t size() const {
+    return fifo_.size();
+  }
+
+ private:
+  // Blocks until the FIFO may hold elements. Returns false without blocking if
+  // it is closed and empty.
+  //
+  // NOTE: Checks the FIFO through is_empty() rather than by popping, as
+  // popping may fail while another consumer flushes the overflow queue, which
+  // is not followed by any notification.
+  bool WaitForElements() {
+    const EventCount::Key key = not_empty_.PrepareWait();
+    if (!fifo_.is_empty()) {
+      not_empty_.CancelWait();
+      return true;
+    }
+    if (is_closed_.load(std::memory_order_acquire)) {
+      not_empty_.CancelWait();
+      return false;
+    }
+
+    not_empty_.Wait(key);
+    return true;
+  }
+
+  // As WaitForElements(), but also returns false once |deadline| passed.
+  template<typename TClock, typename TDuration>
+  bool WaitForElementsUntil(
+      const std::chrono::time_point<TClock, TDuration>& deadline) {
+    const EventCount::Key key = not_empty_.PrepareWait();
+    if (!fifo_.is_empty()) {
+      not_empty_.CancelWait();
+      return true;
+    }
+    if (is_closed_.load(std::memory_order_acquire)) {
+      not_empty_.CancelWait();
+      return false;
+    }
+
+    return not_empty_.WaitUntil(key, deadline);
+  }
+
+  NearlyLocklessFifo<TDataType, TFifoElementCount, TLayoutPolicy,
+                     TProducerPolicy, TConsumerPolicy> fifo_;
+
+  EventCount not_empty_;
+  std::atomic_bool is_closed_{false};
+};
+
+// BlockingFifo for any number of producers and a single consumer.
+template<typename TDataType, size_t TFifoElementCount = 1024>
+using MpscBlockingFifo = BlockingFifo<TDataType, TFifoElementCount,
+                                      PaddedCountersLayout, MultiProducer,
+                                      SingleConsumer>;
+
+}  // namespace util
+
+#endif /* B8AC09B5_0DEB_49CB_983C_C26497169CBE */
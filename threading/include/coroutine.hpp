@@ -0,0 +1,447 @@
+#ifndef E48F9D4A_7553_4FE0_86E6_A584BE0E62E3
+#define E48F9D4A_7553_4FE0_86E6_A584BE0E62E3
+
+// C++20 coroutine support for TaskRunners. Everything below is only available
+// when the compiler supports coroutines, such that the rest of the library
+// keeps building as C++11.
+#if defined(__cpp_impl_coroutine)
+
+#include <atomic>
+#include <coroutine>
+#include <cstddef>
+#include <exception>
+#include <memory>
+#include <new>
+#include <utility>
+
+#include "memory/include/optional.hpp"
+#include "threading/include/future.hpp"
+#include "threading/include/task_runner.hpp"
+
+namespace util {
+
+// Awaitable returned by TaskRunner::Schedule().
+class ScheduleAwaiter {
+ public:
+  explicit ScheduleAwaiter(TaskRunner* task_runner)
+      : task_runner_(task_runner) {}
+
+  bool await_ready() const noexcept {
+    return false;
+  }
+
+  void await_suspend(std::coroutine_handle<> handle) {
+    task_runner_->PostTask([handle]() { handle.resume(); });
+  }
+
+  void await_resume() const noexcept {}
+
+ private:
+  TaskRunner* task_runner_;
+};
+
+// Awaitable returned by TaskRunner::SleepFor().
+class SleepAwaiter {
+ public:
+  SleepAwaiter(TaskRunner* task_runner, TaskRunner::Timespan delay)
+      : task_runner_(task_runner), delay_(delay) {}
+
+  bool await_ready() const noexcept {
+    return false;
+  }
+
+  void await_suspend(std::coroutine_handle<> handle) {
+    task_runner_->PostTaskWithDelay([handle]() { handle.resume(); }, delay_);
+  }
+
+  void await_resume() const noexcept {}
+
+ private:
+  TaskRunner* task_runner_;
+  TaskRunner::Timespan delay_;
+};
+
+inline ScheduleAwaiter TaskRunner::Schedule() {
+  return ScheduleAwaiter(this);
+}
+
+inline SleepAwaiter TaskRunner::SleepFor(Timespan delay) {
+  return SleepAwaiter(this, delay);
+}
+
+namespace internal {
+
+// Per-thread cache of coroutine frames, bucketed by size, such that creating
+// coroutines over and over again stops hitting malloc.
+//
+// Like the task cells of MultithreadedTaskRunner, a frame always goes back to
+// the pool of the thread which allocated it: the owning thread frees to a
+// plain free list, while other threads push to a lock-free list which the
+// owner takes all at once. Frames therefore do not pile up on threads which
+// only ever destroy coroutines started elsewhere, as is common when a
+// coroutine hops between TaskRunners. A pool never holds more frames than were
+// alive at the same time, and is freed once its thread exited and all its
+// frames were returned.
+class CoroutineFramePool {
+ public:
+  static constexpr size_t kGranularity = 64;
+  static constexpr size_t kSizeClassCount = 16;
+
+  static void* Allocate(size_t size) {
+    const size_t size_class = SizeClass(size + sizeof(FrameHeader));
+    if (size_class >= kSizeClassCount) {
+      return new (::operator new(size + sizeof(FrameHeader)))
+          FrameHeader{nullptr, size_class} + 1;
+    }
+
+    CoroutineFramePool* pool = current();
+    SizeClassFrames& frames = pool->size_classes_[size_class];
+    if (!frames.free) {
+      frames.free = frames.returned.exchange(nullptr, std::memory_order_acquire);
+    }
+
+    void* block;
+    if (frames.free) {
+      block = frames.free;
+      frames.free = frames.free->next;
+    } else {
+      block = ::operator new((size_class + 1) * kGranularity);
+    }
+
+    pool->references_.fetch_add(1, std::memory_order_relaxed);
+    return new (block) FrameHeader{pool, size_class} + 1;
+  }
+
+  static void Deallocate(void* pointer) {
+    FrameHeader* header = static_cast<FrameHeader*>(pointer) - 1;
+    CoroutineFramePool* owner = header->owner;
+    if (!owner) {
+      ::operator delete(header);
+      return;
+    }
+
+    SizeClassFrames& frames = owner->size_classes_[header->size_class];
+    if (owner == current()) {
+      frames.free = new (header) FreeFrame{frames.free};
+    } else {
+      FreeFrame* frame = new (header) FreeFrame{nullptr};
+      FreeFrame* top = frames.returned.load(std::memory_order_relaxed);
+      do {
+        frame->next = top;
+      } while (!frames.returned.compare_exchange_weak(
+          top, frame, std::memory_order_release, std::memory_order_relaxed));
+    }
+    owner->Release();
+  }
+
+ private:
+  // Precedes every frame, keeping the frame aligned as operator new would.
+  struct alignas(std::max_align_t) FrameHeader {
+    // Null for frames too large to be pooled.
+    CoroutineFramePool* owner;
+    size_t size_class;
+  };
+
+  struct FreeFrame {
+    FreeFrame* next;
+  };
+
+  struct SizeClassFrames {
+    // Only accessed by the owning thread.
+    FreeFrame* free = nullptr;
+
+    // Frames freed by other threads.
+    std::atomic<FreeFrame*> returned{nullptr};
+  };
+
+  // Drops the reference of the owning thread when it exits.
+  struct ThreadReference {
+    ThreadReference() : pool(new CoroutineFramePool()) {}
+
+    ~ThreadReference() {
+      pool->Release();
+    }
+
+    CoroutineFramePool* const pool;
+  };
+
+  CoroutineFramePool() = default;
+
+  ~CoroutineFramePool() {
+    for (SizeClassFrames& frames : size_classes_) {
+      DeleteFrames(frames.free);
+      DeleteFrames(frames.returned.load(std::memory_order_acquire));
+    }
+  }
+
+  CoroutineFramePool(const CoroutineFramePool& other) = delete;
+  CoroutineFramePool(CoroutineFramePool&& other) = delete;
+
+  static size_t SizeClass(size_t size) {
+    return (size + kGranularity - 1) / kGranularity - 1;
+  }
+
+  static CoroutineFramePool* current() {
+    static thread_local ThreadReference thread_reference;
+    return thread_reference.pool;
+  }
+
+  static void DeleteFrames(FreeFrame* frame) {
+    while (frame) {
+      FreeFrame* next = frame->next;
+      ::operator delete(frame);
+      frame = next;
+    }
+  }
+
+  void Release() {
+    if (references_.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+      delete this;
+    }
+  }
+
+  SizeClassFrames size_classes_[kSizeClassCount];
+
+  // One for the owning thread while it runs, plus one per allocated frame.
+  std::atomic<size_t> references_{1};
+};
+
+// Allocates the frames of coroutines with a promise derived from it from the
+// CoroutineFramePool.
+class PooledFrame {
+ public:
+  static void* operator new(size_t size) {
+    return CoroutineFramePool::Allocate(size);
+  }
+
+  static void operator delete(void* pointer) {
+    CoroutineFramePool::Deallocate(pointer);
+  }
+};
+
+// Parts of the promise of a Task<TValue> which do not depend on |TValue|.
+class TaskPromiseBase : public PooledFrame {
+ public:
+  // Once the coroutine finishes, resumes whichever coroutine awaited it.
+  class FinalAwaiter {
+   public:
+    bool await_ready() const noexcept {
+      return false;
+    }
+
+    template<typename TPromise>
+    std::coroutine_handle<> await_suspend(
+        std::coroutine_handle<TPromise> handle) noexcept {
+      std::coroutine_handle<> continuation = handle.promise().continuation_;
+      return continuation ? continuation : std::noop_coroutine();
+    }
+
+    void await_resume() const noexcept {}
+  };
+
+  std::suspend_always initial_suspend() const noexcept {
+    return {};
+  }
+
+  FinalAwaiter final_suspend() const noexcept {
+    return {};
+  }
+
+  void unhandled_exception() {
+    exception_ = std::current_exception();
+  }
+
+  void set_continuation(std::coroutine_handle<> continuation) {
+    continuation_ = continuation;
+  }
+
+ protected:
+  void RethrowIfFailed() {
+    if (exception_) {
+      std::rethrow_exception(exception_);
+    }
+  }
+
+ private:
+  std::coroutine_handle<> continuation_;
+  std::exception_ptr exception_;
+};
+
+}  // namespace internal
+
+// Lazily started coroutine producing a |TValue|. A Task starts running when
+// awaited, on the thread of the awaiting coroutine, and resumes the awaiting
+// coroutine when it finishes, on whichever thread it finished. Use
+// |co_await task_runner->Schedule()| inside the coroutine to move it to a
+// TaskRunner, and Spawn() to start a Task from outside of any coroutine.
+//
+// Any exception thrown by the coroutine is rethrown to the awaiting one.
+template<typename TValue = void>
+class Task {
+ public:
+  class promise_type;
+  using Handle = std::coroutine_handle<promise_type>;
+
+  class promise_type : public internal::TaskPromiseBase {
+   public:
+    Task get_return_object() {
+      return Task(Handle::from_promise(*this));
+    }
+
+    template<typename TResult>
+    void return_value(TResult&& result) {
+      value_ = Optional<TValue>(TValue(std::forward<TResult>(result)));
+    }
+
+    TValue TakeResult() {
+      RethrowIfFailed();
+      return std::move(value_.value());
+    }
+
+   private:
+    Optional<TValue> value_;
+  };
+
+  class Awaiter {
+   public:
+    explicit Awaiter(Handle handle) : handle_(handle) {}
+
+    bool await_ready() const noexcept {
+      return false;
+    }
+
+    std::coroutine_handle<> await_suspend(
+        std::coroutine_handle<> awaiting) noexcept {
+      handle_.promise().set_continuation(awaiting);
+      return handle_;
+    }
+
+    TValue await_resume() {
+      return handle_.promise().TakeResult();
+    }
+
+   private:
+    Handle handle_;
+  };
+
+  Task(Task&& other) noexcept : handle_(std::exchange(other.handle_, {})) {}
+
+  Task& operator=(Task&& other) noexcept {
+    if (this != &other) {
+      Reset();
+      handle_ = std::exchange(other.handle_, {});
+    }
+    return *this;
+  }
+
+  ~Task() {
+    Reset();
+  }
+
+  Task(const Task& other) = delete;
+  Task& operator=(const Task& other) = delete;
+
+  Awaiter operator co_await() && noexcept {
+    return Awaiter(handle_);
+  }
+
+ private:
+  explicit Task(Handle handle) : handle_(handle) {}
+
+  void Reset() {
+    if (handle_) {
+      handle_.destroy();
+      handle_ = nullptr;
+    }
+  }
+
+  Handle handle_;
+};
+
+template<>
+class Task<void>::promise_type : public internal::TaskPromiseBase {
+ public:
+  Task get_return_object() {
+    return Task(Handle::from_promise(*this));
+  }
+
+  void return_void() {}
+
+  void TakeResult() {
+    RethrowIfFailed();
+  }
+};
+
+namespace internal {
+
+// Eagerly started coroutine which destroys itself once it finishes. Only used
+// as the root of a chain of Tasks.
+struct DetachedTask {
+  struct promise_type : public PooledFrame {
+    DetachedTask get_return_object() const noexcept {
+      return {};
+    }
+
+    std::suspend_never initial_suspend() const noexcept {
+      return {};
+    }
+
+    std::suspend_never final_suspend() const noexcept {
+      return {};
+    }
+
+    void return_void() {}
+
+    void unhandled_exception() {
+      std::terminate();
+    }
+  };
+};
+
+template<typename TValue>
+DetachedTask RunTask(std::shared_ptr<TaskRunner> task_runner,
+                     Task<TValue> task,
+                     Promise<TValue> promise) {
+  co_await task_runner->Schedule();
+  Optional<TValue> value;
+  try {
+    value = Optional<TValue>(co_await std::move(task));
+  } catch (...) {
+    promise.SetException(std::current_exception());
+    co_return;
+  }
+  promise.SetValue(std::move(value.value()));
+}
+
+inline DetachedTask RunTask(std::shared_ptr<TaskRunner> task_runner,
+                            Task<void> task,
+                            Promise<void> promise) {
+  co_await task_runner->Schedule();
+  try {
+    co_await std::move(task);
+  } catch (...) {
+    promise.SetException(std::current_exception());
+    co_return;
+  }
+  promise.SetValue();
+}
+
+}  // namespace internal
+
+// Starts |task| on |task_runner|, and returns a Future for its result, or for
+// the exception escaping |task|.
+template<typename TValue>
+Future<TValue> Spawn(std::shared_ptr<TaskRunner> task_runner,
+                     Task<TValue> task) {
+  Promise<TValue> promise;
+  Future<TValue> future = promise.GetFuture();
+  internal::RunTask(std::move(task_runner), std::move(task),
+                    std::move(promise));
+  return future;
+}
+
+}  // namespace util
+
+#endif  // defined(__cpp_impl_coroutine)
+
+#endif /* E48F9D4A_7553_4FE0_86E6_A584BE0E62E3 */
@@ -0,0 +1,58 @@
+#ifndef D981E8E1_76DB_495B_86B9_11320AD73ABC
+#define D981E8E1_76DB_495B_86B9_11320AD73ABC
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+namespace util {
+
+// A NUMA node, along with the CPUs on it which the process may run on.
+struct NumaNode {
+  int id;
+  std::vector<int> cpus;
+};
+
+// NUMA nodes of the machine, as seen by the process.
+class CpuTopology {
+ public:
+  // Reads the topology from /sys/devices/system/node, leaving out CPUs the
+  // process may not run on, and nodes left without any. Falls back to a single
+  // node holding every CPU the process may run on when the topology cannot be
+  // read, such as on machines without NUMA.
+  static CpuTopology Detect();
+
+  // |nodes| must not be empty, and no node may be without CPUs.
+  explicit CpuTopology(std::vector<NumaNode> nodes);
+
+  const std::vector<NumaNode>& nodes() const {
+    return nodes_;
+  }
+
+  // Returns the index in nodes() of the node holding |cpu|, or -1 if none
+  // does.
+  int NodeIndexOfCpu(int cpu) const;
+
+ private:
+  std::vector<NumaNode> nodes_;
+};
+
+// Parses a list of CPUs in the format used by sysfs, such as "0-3,8,10-11".
+// Returns an empty list if |cpu_list| is malformed.
+std::vector<int> ParseCpuList(const std::string& cpu_list);
+
+// Returns the CPUs the calling thread may run on.
+std::vector<int> GetCurrentThreadAffinity();
+
+// Restricts the calling thread to running on |cpus|. Returns false if the
+// platform does not support it, or the CPUs were rejected.
+bool SetCurrentThreadAffinity(const std::vector<int>& cpus);
+
+// Names the calling thread, as shown by debuggers and profilers. Linux
+// truncates names to 15 characters. Returns false if the platform does not
+// support it.
+bool SetCurrentThreadName(const std::string& name);
+
+}  // namespace util
+
+#endif /* D981E8E1_76DB_495B_86B9_11320AD73ABC */
@@ -0,0 +1,325 @@
+#ifndef F29E41A7_3E08_470C_B7B3_8B6E43273673
+#define F29E41A7_3E08_470C_B7B3_8B6E43273673
+
+#include <atomic>
+#include <cassert>
+#include <cstdint>
+#include <exception>
+#include <memory>
+#include <type_traits>
+#include <utility>
+
+#include "memory/include/optional.hpp"
+#include "util/include/once_closure.hpp"
+
+namespace util {
+
+template<typename TValue>
+class Future;
+
+template<typename TValue>
+class Promise;
+
+namespace internal {
+
+// Stand-in for the value of a Future<void>.
+struct VoidValue {};
+
+template<typename TValue>
+struct StoredValue {
+  using Type = TValue;
+};
+
+template<>
+struct StoredValue<void> {
+  using Type = VoidValue;
+};
+
+// Result of calling a continuation of a Future<TValue>.
+template<typename TValue, typename TFunctor>
+struct ContinuationResult {
+  using Type = typename std::result_of<TFunctor(TValue)>::type;
+};
+
+template<typename TFunctor>
+struct ContinuationResult<void, TFunctor> {
+  using Type = typename std::result_of<TFunctor()>::type;
+};
+
+// State shared by a Promise and its Future. Holds the value, or the exception
+// which prevented computing it, and the continuation, each of which is set
+// exactly once, by any thread. Whichever is set second runs the continuation,
+// such that no thread ever waits for the other.
+template<typename TStored>
+class FutureState {
+ public:
+  FutureState() = default;
+
+  FutureState(const FutureState& other) = delete;
+  FutureState(FutureState&& other) = delete;
+
+  template<typename... TArgs>
+  void SetValue(TArgs&&... args) {
+    value_ = Optional<TStored>(TStored(std::forward<TArgs>(args)...));
+    Publish(kIsReady);
+  }
+
+  void SetException(std::exception_ptr exception) {
+    exception_ = std::move(exception);
+    Publish(kIsReady);
+  }
+
+  void SetContinuation(OnceClosure continuation) {
+    continuation_ = std::move(continuation);
+    Publish(kHasContinuation);
+  }
+
+  bool is_ready() const {
+    return (flags_.load(std::memory_order_acquire) & kIsReady) != 0;
+  }
+
+  // Only valid once is_ready(). value() is only valid without an exception,
+  // and only to be used by the continuation.
+  const std::exception_ptr& exception() const {
+    return exception_;
+  }
+
+  TStored& value() {
+    return value_.value();
+  }
+
+ private:
+  static constexpr uint32_t kIsReady = 1;
+  static constexpr uint32_t kHasContinuation = 2;
+
+  void Publish(uint32_t flag) {
+    if (flags_.fetch_or(flag, std::memory_order_acq_rel) != 0) {
+      continuation_();
+    }
+  }
+
+  std::atomic<uint32_t> flags_{0};
+  Optional<TStored> value_;
+  std::exception_ptr exception_;
+  OnceClosure continuation_;
+};
+
+// Calls |functor| with |args|, and fulfills |promise| with the result, or
+// with the exception it threw. Only |functor| is guarded, such that a
+// continuation failing to be scheduled never fulfills |promise| twice.
+template<typename TResult>
+struct Fulfill {
+  template<typename TPromise, typename TFunctor, typename... TArgs>
+  static void Run(TPromise& promise, TFunctor& functor, TArgs&&... args) {
+    Optional<TResult> result;
+    try {
+      result = Optional<TResult>(functor(std::forward<TArgs>(args)...));
+    } catch (...) {
+      promise.SetException(std::current_exception());
+      return;
+    }
+    promise.SetValue(std::move(result.value()));
+  }
+};
+
+template<>
+struct Fulfill<void> {
+  template<typename TPromise, typename TFunctor, typename... TArgs>
+  static void Run(TPromise& promise, TFunctor& functor, TArgs&&... args) {
+    try {
+      functor(std::forward<TArgs>(args)...);
+    } catch (...) {
+      promise.SetException(std::current_exception());
+      return;
+    }
+    promise.SetValue();
+  }
+};
+
+// Task running |functor| on the value of a Future<TValue>, then fulfilling
+// |promise| with the result.
+template<typename TValue, typename TResult, typename TFunctor>
+class ResultTask {
+ public:
+  using Stored = typename StoredValue<TValue>::Type;
+
+  ResultTask(Stored value, Promise<TResult> promise, TFunctor functor)
+      : value_(std::move(value)),
+        promise_(std::move(promise)),
+        functor_(std::move(functor)) {}
+
+  void operator()() {
+    Run(std::is_void<TValue>());
+  }
+
+ private:
+  void Run(std::true_type /* is_void */) {
+    Fulfill<TResult>::Run(promise_, functor_);
+  }
+
+  void Run(std::false_type /* is_void */) {
+    Fulfill<TResult>::Run(promise_, functor_, std::move(value_));
+  }
+
+  Stored value_;
+  Promise<TResult> promise_;
+  TFunctor functor_;
+};
+
+// Continuation stored in a FutureState, which posts a ResultTask to
+// |task_runner| once the value is ready. If an exception is ready instead,
+// |functor| is skipped, and |promise| fails with the same exception right away.
+//
+// NOTE: Points to |state| without owning it, as it is owned by |state| and
+// only ever run from one of its functions.
+template<typename TValue, typename TResult, typename TFunctor,
+         typename TTaskRunner>
+class ContinuationPoster {
+ public:
+  using State = FutureState<typename StoredValue<TValue>::Type>;
+
+  ContinuationPoster(State* state,
+                     std::shared_ptr<TTaskRunner> task_runner,
+                     Promise<TResult> promise,
+                     TFunctor functor)
+      : state_(state),
+        task_runner_(std::move(task_runner)),
+        promise_(std::move(promise)),
+        functor_(std::move(functor)) {}
+
+  void operator()() {
+    if (state_->exception()) {
+      promise_.SetException(state_->exception());
+      return;
+    }
+
+    task_runner_->PostTask(ResultTask<TValue, TResult, TFunctor>(
+        std::move(state_->value()), std::move(promise_), std::move(functor_)));
+  }
+
+ private:
+  State* state_;
+  std::shared_ptr<TTaskRunner> task_runner_;
+  Promise<TResult> promise_;
+  TFunctor functor_;
+};
+
+}  // namespace internal
+
+// Write end of a Future. Move-only.
+//
+// NOTE: If a Promise is destroyed without a value, continuations of its Future
+// never run.
+template<typename TValue>
+class Promise {
+ public:
+  Promise() : state_(std::make_shared<State>()) {}
+  ~Promise() = default;
+
+  Promise(Promise&& other) = default;
+  Promise& operator=(Promise&& other) = default;
+
+  Promise(const Promise& other) = delete;
+  Promise& operator=(const Promise& other) = delete;
+
+  // Returns the Future reading this Promise. Must be called at most once.
+  Future<TValue> GetFuture() {
+    return Future<TValue>(state_);
+  }
+
+  // Fulfills the promise with a value constructed from |args|. Must be called
+  // at most once. Any continuation is scheduled from the calling thread.
+  template<typename... TArgs>
+  void SetValue(TArgs&&... args) {
+    state_->SetValue(std::forward<TArgs>(args)...);
+  }
+
+  // Fails the promise with |exception| instead. Must be called at most once,
+  // and only if SetValue() is not.
+  void SetException(std::exception_ptr exception) {
+    state_->SetException(std::move(exception));
+  }
+
+ private:
+  using State = internal::FutureState<
+      typename internal::StoredValue<TValue>::Type>;
+
+  std::shared_ptr<State> state_;
+};
+
+// Lightweight, move-only future, whose value is consumed by scheduling a
+// continuation with Then(), rather than by blocking a thread. A Future and its
+// Promise share a single allocation, and fulfilling one never takes a lock.
+//
+// If the functor computing the value throws, the Future holds the exception
+// instead, which skips the continuations chained after it and is passed on to
+// the last Future of the chain.
+template<typename TValue>
+class Future {
+ public:
+  Future() = default;
+  ~Future() = default;
+
+  Future(Future&& other) = default;
+  Future& operator=(Future&& other) = default;
+
+  Future(const Future& other) = delete;
+  Future& operator=(const Future& other) = delete;
+
+  // Returns false for default-constructed Futures, and once Then() was called.
+  bool is_valid() const {
+    return !!state_;
+  }
+
+  bool is_ready() const {
+    assert(is_valid());
+    return state_->is_ready();
+  }
+
+  // Once is_ready(), returns the exception the Future holds instead of a
+  // value, if any.
+  std::exception_ptr exception() const {
+    assert(is_ready());
+    return state_->exception();
+  }
+
+  // Once the value is ready, posts |functor| to |task_runner|, to be called
+  // with the value (or without arguments for a Future<void>). Returns a Future
+  // for the result of |functor|, such that calls can be chained to pipeline
+  // work across several TaskRunners. Consumes this Future.
+  //
+  // |TTaskRunner| may be any type with a TaskRunner-like PostTask().
+  template<typename TTaskRunner, typename TFunctor>
+  Future<typename internal::ContinuationResult<TValue, TFunctor>::Type> Then(
+      std::shared_ptr<TTaskRunner> task_runner, TFunctor functor) {
+    using TResult =
+        typename internal::ContinuationResult<TValue, TFunctor>::Type;
+    assert(is_valid());
+
+    Promise<TResult> promise;
+    Future<TResult> result = promise.GetFuture();
+
+    // Keeps the state alive until SetContinuation() returns, as it may run the
+    // continuation.
+    std::shared_ptr<State> state = std::move(state_);
+    state->SetContinuation(
+        internal::ContinuationPoster<TValue, TResult, TFunctor, TTaskRunner>(
+            state.get(), std::move(task_runner), std::move(promise),
+            std::move(functor)));
+    return result;
+  }
+
+ private:
+  friend class Promise<TValue>;
+
+  using State = internal::FutureState<
+      typename internal::StoredValue<TValue>::Type>;
+
+  explicit Future(std::shared_ptr<State> state) : state_(std::move(state)) {}
+
+  std::shared_ptr<State> state_;
+};
+
+}  // namespace util
+
+#endif /* F29E41A7_3E08_470C_B7B3_8B6E43273673 */
@@ -1,26 +1,43 @@
 #ifndef F4036F42_4CE4_4B4C_95CD_C0E1E2533545
 #define F4036F42_4CE4_4B4C_95CD_C0E1E2533545
 
-#include <array>
 #include <atomic>
-#include <mutex>
-#include <thread>
+#include <iterator>
 #include <type_traits>
-#include <vector>
 
 #include "memory/include/optional.hpp"
+#include "threading/include/queue_policies.hpp"
 #include "threading/parallel_circular_buffer.hpp"
+#include "threading/segmented_overflow_queue.hpp"
 #include "util/include/compiler_hints.hpp"
 
 namespace util {
 
 // This class defines a fully parallelized multi-producer multi-consumer
-// "nearly-lockless" FIFO queue. Specifically, contention for a mutex may only
-// occur when the underlying |data_| queue is full. For the expected use case
-// where nowhere near |TFifoElementCount| elements are ever queued up at the
-// same time, but the queue is never empty, this implementation should never
-// lock a mutex. 
-template<typename TDataType, size_t TFifoElementCount = 1024>
+// "nearly-lockless" FIFO queue. Elements are stored in the fixed-size |data_|
+// ring buffer. When it is full, they spill into |overflow_queue_|, an unbounded
+// lock-free list of segments which is flushed back into |data_| as space frees
+// up. For the expected use case where nowhere near |TFifoElementCount| elements
+// are ever queued up at the same time, only |data_| is ever used, and once a
+// burst has drained the queue returns to using only |data_|.
+//
+// NOTE: The only waiting that may occur is when a thread must briefly spin on
+// a slot of |data_| which another thread claimed but has not yet finished
+// with, or when a consumer finds |overflow_queue_| being flushed by another
+// thread, in which case it reports the queue as empty rather than waiting.
+//
+// |TLayoutPolicy| controls the padding of the underlying buffer and of the
+// overflow bookkeeping, as described in queue_policies.hpp.
+//
+// |TProducerPolicy| and |TConsumerPolicy| select how many threads may act on
+// each side of the queue at once. When a side is single-threaded, that side of
+// |data_| claims its slots without a CAS. See the MpscFifo and SpscFifo aliases
+// below for the common combinations.
+template<typename TDataType,
+         size_t TFifoElementCount = 1024,
+         typename TLayoutPolicy = PaddedCountersLayout,
+         typename TProducerPolicy = MultiProducer,
+         typename TConsumerPolicy = MultiConsumer>
 class NearlyLocklessFifo {
  public:
   // Use SFINAR to ensure this class can only be used with movable types.
@@ -36,14 +53,41 @@ class NearlyLocklessFifo {
 	void Enqueue(TDataType&& data);
 	Optional<TDataType> Dequeue();
 
+	// Bulk queue operations, which pay the cost of synchronization once per call
+	// instead of once per element where possible. EnqueueBulk() takes ownership
+	// of all elements in [|first|, |last|). DequeueBulk() writes up to |max|
+	// elements to |out| and returns how many were written.
+	template<typename TIterator>
+	void EnqueueBulk(TIterator first, TIterator last);
+	template<typename TOutputIterator>
+	size_t DequeueBulk(TOutputIterator out, size_t max);
+
+	// Snapshot of the overflow path's state, for monitoring.
+	struct Stats {
+		// Number of elements currently held outside of the ring buffer.
+		size_t overflow_depth = 0;
+
+		// Number of overflow segments in use, and allocated but idle.
+		size_t overflow_segments = 0;
+		size_t pooled_overflow_segments = 0;
+	};
+
 	// Accessors
-	bool is_empty() {
-	  if (!data_.is_empty()) {
-			return false;
-		}
+	bool is_empty() const {
+		return data_.is_empty() && overflow_queue_.is_empty();
+	}
+
+	// NOTE: Snapshot, which may be stale by the time it returns.
+	size_t size() const {
+		return data_.size() + overflow_queue_.size();
+	}
 
-		std::unique_lock<std::mutex> lock(overflow_queue_lock_);
-		return overflow_queue_.empty();
+	Stats stats() const {
+		Stats stats;
+		stats.overflow_depth = overflow_queue_.size();
+		stats.overflow_segments = overflow_queue_.linked_segments();
+		stats.pooled_overflow_segments = overflow_queue_.pooled_segments();
+		return stats;
 	}
 
  private:
@@ -52,49 +96,137 @@ class NearlyLocklessFifo {
 	bool queue_needs_maintanance() const;
 	bool MaintainQueue();
 
-	// Thread-safe accessors for |data_|.
- 	bool TryPushToArray(TDataType& data);
- 	virtual Optional<TDataType> TryPopFromArray();
+	// Removes the next element in FIFO order from either |data_| or
+	// |overflow_queue_|, if any. Used in place of MaintainQueue() by consumers
+	// when they may not push to |data_| because it has a single producer.
+	Optional<TDataType> TryPopFromOverflow();
+
+	bool is_overflow_queue_in_use() const {
+		return !overflow_queue_.is_empty();
+	}
+
+	// Thread-safe accessor for |data_|.
+ 	bool TryPushToArray(TDataType& data) {
+		return data_.TryEnqueue(data);
+	}
+
+	static constexpr size_t kOverflowSegmentSize =
+			TFifoElementCount < size_t{256} ? TFifoElementCount : size_t{256};
 
  	// Queue of tasks to execute that don't fit in |data_|. Will be dequeued and
- 	// pushed to |data_| once |data_| is only half-full.
- 	//
- 	// NOTE: Use Optional to support types that should or cannot be trivially
- 	// constructed.
- 	std::vector<Optional<TDataType>> overflow_queue_;
- 	std::mutex overflow_queue_lock_;
- 	std::atomic_bool is_overflow_queue_flushing_{false};
- 	std::atomic_bool is_overflow_queue_in_use_{false};
+ 	// pushed to |data_| as space becomes available. Only the thread holding
+ 	// |is_overflow_queue_flushing_| may read from it.
+ 	SegmentedOverflowQueue<TDataType, kOverflowSegmentSize> overflow_queue_;
 
-  std::atomic_int32_t elements_written_so_far_{ 0 };
+  // Polled by every producer and consumer, so kept away from |data_|'s tickets.
+  alignas(StricterAlignment(TLayoutPolicy::kCounterAlignment,
+                            alignof(std::atomic_bool)))
+ 	std::atomic_bool is_overflow_queue_flushing_{false};
 
  	// Array backing the lockless FIFO used to store tasks.
- 	ParallelCircularBuffer<TDataType, TFifoElementCount> data_;
+ 	ParallelCircularBuffer<TDataType, TFifoElementCount, TLayoutPolicy,
+	                       TProducerPolicy, TConsumerPolicy> data_;
 };
 
-template<typename TDataType, size_t TFifoElementCount>
-void NearlyLocklessFifo<TDataType, TFifoElementCount>::Enqueue(
-		TDataType&& data) {
-	if (data_.TryEnqueue(data)) {
+// FIFO for any number of producers and a single consumer.
+template<typename TDataType, size_t TFifoElementCount = 1024>
+using MpscFifo = NearlyLocklessFifo<TDataType, TFifoElementCount,
+                                    PaddedCountersLayout, MultiProducer,
+                                    SingleConsumer>;
+
+// FIFO for a single producer and a single consumer.
+template<typename TDataType, size_t TFifoElementCount = 1024>
+using SpscFifo = NearlyLocklessFifo<TDataType, TFifoElementCount,
+                                    PaddedCountersLayout, SingleProducer,
+                                    SingleConsumer>;
+
+template<typename TDataType,
+         size_t TFifoElementCount,
+         typename TLayoutPolicy,
+         typename TProducerPolicy,
+         typename TConsumerPolicy>
+void
+NearlyLocklessFifo<TDataType, TFifoElementCount, TLayoutPolicy,
+                   TProducerPolicy, TConsumerPolicy>
+		::Enqueue(TDataType&& data) {
+	// While |overflow_queue_| holds elements, new ones are queued behind them
+	// to keep FIFO order for each producer.
+	if (LIKELY(!is_overflow_queue_in_use()) && data_.TryEnqueue(data)) {
 		return;
 	}
 
-	const int so_far = elements_written_so_far_.load(std::memory_order_relaxed);
-	constexpr int check_interval = TFifoElementCount / 16;
-	if (so_far % check_interval == 0) {
-		MaintainQueue();
-		
-		if (data_.TryEnqueue(data)) {
-			return;
+	MaintainQueue();
+	if (!is_overflow_queue_in_use() && data_.TryEnqueue(data)) {
+		return;
+	}
+
+	overflow_queue_.Push(std::move(data));
+}
+
+template<typename TDataType,
+         size_t TFifoElementCount,
+         typename TLayoutPolicy,
+         typename TProducerPolicy,
+         typename TConsumerPolicy>
+template<typename TIterator>
+void
+NearlyLocklessFifo<TDataType, TFifoElementCount, TLayoutPolicy,
+                   TProducerPolicy, TConsumerPolicy>
+		::EnqueueBulk(TIterator first, TIterator last) {
+	if (LIKELY(!is_overflow_queue_in_use())) {
+		std::advance(first, data_.TryEnqueueBulk(first, last));
+	}
+
+	// Whatever did not fit in |data_| takes the slow path.
+	for (; first != last; ++first) {
+		Enqueue(std::move(*first));
+	}
+}
+
+template<typename TDataType,
+         size_t TFifoElementCount,
+         typename TLayoutPolicy,
+         typename TProducerPolicy,
+         typename TConsumerPolicy>
+template<typename TOutputIterator>
+size_t
+NearlyLocklessFifo<TDataType, TFifoElementCount, TLayoutPolicy,
+                   TProducerPolicy, TConsumerPolicy>
+		::DequeueBulk(TOutputIterator out, size_t max) {
+	size_t count = data_.DequeueBulk(out, max);
+	if (count == max || !queue_needs_maintanance()) {
+		return count;
+	}
+
+	for (size_t i = 0; i < count; i++) {
+		++out;
+	}
+
+	if (!TProducerPolicy::kIsConcurrent) {
+		while (count < max) {
+			auto element = TryPopFromOverflow();
+			if (!element) {
+				break;
+			}
+			*out = std::move(element).value();
+			++out;
+			count++;
 		}
+		return count;
 	}
 
-	std::lock_guard<std::mutex> lock(overflow_queue_lock_);
-	overflow_queue_.emplace_back(std::move(data));
+	MaintainQueue();
+	return count + data_.DequeueBulk(out, max - count);
 }
 
-template<typename TDataType, size_t TFifoElementCount>
-Optional<TDataType> NearlyLocklessFifo<TDataType, TFifoElementCount>
+template<typename TDataType,
+         size_t TFifoElementCount,
+         typename TLayoutPolicy,
+         typename TProducerPolicy,
+         typename TConsumerPolicy>
+Optional<TDataType>
+NearlyLocklessFifo<TDataType, TFifoElementCount, TLayoutPolicy,
+                   TProducerPolicy, TConsumerPolicy>
 		::Dequeue() {
 	auto result = data_.Dequeue();
 	if(!!result) {
@@ -102,6 +234,10 @@ Optional<TDataType> NearlyLocklessFifo<TDataType, TFifoElementCount>
 	}
 	
 	if (queue_needs_maintanance()) {
+		if (!TProducerPolicy::kIsConcurrent) {
+			return TryPopFromOverflow();
+		}
+
 		MaintainQueue();
 		return data_.Dequeue();
 	}
@@ -109,70 +245,74 @@ Optional<TDataType> NearlyLocklessFifo<TDataType, TFifoElementCount>
 	return result;
 }
 
-template<typename TDataType, size_t TFifoElementCount>
-bool NearlyLocklessFifo<TDataType, TFifoElementCount>
+template<typename TDataType,
+         size_t TFifoElementCount,
+         typename TLayoutPolicy,
+         typename TProducerPolicy,
+         typename TConsumerPolicy>
+bool
+NearlyLocklessFifo<TDataType, TFifoElementCount, TLayoutPolicy,
+                   TProducerPolicy, TConsumerPolicy>
 		::queue_needs_maintanance() const {
-	return is_overflow_queue_in_use_.load(std::memory_order_relaxed) &&
+	return is_overflow_queue_in_use() &&
 			!is_overflow_queue_flushing_.load(std::memory_order_relaxed);
 }
 
-template<typename TDataType, size_t TFifoElementCount>
-bool NearlyLocklessFifo<TDataType, TFifoElementCount>::MaintainQueue() {
+template<typename TDataType,
+         size_t TFifoElementCount,
+         typename TLayoutPolicy,
+         typename TProducerPolicy,
+         typename TConsumerPolicy>
+bool
+NearlyLocklessFifo<TDataType, TFifoElementCount, TLayoutPolicy,
+                   TProducerPolicy, TConsumerPolicy>
+		::MaintainQueue() {
 	if (!queue_needs_maintanance()) {
 		return false;
 	}
 
-	if (is_overflow_queue_flushing_.exchange(true)) {
-		return false;
-	}
-
-	if (UNLIKELY(!queue_needs_maintanance())) {
+	if (is_overflow_queue_flushing_.exchange(true, std::memory_order_acquire)) {
 		return false;
 	}
 
-	// Perform all modifications into the queue outside of the mutex section to
-	// boost performance.
-	std::vector<Optional<TDataType>> local_overflow_queue;
-	{
-		std::unique_lock<std::mutex> lock(overflow_queue_lock_);
-		overflow_queue_.swap(local_overflow_queue);
+	// Move elements over in order until either side runs out. Elements are only
+	// removed from |overflow_queue_| once |data_| has accepted them.
+	for (TDataType* front = overflow_queue_.Front();
+	     !!front && TryPushToArray(*front);
+	     front = overflow_queue_.Front()) {
+		overflow_queue_.PopFront();
 	}
 
-	auto it = local_overflow_queue.begin();
-	for (;it != local_overflow_queue.end(); it++) {
-		assert(*it);
-		if (!TryPushToArray(it->value())) {
-			break;
-		}
-	}
-	local_overflow_queue.erase(local_overflow_queue.begin(), it);
-	
-	// Now we have to go back and modify the original queue. First, handle any
-	// new elements added to the overflow queue since the prior swap.
-	std::unique_lock<std::mutex> second_lock(overflow_queue_lock_);
-
-	auto it2 = overflow_queue_.begin();
-	if (it == local_overflow_queue.end()) {
-		for (;it2 != overflow_queue_.end(); it2++) {
-			if (!TryPushToArray(it2->value())) {
-				break;
-			}
-		}
-	}
+	is_overflow_queue_flushing_.store(false, std::memory_order_release);
+	return true;
+}
 
-	// Add all remaining elements to the end of the local queue, then swap the
-	// queues back.
-	for (;it2 != overflow_queue_.end(); it2++) {
-		local_overflow_queue.push_back(std::move(*it2));
+template<typename TDataType,
+         size_t TFifoElementCount,
+         typename TLayoutPolicy,
+         typename TProducerPolicy,
+         typename TConsumerPolicy>
+Optional<TDataType>
+NearlyLocklessFifo<TDataType, TFifoElementCount, TLayoutPolicy,
+                   TProducerPolicy, TConsumerPolicy>
+		::TryPopFromOverflow() {
+	// Exclude MaintainQueue(), which could otherwise move the elements ahead of
+	// the one popped here into |data_| after |data_| was found to be empty.
+	if (is_overflow_queue_flushing_.exchange(true, std::memory_order_acquire)) {
+		return nullopt;
 	}
-	overflow_queue_.swap(local_overflow_queue);
 
-	if (overflow_queue_.empty()) {
-		is_overflow_queue_in_use_.store(false, std::memory_order_relaxed);
+	Optional<TDataType> result = data_.Dequeue();
+	if (!result) {
+		TDataType* front = overflow_queue_.Front();
+		if (front) {
+			result = std::move(*front);
+			overflow_queue_.PopFront();
+		}
 	}
-	is_overflow_queue_flushing_.store(false, std::memory_order_relaxed);
 
-	return true;
+	is_overflow_queue_flushing_.store(false, std::memory_order_release);
+	return result;
 }
 
 }  // namespace util
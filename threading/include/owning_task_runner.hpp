@@ -0,0 +1,132 @@
+#ifndef C16C5C25_BAA2_46CA_8057_33752C4666AC
+#define C16C5C25_BAA2_46CA_8057_33752C4666AC
+
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "threading/include/task_runner.hpp"
+
+namespace util {
+
+// What the threads of an OwningTaskRunner do with the tasks left when it is
+// shut down. In every mode, delayed tasks whose delay has not passed yet are
+// dropped.
+enum class ShutdownMode {
+  // Keeps running tasks until there are none left, including those posted by
+  // the tasks run meanwhile.
+  kDrainAll,
+
+  // As kDrainAll, but drops the tasks left once the timeout passed.
+  kDrainUntilDeadline,
+
+  // Drops every task left once threads are done with the tasks they already
+  // took, which for a multithreaded runner may be a small batch each.
+  kDropPending,
+};
+
+// Counters returned by OwningTaskRunner::ShutdownAndWait().
+struct ShutdownStats {
+  // Number of tasks run over the lifetime of the runner.
+  uint64_t tasks_run = 0;
+
+  // Number of tasks which were posted but never run, including those posted
+  // after the runner stopped accepting tasks.
+  uint64_t tasks_dropped = 0;
+
+  // Number of the tasks run which exited by throwing an exception.
+  uint64_t tasks_failed = 0;
+};
+
+// A TaskRunner which runs its tasks on threads of its own, and can be shut
+// down. Threads started by the factory functions keep the runner alive until
+// they return from LoopExecution(), so a runner which is never shut down is
+// never destroyed.
+class OwningTaskRunner : public TaskRunner {
+ public:
+  OwningTaskRunner() = default;
+
+  // Joins the threads left, which must already have returned from
+  // LoopExecution(). If the runner is destroyed by one of them, as happens
+  // when it drops the last reference, that thread is detached instead.
+  ~OwningTaskRunner() override {
+    for (std::thread& thread : threads_) {
+      if (!thread.joinable()) {
+        continue;
+      }
+
+      if (thread.get_id() == std::this_thread::get_id()) {
+        thread.detach();
+      } else {
+        thread.join();
+      }
+    }
+  }
+
+  OwningTaskRunner(const OwningTaskRunner& other) = delete;
+  OwningTaskRunner& operator=(const OwningTaskRunner& other) = delete;
+
+  // Takes ownership of |thread|, which must be running LoopExecution() of this
+  // runner, such that ShutdownAndWait() joins it.
+  void OwnThread(std::thread thread) {
+    std::lock_guard<std::mutex> lock(threads_lock_);
+    threads_.push_back(std::move(thread));
+  }
+
+  // Makes the threads of the runner return from LoopExecution() as selected by
+  // |mode|, without waiting for them. |timeout| is only used by
+  // ShutdownMode::kDrainUntilDeadline. Tasks posted once the runner stopped
+  // running tasks are dropped. May be called again to switch to a stricter
+  // mode or earlier deadline, but never back.
+  virtual void Shutdown(ShutdownMode mode,
+                        Timespan timeout = Timespan::zero()) = 0;
+
+  // As Shutdown(), then waits for every thread to return from LoopExecution(),
+  // joining those owned, and drops the tasks left.
+  //
+  // NOTE: Must not be called from a thread of the runner.
+  ShutdownStats ShutdownAndWait(ShutdownMode mode,
+                                Timespan timeout = Timespan::zero()) {
+    Shutdown(mode, timeout);
+
+    std::vector<std::thread> threads;
+    {
+      std::lock_guard<std::mutex> lock(threads_lock_);
+      threads.swap(threads_);
+    }
+    for (std::thread& thread : threads) {
+      thread.join();
+    }
+
+    return FinishShutdown();
+  }
+
+ protected:
+  // Called by ShutdownAndWait() once the owned threads were joined. Waits for
+  // any other thread running LoopExecution() to return, then drops the tasks
+  // left and returns the counters of the runner.
+  virtual ShutdownStats FinishShutdown() = 0;
+
+  // Gives up ownership of the calling thread, which must be about to return
+  // from LoopExecution() for good, such that it does not need to be joined.
+  void ReleaseCurrentThread() {
+    std::lock_guard<std::mutex> lock(threads_lock_);
+    for (auto it = threads_.begin(); it != threads_.end(); ++it) {
+      if (it->get_id() == std::this_thread::get_id()) {
+        it->detach();
+        threads_.erase(it);
+        return;
+      }
+    }
+  }
+
+ private:
+  std::vector<std::thread> threads_;
+  std::mutex threads_lock_;
+};
+
+}  // namespace util
+
+#endif /* C16C5C25_BAA2_46CA_8057_33752C4666AC */
@@ -0,0 +1,287 @@
+#ifndef E6BD890E_A142_47B6_AEBF_5BC5617E1B10
+#define E6BD890E_A142_47B6_AEBF_5BC5617E1B10
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "threading/include/task_runner.hpp"
+#include "threading/include/wait_group.hpp"
+
+namespace util {
+
+// Data-parallel algorithms running on the threads of a TaskRunner, along with
+// the calling thread.
+//
+// Ranges are split in halves recursively until no larger than the grain size.
+// At each split, the second half is posted as a task while the calling thread
+// goes on with the first half, then joins the second half. If no thread
+// started the second half by then, the joining thread runs it itself, such
+// that it only ever waits for work which is actually running. Waiting threads
+// of |task_runner| run its other tasks meanwhile, so that fork-join algorithms
+// can be nested and called from tasks of the same runner without deadlocking
+// it, even with a single thread.
+//
+// A grain size of zero picks one from the size of the range and the number of
+// CPUs, such that each CPU gets several pieces to balance the load.
+//
+// NOTE: |fn| and the other functors must not throw, as a posted task must not.
+
+namespace internal {
+
+// Number of pieces per CPU a range is split into when no grain size is given.
+constexpr size_t kPiecesPerCpu = 8;
+
+inline size_t AdaptiveGrain(size_t count, size_t grain, size_t min_grain) {
+  if (grain) {
+    return grain;
+  }
+
+  const size_t cpu_count =
+      std::max(static_cast<size_t>(std::thread::hardware_concurrency()),
+               size_t{1});
+  return std::max(count / (cpu_count * kPiecesPerCpu), min_grain);
+}
+
+// Second half of a ForkJoin(), run by whichever of the posted task and the
+// joining thread claims it first.
+struct ForkedWork {
+  std::atomic_bool is_claimed{false};
+  WaitGroup done{1};
+};
+
+// Runs |first| on the calling thread and |second| on |task_runner|, unless the
+// calling thread gets to it first, and returns once both ran.
+template<typename TFirst, typename TSecond>
+void ForkJoin(TaskRunner* task_runner, TFirst first, TSecond second) {
+  // Shared, as the posted task may only run once the join returned.
+  auto work = std::make_shared<ForkedWork>();
+  TSecond* const second_pointer = &second;
+  task_runner->PostTask([work, second_pointer]() {
+    if (!work->is_claimed.exchange(true, std::memory_order_acquire)) {
+      (*second_pointer)();
+      work->done.Done();
+    }
+  });
+
+  first();
+
+  if (!work->is_claimed.exchange(true, std::memory_order_acquire)) {
+    second();
+  } else {
+    work->done.Wait(task_runner);
+  }
+}
+
+template<typename TFunctor>
+void ParallelForRange(TaskRunner* task_runner, size_t begin, size_t end,
+                      size_t grain, const TFunctor& fn) {
+  if (end - begin <= grain) {
+    for (size_t i = begin; i < end; i++) {
+      fn(i);
+    }
+    return;
+  }
+
+  const size_t middle = begin + (end - begin) / 2;
+  ForkJoin(
+      task_runner,
+      [&]() { ParallelForRange(task_runner, begin, middle, grain, fn); },
+      [&]() { ParallelForRange(task_runner, middle, end, grain, fn); });
+}
+
+template<typename TValue, typename TMap, typename TReduce>
+TValue ParallelReduceRange(TaskRunner* task_runner, size_t begin, size_t end,
+                           size_t grain, const TValue& identity,
+                           const TMap& map, const TReduce& reduce) {
+  if (end - begin <= grain) {
+    TValue result = identity;
+    for (size_t i = begin; i < end; i++) {
+      result = reduce(std::move(result), map(i));
+    }
+    return result;
+  }
+
+  const size_t middle = begin + (end - begin) / 2;
+  TValue first_result = identity;
+  TValue second_result = identity;
+  ForkJoin(
+      task_runner,
+      [&]() {
+        first_result = ParallelReduceRange(task_runner, begin, middle, grain,
+                                           identity, map, reduce);
+      },
+      [&]() {
+        second_result = ParallelReduceRange(task_runner, middle, end, grain,
+                                            identity, map, reduce);
+      });
+  return reduce(std::move(first_result), std::move(second_result));
+}
+
+// Moves the sorted ranges [|first1|, |last1|) and [|first2|, |last2|) to
+// |out|, merging them. Splits around the middle element of the larger range,
+// found in the other one by binary search, such that both halves can be merged
+// in parallel.
+template<typename TIterator, typename TOutputIterator, typename TCompare>
+void ParallelMerge(TaskRunner* task_runner, TIterator first1, TIterator last1,
+                   TIterator first2, TIterator last2, TOutputIterator out,
+                   size_t grain, const TCompare& compare) {
+  const size_t size1 = static_cast<size_t>(last1 - first1);
+  const size_t size2 = static_cast<size_t>(last2 - first2);
+  if (size1 + size2 <= grain) {
+    std::merge(std::make_move_iterator(first1), std::make_move_iterator(last1),
+               std::make_move_iterator(first2), std::make_move_iterator(last2),
+               out, compare);
+    return;
+  }
+
+  if (size1 < size2) {
+    ParallelMerge(task_runner, first2, last2, first1, last1, out, grain,
+                  compare);
+    return;
+  }
+
+  const TIterator middle1 = first1 + size1 / 2;
+  const TIterator middle2 = std::lower_bound(first2, last2, *middle1, compare);
+  const TOutputIterator middle_out =
+      out + (middle1 - first1) + (middle2 - first2);
+  *middle_out = std::move(*middle1);
+  ForkJoin(
+      task_runner,
+      [&]() {
+        ParallelMerge(task_runner, first1, middle1, first2, middle2, out, grain,
+                      compare);
+      },
+      [&]() {
+        ParallelMerge(task_runner, middle1 + 1, last1, middle2, last2,
+                      middle_out + 1, grain, compare);
+      });
+}
+
+// Sorts [|first|, |last|), using [|buffer|, ...) of the same size as scratch
+// space. The sorted elements end up in the buffer if |is_into_buffer|, and in
+// place otherwise. The halves are sorted into the other range than the
+// result, such that each level only moves elements once.
+template<typename TIterator, typename TBufferIterator, typename TCompare>
+void ParallelMergeSort(TaskRunner* task_runner, TIterator first,
+                       TIterator last, TBufferIterator buffer,
+                       bool is_into_buffer, size_t grain,
+                       const TCompare& compare) {
+  const size_t size = static_cast<size_t>(last - first);
+  if (size <= grain) {
+    std::sort(first, last, compare);
+    if (is_into_buffer) {
+      std::move(first, last, buffer);
+    }
+    return;
+  }
+
+  const size_t half = size / 2;
+  ForkJoin(
+      task_runner,
+      [&]() {
+        ParallelMergeSort(task_runner, first, first + half, buffer,
+                          !is_into_buffer, grain, compare);
+      },
+      [&]() {
+        ParallelMergeSort(task_runner, first + half, last, buffer + half,
+                          !is_into_buffer, grain, compare);
+      });
+
+  if (is_into_buffer) {
+    ParallelMerge(task_runner, first, first + half, first + half, last, buffer,
+                  grain, compare);
+  } else {
+    ParallelMerge(task_runner, buffer, buffer + half, buffer + half,
+                  buffer + size, first, grain, compare);
+  }
+}
+
+}  // namespace internal
+
+// Calls |fn| with every index in [|begin|, |end|), in no particular order,
+// calling it for at most |grain| consecutive indices per piece of work.
+template<typename TFunctor>
+void ParallelFor(const std::shared_ptr<TaskRunner>& task_runner, size_t begin,
+                 size_t end, size_t grain, TFunctor fn) {
+  if (begin >= end) {
+    return;
+  }
+
+  internal::ParallelForRange(task_runner.get(), begin, end,
+                             internal::AdaptiveGrain(end - begin, grain, 1),
+                             fn);
+}
+
+// Returns |identity| combined with |map(i)| for every index in [|begin|,
+// |end|), using |reduce|, which must be associative. The results of
+// consecutive indices are combined in order, but pieces are combined in no
+// particular grouping.
+template<typename TValue, typename TMap, typename TReduce>
+TValue ParallelReduce(const std::shared_ptr<TaskRunner>& task_runner,
+                      size_t begin, size_t end, size_t grain, TValue identity,
+                      TMap map, TReduce reduce) {
+  if (begin >= end) {
+    return identity;
+  }
+
+  return internal::ParallelReduceRange(
+      task_runner.get(), begin, end,
+      internal::AdaptiveGrain(end - begin, grain, 1), identity, map, reduce);
+}
+
+// Writes |fn(*it)| for every |it| in [|first|, |last|) to the matching
+// position of |out|. All iterators must be random-access.
+template<typename TInputIterator, typename TOutputIterator, typename TFunctor>
+void ParallelTransform(const std::shared_ptr<TaskRunner>& task_runner,
+                       TInputIterator first, TInputIterator last,
+                       TOutputIterator out, size_t grain, TFunctor fn) {
+  ParallelFor(task_runner, 0, static_cast<size_t>(last - first), grain,
+              [first, out, &fn](size_t i) {
+                out[i] = fn(first[i]);
+              });
+}
+
+// Sorts [|first|, |last|) by |compare| with a parallel merge sort. Pieces of
+// up to |grain| elements are sorted with std::sort, then merged in parallel.
+// Allocates a buffer as large as the range. Not stable.
+template<typename TIterator, typename TCompare>
+void ParallelSort(const std::shared_ptr<TaskRunner>& task_runner,
+                  TIterator first, TIterator last, size_t grain,
+                  TCompare compare) {
+  using Value = typename std::iterator_traits<TIterator>::value_type;
+
+  // Pieces too small to be worth posting a task for.
+  constexpr size_t kMinSortGrain = 1024;
+
+  const size_t size = static_cast<size_t>(last - first);
+  grain = internal::AdaptiveGrain(size, grain, kMinSortGrain);
+  if (size <= grain) {
+    std::sort(first, last, compare);
+    return;
+  }
+
+  // Move the elements to the buffer and sort them back, such that the buffer
+  // never needs default-constructed elements.
+  std::vector<Value> buffer(std::make_move_iterator(first),
+                            std::make_move_iterator(last));
+  internal::ParallelMergeSort(task_runner.get(), buffer.begin(), buffer.end(),
+                              first, true, grain, compare);
+}
+
+template<typename TIterator>
+void ParallelSort(const std::shared_ptr<TaskRunner>& task_runner,
+                  TIterator first, TIterator last, size_t grain = 0) {
+  ParallelSort(task_runner, first, last, grain,
+               std::less<typename std::iterator_traits<TIterator>::value_type>());
+}
+
+}  // namespace util
+
+#endif /* E6BD890E_A142_47B6_AEBF_5BC5617E1B10 */
@@ -0,0 +1,77 @@
+#ifndef D31F2765_3D6E_4B46_8D3D_AE2E6FF4E24B
+#define D31F2765_3D6E_4B46_8D3D_AE2E6FF4E24B
+
+#include <cstddef>
+
+namespace util {
+
+// Size of the unit of memory that may be invalidated in other cores' caches
+// when written to. Two atomics written by different threads should be at least
+// this far apart to avoid false sharing.
+//
+// NOTE: Fixed rather than std::hardware_destructive_interference_size, which
+// may vary with compiler flags, and would thus change the layout of the queues
+// between translation units.
+constexpr size_t kCacheLineSize = 64;
+
+// Returns the stricter of |requested| and |natural|, such that a layout policy
+// can never weaken the natural alignment of a type.
+constexpr size_t StricterAlignment(size_t requested, size_t natural) {
+  return requested > natural ? requested : natural;
+}
+
+// Layout policies for the lock-free queues (ParallelCircularBuffer and
+// NearlyLocklessFifo). Each provides:
+//   - |kCounterAlignment|: Alignment of the counters written by producers and
+//     consumers (e.g. the enqueue and dequeue tickets).
+//   - |kSlotAlignment|: Alignment of each individual element slot.
+// A value of 1 means "use the natural alignment".
+
+// Packs everything as tightly as possible. Best for memory footprint and for
+// queues only used from a single thread at a time.
+struct CompactLayout {
+  static constexpr size_t kCounterAlignment = 1;
+  static constexpr size_t kSlotAlignment = 1;
+};
+
+// Places each hot counter on its own cache line, such that producers and
+// consumers do not invalidate each others' counters. Slots remain packed.
+struct PaddedCountersLayout {
+  static constexpr size_t kCounterAlignment = kCacheLineSize;
+  static constexpr size_t kSlotAlignment = 1;
+};
+
+// Additionally places each slot on its own cache line, such that a producer
+// writing one slot does not invalidate the neighbouring slot being read by a
+// consumer. Costs up to a cache line of memory per element.
+struct PaddedSlotsLayout {
+  static constexpr size_t kCounterAlignment = kCacheLineSize;
+  static constexpr size_t kSlotAlignment = kCacheLineSize;
+};
+
+// Concurrency policies for the lock-free queues. A queue is given one producer
+// policy and one consumer policy. The "Single" policies promise that only one
+// thread at a time acts on that side of the queue, which lets that side claim
+// its slots with plain acquire/release loads and stores instead of a CAS.
+//
+// NOTE: "Single" does not mean "always the same thread", only that calls on
+// that side never overlap and are ordered by some other synchronization.
+struct SingleProducer {
+  static constexpr bool kIsConcurrent = false;
+};
+
+struct MultiProducer {
+  static constexpr bool kIsConcurrent = true;
+};
+
+struct SingleConsumer {
+  static constexpr bool kIsConcurrent = false;
+};
+
+struct MultiConsumer {
+  static constexpr bool kIsConcurrent = true;
+};
+
+}  // namespace util
+
+#endif /* D31F2765_3D6E_4B46_8D3D_AE2E6FF4E24B */
@@ -0,0 +1,293 @@
+#ifndef DBBDAC16_A27A_4E91_9F2F_79222E992B39
+#define DBBDAC16_A27A_4E91_9F2F_79222E992B39
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <cstddef>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "threading/include/task_runner.hpp"
+#include "threading/include/wait_group.hpp"
+#include "util/include/once_closure.hpp"
+
+namespace util {
+
+// A directed acyclic graph of closures, each of which runs once all of the
+// nodes it depends on ran. Add nodes and dependencies, Build() the graph once,
+// then Run() it on a TaskRunner as many times as needed.
+//
+// Each node holds an atomic count of the predecessors which did not run yet in
+// the current run. Whichever thread finishes the last of them dispatches the
+// node: the first node made ready by a finishing node runs right away on the
+// same thread, and any other one is posted to the TaskRunner. Runs reset the
+// counts in place, such that once built, running the graph allocates nothing
+// beyond what posting its tasks does.
+//
+// The start and finish times of each node are recorded on every run, from
+// which the critical path of the last run can be derived.
+//
+// NOTE: The graph must outlive its runs, must not be modified while running,
+// and only runs once at a time. Closures must not throw.
+class TaskGraph {
+ public:
+  using NodeId = size_t;
+  using Closure = std::function<void()>;
+  using Clock = std::chrono::steady_clock;
+  using Timespan = Clock::duration;
+
+  // Times of a node in the last run, from the start of the run.
+  struct NodeTiming {
+    Timespan start_time = Timespan::zero();
+    Timespan finish_time = Timespan::zero();
+
+    Timespan duration() const {
+      return finish_time - start_time;
+    }
+  };
+
+  TaskGraph() = default;
+  ~TaskGraph() = default;
+
+  TaskGraph(const TaskGraph& other) = delete;
+  TaskGraph& operator=(const TaskGraph& other) = delete;
+
+  // Adds a node running |closure|, and returns its id. |name| is only used to
+  // tell nodes apart when inspecting timings.
+  NodeId AddNode(Closure closure, std::string name = std::string()) {
+    assert(!is_running_.load(std::memory_order_relaxed));
+
+    is_built_ = false;
+    nodes_.emplace_back();
+    nodes_.back().closure = std::move(closure);
+    nodes_.back().name = std::move(name);
+    return nodes_.size() - 1;
+  }
+
+  // Makes |node| run only after |dependency| ran.
+  void AddDependency(NodeId node, NodeId dependency) {
+    assert(!is_running_.load(std::memory_order_relaxed));
+    assert(node < nodes_.size() && dependency < nodes_.size());
+
+    is_built_ = false;
+    nodes_[dependency].successors.push_back(node);
+    nodes_[node].predecessor_count++;
+  }
+
+  // Prepares the graph to run. Returns false if the dependencies form a cycle,
+  // in which case the graph cannot run.
+  bool Build() {
+    assert(!is_running_.load(std::memory_order_relaxed));
+
+    // Sort the nodes topologically, as the critical path is derived in that
+    // order. Nodes are only ever appended to |topological_order_| once all of
+    // their predecessors were.
+    const size_t node_count = nodes_.size();
+    pending_predecessor_counts_.reset(new std::atomic<size_t>[node_count]);
+    topological_order_.clear();
+    topological_order_.reserve(node_count);
+    root_nodes_.clear();
+    for (NodeId id = 0; id < node_count; id++) {
+      pending_predecessor_counts_[id].store(nodes_[id].predecessor_count,
+                                            std::memory_order_relaxed);
+      if (!nodes_[id].predecessor_count) {
+        root_nodes_.push_back(id);
+        topological_order_.push_back(id);
+      }
+    }
+    for (size_t i = 0; i < topological_order_.size(); i++) {
+      for (NodeId successor : nodes_[topological_order_[i]].successors) {
+        if (pending_predecessor_counts_[successor].fetch_sub(
+                1, std::memory_order_relaxed) == 1) {
+          topological_order_.push_back(successor);
+        }
+      }
+    }
+
+    timings_.assign(node_count, NodeTiming());
+    is_built_ = topological_order_.size() == node_count;
+    return is_built_;
+  }
+
+  // Runs every node on |task_runner|, then |on_done|, on whichever thread ran
+  // the last node, or on the calling thread if the graph is empty. The graph
+  // may run again from |on_done|.
+  void Run(std::shared_ptr<TaskRunner> task_runner, OnceClosure on_done) {
+    assert(is_built_);
+    const bool was_running = is_running_.exchange(true,
+                                                  std::memory_order_acquire);
+    assert(!was_running);
+    (void)was_running;
+
+    task_runner_ = std::move(task_runner);
+    on_done_ = std::move(on_done);
+    for (NodeId id = 0; id < nodes_.size(); id++) {
+      pending_predecessor_counts_[id].store(nodes_[id].predecessor_count,
+                                            std::memory_order_relaxed);
+    }
+    remaining_node_count_.store(nodes_.size(), std::memory_order_relaxed);
+    run_start_time_ = Clock::now();
+
+    if (nodes_.empty()) {
+      FinishRun();
+      return;
+    }
+
+    // Posting publishes the counts reset above to the threads running nodes.
+    for (NodeId id : root_nodes_) {
+      PostNode(id);
+    }
+  }
+
+  // As Run(), but blocks until the run finished. If called from one of the
+  // threads of |task_runner|, runs its tasks meanwhile.
+  void RunAndWait(const std::shared_ptr<TaskRunner>& task_runner) {
+    TaskRunner* const task_runner_pointer = task_runner.get();
+    run_done_.Add();
+    Run(task_runner, [this]() { run_done_.Done(); });
+    run_done_.Wait(task_runner_pointer);
+  }
+
+  size_t node_count() const {
+    return nodes_.size();
+  }
+
+  const std::string& name(NodeId id) const {
+    return nodes_[id].name;
+  }
+
+  // Timings of the last run, which must be done.
+  const NodeTiming& timing(NodeId id) const {
+    return timings_[id];
+  }
+
+  Timespan run_duration() const {
+    return run_duration_;
+  }
+
+  // Returns the nodes of the path through the graph which took longest to run
+  // in the last run, counting only the time the nodes of the path ran, in the
+  // order in which they ran. Sets |duration| to that time if not null.
+  std::vector<NodeId> CriticalPath(Timespan* duration = nullptr) const {
+    static constexpr NodeId kNoNode = std::numeric_limits<NodeId>::max();
+
+    // Longest duration of any path ending with each node, and the node before
+    // it on that path.
+    std::vector<Timespan> path_durations(nodes_.size(), Timespan::zero());
+    std::vector<NodeId> previous_nodes(nodes_.size(), kNoNode);
+    std::vector<Timespan> predecessor_durations(nodes_.size(),
+                                                Timespan::zero());
+    NodeId last = kNoNode;
+    for (NodeId id : topological_order_) {
+      path_durations[id] = predecessor_durations[id] + timings_[id].duration();
+      if (last == kNoNode || path_durations[id] > path_durations[last]) {
+        last = id;
+      }
+
+      for (NodeId successor : nodes_[id].successors) {
+        if (previous_nodes[successor] == kNoNode ||
+            path_durations[id] > predecessor_durations[successor]) {
+          previous_nodes[successor] = id;
+          predecessor_durations[successor] = path_durations[id];
+        }
+      }
+    }
+
+    std::vector<NodeId> path;
+    for (NodeId id = last; id != kNoNode; id = previous_nodes[id]) {
+      path.push_back(id);
+    }
+    std::reverse(path.begin(), path.end());
+    if (duration) {
+      *duration = last == kNoNode ? Timespan::zero() : path_durations[last];
+    }
+    return path;
+  }
+
+ private:
+  struct Node {
+    Closure closure;
+    std::string name;
+    std::vector<NodeId> successors;
+    size_t predecessor_count = 0;
+  };
+
+  void PostNode(NodeId id) {
+    task_runner_->PostTask([this, id]() { RunNode(id); });
+  }
+
+  // Runs the node |id|, then the first of its successors which it made ready,
+  // and so on, posting the others.
+  void RunNode(NodeId id) {
+    static constexpr NodeId kNoNode = std::numeric_limits<NodeId>::max();
+
+    while (id != kNoNode) {
+      Node& node = nodes_[id];
+      NodeTiming& timing = timings_[id];
+      timing.start_time = Clock::now() - run_start_time_;
+      node.closure();
+      timing.finish_time = Clock::now() - run_start_time_;
+
+      NodeId next = kNoNode;
+      for (NodeId successor : node.successors) {
+        if (pending_predecessor_counts_[successor].fetch_sub(
+                1, std::memory_order_acq_rel) == 1) {
+          if (next == kNoNode) {
+            next = successor;
+          } else {
+            PostNode(successor);
+          }
+        }
+      }
+
+      // Makes the timings of every node visible to whichever thread finishes
+      // the run.
+      if (remaining_node_count_.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        FinishRun();
+        return;
+      }
+      id = next;
+    }
+  }
+
+  void FinishRun() {
+    run_duration_ = Clock::now() - run_start_time_;
+    task_runner_.reset();
+
+    // The graph may run again, or be destroyed, as soon as it is no longer
+    // marked as running.
+    OnceClosure on_done = std::move(on_done_);
+    is_running_.store(false, std::memory_order_release);
+    if (on_done) {
+      on_done();
+    }
+  }
+
+  std::vector<Node> nodes_;
+  std::vector<NodeId> root_nodes_;
+  std::vector<NodeId> topological_order_;
+  bool is_built_ = false;
+
+  // State of the current run.
+  std::unique_ptr<std::atomic<size_t>[]> pending_predecessor_counts_;
+  std::atomic<size_t> remaining_node_count_{0};
+  std::atomic_bool is_running_{false};
+  std::shared_ptr<TaskRunner> task_runner_;
+  OnceClosure on_done_;
+  WaitGroup run_done_;
+  Clock::time_point run_start_time_;
+
+  // Timings of the last run, each only written by the thread running its node.
+  std::vector<NodeTiming> timings_;
+  Timespan run_duration_ = Timespan::zero();
+};
+
+}  // namespace util
+
+#endif /* DBBDAC16_A27A_4E91_9F2F_79222E992B39 */
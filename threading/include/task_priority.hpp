@@ -0,0 +1,26 @@
+#ifndef EB41DEBF_DBAC_4D38_BD6C_E2D4D8490457
+#define EB41DEBF_DBAC_4D38_BD6C_E2D4D8490457
+
+#include <cstddef>
+
+namespace util {
+
+// Priority class of a posted task. TaskRunners which support priorities serve
+// higher classes more often, without ever starving lower ones. Others treat
+// every task the same.
+enum class TaskPriority {
+  // Latency-critical work, such as control-plane messages.
+  kHigh,
+
+  // What PostTask() uses when no priority is given.
+  kNormal,
+
+  // Bulk work which may wait for everything else.
+  kBestEffort,
+};
+
+constexpr size_t kTaskPriorityCount = 3;
+
+}  // namespace util
+
+#endif /* EB41DEBF_DBAC_4D38_BD6C_E2D4D8490457 */
@@ -3,10 +3,20 @@
 
 #include <chrono>
 #include <future>
+#include <type_traits>
 #include <utility>
 
+#include "threading/include/future.hpp"
+#include "threading/include/task_priority.hpp"
+#include "util/include/once_closure.hpp"
+
 namespace util {
 
+#if defined(__cpp_impl_coroutine)
+class ScheduleAwaiter;
+class SleepAwaiter;
+#endif
+
 // A thread-safe API surface that allows for posting tasks. Posted tasks are
 // expected to be dispatched to executing threads in the order in which they are
 // posted via PostTask(). To phrase this differently, if A is posted to the
@@ -14,9 +24,14 @@ namespace util {
 // thread before B.
 // NOTE: This does NOT guarantee that if A was posted before B, then A will run
 // before B if A and B are dispatched to different threads. 
+//
+// Exceptions thrown by tasks are caught and discarded by the thread running
+// them, which moves on to the next task. Tasks which need to report errors
+// should do so themselves, or be posted with PostTaskAndReturn(), whose Future
+// holds the exception.
 class TaskRunner {
  public:
-  using Task = std::packaged_task<void()>;
+  using Task = OnceClosure;
   using Timespan = std::chrono::milliseconds;
 
   virtual ~TaskRunner() = default;
@@ -25,7 +40,22 @@ class TaskRunner {
   // etc.) that should be run at the first convenient time.
   template <typename Functor>
   inline void PostTask(Functor f) {
-    PostPackagedTask(Task(std::move(f)));
+    PostClosure(Task(std::move(f)));
+  }
+
+  // As PostTask(), but with the given |priority|. Tasks are only dispatched in
+  // the order in which they are posted within a priority.
+  template <typename Functor>
+  inline void PostTask(Functor f, TaskPriority priority) {
+    PostClosureWithPriority(Task(std::move(f)), priority, Timespan::max());
+  }
+
+  // As above, with a soft |deadline| from now. Once a task is past its
+  // deadline, the tasks of its priority get to run ahead of their turn until it
+  // did. There is no guarantee that it runs before the deadline.
+  template <typename Functor>
+  inline void PostTask(Functor f, TaskPriority priority, Timespan deadline) {
+    PostClosureWithPriority(Task(std::move(f)), priority, deadline);
   }
 
   // Takes any callable target (function, lambda-expression, std::bind result,
@@ -34,29 +64,83 @@ class TaskRunner {
   // system load. There is no deadline concept.
   template <typename Functor>
   inline void PostTaskWithDelay(Functor f, Timespan delay) {
-    PostPackagedTaskWithDelay(Task(std::move(f)), delay);
+    PostClosureWithDelay(Task(std::move(f)), delay);
+  }
+
+  // Posts |task| as PostTask() would, and returns the future of its result.
+  // Unlike PostTask(), this allocates shared state for the future, so should
+  // only be used when the result is actually needed.
+  template <typename TResult>
+  std::future<TResult> PostPackagedTask(std::packaged_task<TResult()> task) {
+    std::future<TResult> future = task.get_future();
+    PostClosure(Task(std::move(task)));
+    return future;
   }
 
+  // Posts |f| as PostTask() would, and returns a Future for its result, on
+  // which further work can be chained with Future::Then(). Costs a single
+  // allocation, and never blocks any thread.
+  template <typename Functor>
+  Future<typename std::result_of<Functor()>::type> PostTaskAndReturn(
+      Functor f) {
+    using TResult = typename std::result_of<Functor()>::type;
+
+    Promise<TResult> promise;
+    Future<TResult> future = promise.GetFuture();
+    PostClosure(Task(internal::ResultTask<void, TResult, Functor>(
+        internal::VoidValue(), std::move(promise), std::move(f))));
+    return future;
+  }
+
+#if defined(__cpp_impl_coroutine)
+  // Awaitables for C++20 coroutines. |co_await Schedule()| resumes the
+  // awaiting coroutine on this TaskRunner, as a task posted with PostTask().
+  // |co_await SleepFor(delay)| does the same no sooner than |delay| from now.
+  // Defined in threading/include/coroutine.hpp, which must be included to use
+  // them.
+  ScheduleAwaiter Schedule();
+  SleepAwaiter SleepFor(Timespan delay);
+#endif
+
   // Return true if the calling thread is a thread currently executing task
   // runner tasks.
   virtual bool IsRunningOnTaskRunner() const = 0;
 
+  // If the calling thread is one of the threads of this TaskRunner, runs some
+  // of the tasks waiting for a thread. Lets a task which waits for other tasks
+  // to finish keep the runner going rather than blocking one of its threads.
+  // Returns false if no task ran, which is always the case for implementations
+  // which cannot run tasks out of turn.
+  virtual bool RunPendingTask() {
+    return false;
+  }
+
  protected:
+  // Runs |task| as implementations should, discarding any exception it throws.
+  // Returns false if it threw one.
+  static bool RunTaskCatchingExceptions(Task& task) {
+    try {
+      task();
+      return true;
+    } catch (...) {
+      return false;
+    }
+  }
+
   // Implementations should provide the behavior explained in the comments above
   // for PostTask[WithDelay]().
-  virtual void PostPackagedTask(Task task) = 0;
-  virtual void PostPackagedTaskWithDelay(Task task, Timespan delay) = 0;
-};
-
-template <>
-inline void TaskRunner::PostTask(Task f) {
-  PostPackagedTask(std::move(f));
-}
+  virtual void PostClosure(Task task) = 0;
+  virtual void PostClosureWithDelay(Task task, Timespan delay) = 0;
 
-template<>
-inline void TaskRunner::PostTaskWithDelay(Task task, Timespan delay) {
-  PostPackagedTaskWithDelay(std::move(task), delay);
-}
+  // Implementations supporting priorities should override this to provide the
+  // behavior of the PostTask() overloads taking a TaskPriority. |deadline| is
+  // Timespan::max() if there is none.
+  virtual void PostClosureWithPriority(Task task,
+                                       TaskPriority /* priority */,
+                                       Timespan /* deadline */) {
+    PostClosure(std::move(task));
+  }
+};
 
 }  // namespace util
 
@@ -1,35 +1,68 @@
 #ifndef D5AB2FA6_BE5C_4404_BC22_2A4FC8636FDE
 #define D5AB2FA6_BE5C_4404_BC22_2A4FC8636FDE
 
-#include "include/task_runner.hpp"
+#include <memory>
+#include <thread>
+#include <utility>
+
+#include "threading/include/owning_task_runner.hpp"
+#include "threading/include/task_priority.hpp"
+#include "threading/include/task_runner.hpp"
+#include "threading/include/thread_pool_options.hpp"
 #include "threading/multithreaded_task_runner.hpp"
+#include "threading/sequenced_task_runner.hpp"
 #include "threading/single_threaded_task_runner.hpp"
 
 namespace util {
 
-template<size_t TFifoElementCount = size_t{1024}>
-std::shared_ptr<TaskRunner> CreateSingleThreadedTaskRunner() {
-  return std::make_shared<SingleThreadedTaskRunner<TFifoElementCount>>();
+// Creates a TaskRunner backed by a single thread of its own, which keeps
+// running until the runner is shut down.
+inline std::shared_ptr<OwningTaskRunner> CreateSingleThreadedTaskRunner() {
+  auto task_runner = std::make_shared<SingleThreadedTaskRunner>();
+  task_runner->OwnThread(std::thread([task_runner]() {
+    task_runner->LoopExecution();
+  }));
+
+  return task_runner;
 }
 
+// Creates a TaskRunner backed by |threads| threads, scheduled as described by
+// |options|, which keep running until the runner is shut down.
 template<size_t TFifoElementCount = size_t{1024}>
-std::shared_ptr<TaskRunner> CreateMultithreadedTaskRunner(int threads) {
+std::shared_ptr<OwningTaskRunner> CreateMultithreadedTaskRunner(
+    int threads, const ThreadPoolOptions& options = ThreadPoolOptions()) {
   if (threads <= 0) {
     return nullptr;
   }
 
   auto task_runner =
-      std::make_shared<MultithreadedTaskRunner<TFifoElementCount>>();
+      std::make_shared<MultithreadedTaskRunner<TFifoElementCount>>(
+          static_cast<size_t>(threads), options);
   for (int i = 0; i < threads; i++) {
-    std::thread thread([task_runner]() {
-      task_runner.LoopExecution();
-    });
-    thread.detach();
+    task_runner->OwnThread(std::thread([task_runner]() {
+      task_runner->LoopExecution();
+    }));
   }
 
   return task_runner;
 }
 
+// Creates a TaskRunner which runs tasks one at a time, in the order in which
+// they were posted, on the threads of |task_runner|, posting its runs with
+// |priority|. Sequences are cheap, so one can be created per object needing
+// ordered tasks, rather than a thread per object.
+template<size_t TFifoElementCount = size_t{32}>
+std::shared_ptr<TaskRunner> CreateSequencedTaskRunner(
+    std::shared_ptr<TaskRunner> task_runner,
+    TaskPriority priority = TaskPriority::kNormal) {
+  if (!task_runner) {
+    return nullptr;
+  }
+
+  return std::make_shared<SequencedTaskRunner<TFifoElementCount>>(
+      std::move(task_runner), priority);
+}
+
 }  // namespace util
 
 #endif /* D5AB2FA6_BE5C_4404_BC22_2A4FC8636FDE */
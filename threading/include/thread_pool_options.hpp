@@ -0,0 +1,147 @@
+#ifndef B48C6BB2_9256_41BA_8B66_CB208FEB9E64
+#define B48C6BB2_9256_41BA_8B66_CB208FEB9E64
+
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "threading/include/task_priority.hpp"
+
+namespace util {
+
+// How a multithreaded TaskRunner distributes tasks between its threads.
+enum class SchedulingMode {
+  // All threads take tasks from a single shared FIFO.
+  kSharedQueue,
+
+  // Each thread owns a deque which receives the tasks posted from that thread,
+  // while tasks posted from any other thread go to a shared injection queue.
+  // Idle threads steal from the deques of randomly chosen other threads. Best
+  // when tasks themselves post many further tasks.
+  kWorkStealing,
+};
+
+// What a thread of a multithreaded TaskRunner does when it runs out of tasks.
+enum class IdleStrategy {
+  // Sleeps for a short fixed time, then checks again.
+  kSleep,
+
+  // Spins, then keeps yielding to other threads. Lowest latency, but keeps a
+  // core busy for as long as the thread is idle.
+  kSpin,
+
+  // Spins briefly, then yields for a while, then blocks until a task is
+  // posted. Posting a task only pays for a wake-up when a thread is blocked.
+  kSpinThenPark,
+};
+
+// Where the threads of a multithreaded TaskRunner may run.
+enum class ThreadPlacement {
+  // Wherever the OS schedules them.
+  kNone,
+
+  // Each thread is pinned to a single CPU, going round the allowed CPUs.
+  kCpus,
+
+  // Threads are spread evenly over the NUMA nodes of the allowed CPUs, and each
+  // may run on any allowed CPU of its node. Tasks posted from a thread stay on
+  // its node while threads there keep up with them: in SchedulingMode
+  // kSharedQueue each node gets a FIFO of its own for TaskPriority::kNormal
+  // tasks posted by its threads, and threads which run out of tasks take those
+  // of their own node before those of other nodes, in either SchedulingMode.
+  kNumaNodes,
+};
+
+// Options for CreateMultithreadedTaskRunner().
+struct ThreadPoolOptions {
+  SchedulingMode scheduling_mode = SchedulingMode::kSharedQueue;
+  IdleStrategy idle_strategy = IdleStrategy::kSpinThenPark;
+
+  // Relative share of task batches given to each TaskPriority, indexed by
+  // priority, while tasks of several priorities are waiting. Weights of zero
+  // are treated as one, such that no priority can be starved.
+  std::array<uint32_t, kTaskPriorityCount> priority_weights = {{8, 4, 1}};
+
+  ThreadPlacement thread_placement = ThreadPlacement::kNone;
+
+  // CPUs threads may be placed on, unless empty, in which case threads may be
+  // placed on any CPU the process may run on. Ignored with
+  // ThreadPlacement::kNone.
+  std::vector<int> cpus;
+
+  // Threads are named "<thread_name_prefix>-<index>", such that they can be
+  // told apart in profilers, unless empty.
+  std::string thread_name_prefix = "worker";
+
+  // Elastic sizing. Unless |max_threads| is larger than the thread count given
+  // to CreateMultithreadedTaskRunner(), the pool keeps a fixed size. Otherwise
+  // that count is the minimum, and a thread is added whenever more than
+  // |scale_up_queue_depth| tasks per thread are waiting, or the tasks last run
+  // waited longer than |scale_up_wait_time|, at most once per
+  // |scale_up_interval|. Threads beyond the minimum retire once idle for
+  // |idle_timeout|, but never within |idle_timeout| of the last resize, such
+  // that a pool which just grew does not shrink right back.
+  size_t max_threads = 0;
+  size_t scale_up_queue_depth = 32;
+  std::chrono::milliseconds scale_up_wait_time{5};
+  std::chrono::milliseconds scale_up_interval{10};
+  std::chrono::milliseconds idle_timeout{1000};
+};
+
+// Counters of what the threads of a multithreaded TaskRunner did while idle,
+// accumulated over the lifetime of the runner.
+struct IdleStats {
+  // Number of times an idle thread spun, yielded, slept or blocked before
+  // checking for tasks again.
+  uint64_t spins = 0;
+  uint64_t yields = 0;
+  uint64_t sleeps = 0;
+  uint64_t parks = 0;
+
+  // Number of times posting a task woke up a blocked thread.
+  uint64_t wakeups = 0;
+
+  // Total time threads spent blocked.
+  std::chrono::nanoseconds parked_time{0};
+};
+
+// Size of an elastic multithreaded TaskRunner, and counters of its resizes,
+// accumulated over the lifetime of the runner.
+struct ResizeStats {
+  // Number of threads currently running tasks, and the most there ever were.
+  size_t thread_count = 0;
+  size_t peak_thread_count = 0;
+
+  // Number of threads added because of the queue depth or the wait time of
+  // tasks, counting the queue depth if both were past their threshold.
+  uint64_t threads_added_for_queue_depth = 0;
+  uint64_t threads_added_for_wait_time = 0;
+
+  // Number of threads which retired for being idle.
+  uint64_t threads_retired = 0;
+};
+
+// Counters of the tasks of one TaskPriority of a multithreaded TaskRunner,
+// accumulated over the lifetime of the runner.
+struct TaskPriorityStats {
+  // Number of tasks currently waiting to run.
+  size_t queue_depth = 0;
+
+  // Number of tasks which started running, and how long they waited for it in
+  // total and at most.
+  uint64_t tasks_run = 0;
+  std::chrono::nanoseconds total_wait_time{0};
+  std::chrono::nanoseconds max_wait_time{0};
+
+  // Number of times tasks were run ahead of their turn because one of them was
+  // past its deadline, and number of tasks which started after their deadline.
+  uint64_t deadline_jumps = 0;
+  uint64_t missed_deadlines = 0;
+};
+
+}  // namespace util
+
+#endif /* B48C6BB2_9256_41BA_8B66_CB208FEB9E64 */
@@ -0,0 +1,72 @@
+#ifndef A58E5029_7940_4BC4_AE52_803E8CA2A03D
+#define A58E5029_7940_4BC4_AE52_803E8CA2A03D
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <mutex>
+
+#include "threading/include/task_runner.hpp"
+
+namespace util {
+
+// Counter of outstanding work which a thread can wait on, for fork-join
+// parallelism. Add() before forking work, Done() once each piece finished,
+// then Wait().
+//
+// Done() only takes the lock when the count drops to zero, and Wait() always
+// returns with the lock taken and released, such that a WaitGroup may be
+// destroyed as soon as Wait() returned, even though the last Done() is still
+// on its way out.
+class WaitGroup {
+ public:
+  explicit WaitGroup(size_t count = 0) : count_(count) {}
+  ~WaitGroup() = default;
+
+  WaitGroup(const WaitGroup& other) = delete;
+  WaitGroup& operator=(const WaitGroup& other) = delete;
+
+  void Add(size_t count = 1) {
+    count_.fetch_add(count, std::memory_order_relaxed);
+  }
+
+  void Done() {
+    size_t count = count_.load(std::memory_order_relaxed);
+    while (count > 1) {
+      if (count_.compare_exchange_weak(count, count - 1,
+                                       std::memory_order_release,
+                                       std::memory_order_relaxed)) {
+        return;
+      }
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (count_.fetch_sub(1, std::memory_order_release) == 1) {
+      condition_.notify_all();
+    }
+  }
+
+  // Blocks until the count is zero. Meanwhile, if the calling thread is one of
+  // the threads of |task_runner|, runs its pending tasks for as long as there
+  // are any, such that waiting never takes a thread away from the runner
+  // while there is work to do.
+  void Wait(TaskRunner* task_runner = nullptr) {
+    while (task_runner && count_.load(std::memory_order_acquire) != 0 &&
+           task_runner->RunPendingTask()) {
+    }
+
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (count_.load(std::memory_order_acquire) != 0) {
+      condition_.wait(lock);
+    }
+  }
+
+ private:
+  std::atomic<size_t> count_;
+  std::mutex mutex_;
+  std::condition_variable condition_;
+};
+
+}  // namespace util
+
+#endif /* A58E5029_7940_4BC4_AE52_803E8CA2A03D */
@@ -2,30 +2,103 @@
 #define D56B62A1_1E8A_4102_B97A_345B93505BE1
 
 #include <algorithm>
+#include <array>
 #include <atomic>
 #include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <functional>
 #include <future>
+#include <iterator>
+#include <limits>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <string>
 #include <thread>
 #include <utility>
 #include <vector>
 
+#include "threading/event_count.hpp"
+#include "threading/include/cpu_topology.hpp"
 #include "threading/include/nearly_lockless_fifo.hpp"
+#include "threading/include/owning_task_runner.hpp"
+#include "threading/include/task_priority.hpp"
 #include "threading/include/task_runner.hpp"
+#include "threading/include/thread_pool_options.hpp"
+#include "threading/shutdown_state.hpp"
+#include "threading/timer_wheel.hpp"
+#include "threading/work_stealing_deque.hpp"
+#include "util/include/compiler_hints.hpp"
 
 namespace util {
 
 // High-performance implementation of TaskRunner for the use case of multiple
 // producer threads and multiple consumer threads.
 //
-// Tasks are stored in a "nearly-lockless" FIFO of size |TFifoElementCount|,
-// which is expected to never have contention for a mutex, while delayed tasks
-// are protected by a mutex and regularly enqueued into the underlying |data_|
-// FIFO.
-template<size_t TFifoElementCount>
-class MultithreadedTaskRunner : public TaskRunner {
+// Tasks are stored in "nearly-lockless" FIFOs of size |TFifoElementCount|, one
+// per TaskPriority, which are expected to never have contention for a mutex,
+// while delayed tasks are held in a TimerWheel protected by a mutex. Worker
+// threads move expired delayed tasks into the kNormal FIFO whenever they run
+// out of work, and every few batches of tasks otherwise.
+//
+// With SchedulingMode::kWorkStealing, each of the first |worker_count| threads
+// to call LoopExecution() additionally owns a WorkStealingDeque. Tasks posted
+// from such a thread with TaskPriority::kNormal go to its own deque, and the
+// kNormal FIFO only receives tasks posted from other threads. Threads which run
+// out of tasks steal from the deques of other threads. Every deque is consumed
+// from the top, such that tasks posted by any one thread are still dispatched
+// in the order they were posted.
+//
+// Threads pick the FIFO to take their next batch of tasks from by smooth
+// weighted round-robin over the priorities with tasks waiting, using the
+// weights in the ThreadPoolOptions, such that every priority with tasks gets a
+// turn at least once per sum-of-weights batches. Tasks posted with a deadline
+// are additionally indexed by deadline, and once past it jump ahead of both the
+// round-robin and the tasks queued before them, for at most
+// |kMaxConsecutiveDeadlinePicks| batches in a row.
+//
+// Each thread calling LoopExecution() takes the next index, by which it is named
+// and placed as selected by the ThreadPlacement in the ThreadPoolOptions. With
+// ThreadPlacement::kNumaNodes on a machine with several nodes, threads claim a
+// Worker on their own node, and in kSharedQueue mode post kNormal tasks to the
+// FIFO of their node, which they take tasks from before the shared one. Idle
+// threads steal from the Workers or FIFOs of their own node first.
+//
+// Threads which run out of work behave as selected by the IdleStrategy in the
+// ThreadPoolOptions. With IdleStrategy::kSpinThenPark they eventually block on
+// |work_available_|, waking up early for the next delayed task.
+//
+// With |max_threads| set in the ThreadPoolOptions, the pool is elastic. Threads
+// which ran a full round of batches without running out of tasks, and threads
+// posting from outside the pool, check whether to add a thread at most once per
+// |scale_up_interval|, comparing the number of queued tasks and the wait of the
+// last batches run against their thresholds under |executing_threads_lock_|.
+// Idle threads retire by returning from LoopExecution(), no sooner than
+// |idle_timeout| after both their last task and the last resize.
+//
+// Once shut down, threads check whether to stop before each batch of tasks, and
+// return from LoopExecution() as soon as they find no task while draining.
+// Each thread tallies the tasks it ran, and adds them to |run_task_count_| when
+// it returns, such that counting costs nothing while running.
+//
+// |TConsumerPolicy| should be SingleConsumer if only one thread will ever call
+// LoopExecution(), such that dequeuing tasks does not require a CAS.
+//
+// Objects must be owned by a std::shared_ptr to be elastic, as the threads they
+// add keep them alive.
+template<size_t TFifoElementCount, typename TConsumerPolicy = MultiConsumer>
+class MultithreadedTaskRunner
+    : public OwningTaskRunner,
+      public std::enable_shared_from_this<
+          MultithreadedTaskRunner<TFifoElementCount, TConsumerPolicy>> {
  public:
- 	MultithreadedTaskRunner();
- 	~MultithreadedTaskRunner() override = default;
+ 	explicit MultithreadedTaskRunner(
+ 			size_t worker_count = 1,
+ 			const ThreadPoolOptions& options = ThreadPoolOptions());
+ 	~MultithreadedTaskRunner() override;
   
   MultithreadedTaskRunner(const MultithreadedTaskRunner& other) = delete;
   MultithreadedTaskRunner(MultithreadedTaskRunner&& other) = delete;
@@ -35,45 +108,493 @@ class MultithreadedTaskRunner : public TaskRunner {
   virtual void LoopExecution();
 
 	// TaskRunner implementation.
-	void PostPackagedTask(Task task) final;
-	void PostPackagedTaskWithDelay(Task task, Timespan delay) final;
+	void PostClosure(Task task) final;
+	void PostClosureWithDelay(Task task, Timespan delay) final;
+	void PostClosureWithPriority(Task task, TaskPriority priority,
+	                             Timespan deadline) final;
 	bool IsRunningOnTaskRunner() const override;
+	bool RunPendingTask() override;
+
+	// OwningTaskRunner implementation.
+	void Shutdown(ShutdownMode mode,
+	              Timespan timeout = Timespan::zero()) override;
+
+	IdleStats idle_stats() const;
+
+	// NOTE: Tasks which a thread posted to its own work-stealing deque only count
+	// towards the |queue_depth| of TaskPriority::kNormal.
+	TaskPriorityStats priority_stats(TaskPriority priority) const;
+
+	ResizeStats resize_stats() const;
+
+ protected:
+	ShutdownStats FinishShutdown() override;
 
  private:
- 	using DelayedTask =
- 			std::pair<Task, std::chrono::time_point<std::chrono::system_clock>>;
+	struct Worker;
+
+	// Heap cell holding a task in a work-stealing deque. Cells go back to the
+	// Worker which allocated them once run, by whichever thread ran them, such
+	// that posting to a deque does not allocate in the steady state.
+	struct TaskCell {
+		Task task;
+		Worker* owner;
+		TaskCell* next_free;
+	};
+
+	// State of a thread running LoopExecution() in work-stealing mode.
+	struct Worker {
+		Worker(MultithreadedTaskRunner* runner, size_t node)
+				: runner(runner), node(node) {}
+		~Worker();
+
+		MultithreadedTaskRunner* const runner;
+
+		// Index of the NUMA node of the threads which may claim this Worker.
+		const size_t node;
+
+		WorkStealingDeque<TaskCell*> tasks;
+
+		// Whether a thread currently owns |tasks|.
+		std::atomic_bool is_claimed{false};
+
+		// Cells ready for reuse. |free_cells| is only accessed by the owning
+		// thread, while other threads push to |returned_cells|, which the owner
+		// takes all at once. Like |tasks|, these never shrink.
+		TaskCell* free_cells = nullptr;
+		std::atomic<TaskCell*> returned_cells{nullptr};
+	};
+
+	static constexpr int64_t kNoDeadline = std::numeric_limits<int64_t>::max();
+
+	static constexpr size_t kNormalPriority =
+			static_cast<size_t>(TaskPriority::kNormal);
+
+	struct DeadlineTask;
+	using DeadlineIndex = std::multimap<int64_t, DeadlineTask*>;
+
+	// Task waiting in a PriorityClass, along with the steady_clock time at which
+	// it was posted, as a duration since epoch. Tasks with a deadline are held
+	// in |deadline_task| instead of |task|.
+	struct QueuedTask {
+		Task task;
+		int64_t post_time;
+		std::unique_ptr<DeadlineTask> deadline_task;
+	};
+
+	// Task posted with a deadline. Owned by its QueuedTask, and also listed in
+	// the |deadline_index| of its PriorityClass until taken, either in FIFO order
+	// or for being overdue, whichever comes first. Only accessed under the
+	// |deadlines_lock| of its PriorityClass.
+	struct DeadlineTask {
+		Task task;
+		int64_t post_time;
+		int64_t deadline;
+		bool is_taken;
+		typename DeadlineIndex::iterator position;
+	};
+
+	// Tasks of one TaskPriority, and the counters backing priority_stats().
+	struct PriorityClass {
+		NearlyLocklessFifo<QueuedTask, TFifoElementCount, PaddedCountersLayout,
+		                   MultiProducer, TConsumerPolicy> tasks;
+
+		// Tasks in |tasks| with a deadline which were not taken yet.
+		// |earliest_deadline| mirrors the first deadline, such that the lock is
+		// only taken for tasks with a deadline.
+		DeadlineIndex deadline_index;
+		std::mutex deadlines_lock;
+		std::atomic<int64_t> earliest_deadline{kNoDeadline};
+
+		// Wait times are in steady_clock ticks.
+		std::atomic<uint64_t> tasks_run{0};
+		std::atomic<int64_t> total_wait_ticks{0};
+		std::atomic<int64_t> max_wait_ticks{0};
+		std::atomic<uint64_t> deadline_jumps{0};
+		std::atomic<uint64_t> missed_deadlines{0};
+
+		// Longest wait in the last batch run, which elastic pools grow on.
+		std::atomic<int64_t> last_wait_ticks{0};
+	};
+
+	// Where the thread with a given index may run.
+	struct ThreadSlot {
+		std::vector<int> cpus;
+		size_t node;
+	};
+
+	// kNormal tasks posted by the threads of one NUMA node.
+	struct NodeQueue {
+		explicit NodeQueue(MultithreadedTaskRunner* runner) : runner(runner) {}
+
+		// |tasks| is aligned to the cache line, which a plain new only honours
+		// from C++17 on.
+		static void* operator new(size_t size) {
+			void* memory = nullptr;
+			if (posix_memalign(&memory, alignof(NodeQueue), size) != 0) {
+				throw std::bad_alloc();
+			}
+			return memory;
+		}
+
+		static void operator delete(void* memory) {
+			free(memory);
+		}
+
+		MultithreadedTaskRunner* const runner;
+		NearlyLocklessFifo<QueuedTask, TFifoElementCount, PaddedCountersLayout,
+		                   MultiProducer, TConsumerPolicy> tasks;
+	};
+
+	// State of a thread running LoopExecution(), used to pick the PriorityClass
+	// of its next batch.
+	struct PrioritySelector {
+		// Smooth weighted round-robin credit of each priority.
+		int64_t credits[kTaskPriorityCount] = {};
+
+		// Number of batches of overdue tasks run in a row.
+		size_t deadline_picks = 0;
+	};
+
+	// Maximum number of batches of overdue tasks a thread may run in a row, such
+	// that a stream of overdue tasks cannot starve all others.
+	static constexpr size_t kMaxConsecutiveDeadlinePicks = 4;
+
+	// Maximum number of tasks taken from a PriorityClass by a single worker at
+	// once. Kept small such that a burst of tasks is still spread across all
+	// workers.
+	static constexpr size_t kMaxTaskBatchSize = 8;
+
+	// Number of task batches a worker may run in a row before checking for
+	// expired delayed tasks, such that a steady stream of tasks cannot starve
+	// them.
+	static constexpr size_t kBatchesPerDelayedTaskCheck = 16;
+
+	// Posts every delayed task whose delay has passed, unless another thread is
+	// already doing so. Returns the number of tasks posted.
+	size_t PostExpiredDelayedTasks();
+
+	// Idle strategy tuning. Each idle round either spins |kSpinsPerIdleRound|
+	// times, yields once, or blocks, before checking for tasks again.
+	static constexpr size_t kIdleSpinRounds = 16;
+	static constexpr size_t kSpinsPerIdleRound = 64;
+	static constexpr size_t kIdleYieldRounds = 16;
+
+	// Called after the |idle_rounds|-th consecutive check for tasks came up
+	// empty. Waits as selected by |idle_strategy_|, but no later than
+	// |wake_up_time|, in steady_clock ticks.
+	void WaitForWork(size_t idle_rounds, int64_t wake_up_time);
+	void Park(int64_t wake_up_time);
+
+	bool is_elastic() const {
+		return max_thread_count_ != 0;
+	}
+
+	// Adds a thread if the pool is elastic, lags behind its tasks and was not
+	// checked within |scale_up_interval_ticks_| of |now|.
+	void MaybeAddThread(int64_t now);
+
+	// Returns true if the calling thread, idle since |idle_since|, should retire.
+	// Once the idle timeout passed, restarts it by updating |idle_since|.
+	bool TryRetireThread(int64_t& idle_since);
+
+	// Number of tasks waiting in any queue.
+	size_t QueuedTaskCount() const;
 
-	void EnqueDelayedTasks();
-	bool TryExecuteTask();
+	// Returns true if a task may be available. May spuriously return true, but
+	// never false after a task was posted and notified.
+	bool HasPendingWork() const;
+
+	// Wakes up a parked thread, if any.
+	void NotifyWorker();
+
+	// Runs the next batch of tasks, using |batch| as scratch space. |worker| is
+	// the calling thread's Worker, if any. Returns the number of tasks run, zero
+	// if no task was available.
+	size_t TryExecuteTasks(Worker* worker, PrioritySelector& selector,
+	                     std::vector<QueuedTask>& batch);
+
+	// Returns the priority to take the next batch from by weighted round-robin,
+	// out of those for which |has_tasks| is true, of which there must be at
+	// least one.
+	size_t SelectPriority(PrioritySelector& selector,
+	                      const bool (&has_tasks)[kTaskPriorityCount]);
+
+	// Runs a batch of tasks of |priority| in FIFO order, or of overdue tasks of
+	// the highest priority having any. Return the number of tasks run, zero if
+	// there were none.
+	size_t TryExecuteTasksOfPriority(Worker* worker, size_t priority,
+	                                 std::vector<QueuedTask>& batch);
+	size_t TryExecuteNodeTasks(NodeQueue& node_queue,
+	                           std::vector<QueuedTask>& batch);
+	size_t TryExecuteOverdueTasks(std::vector<QueuedTask>& batch);
+
+	// Moves the tasks of the DeadlineTasks in |batch| which were not taken yet
+	// to their QueuedTask, then updates the counters of |priority_class|.
+	static void OnTasksDequeued(PriorityClass& priority_class,
+	                            std::vector<QueuedTask>& batch);
+
+	// Updates the counters of |priority_class| for the |count| tasks in |batch|
+	// about to be run at |now|, of which |missed_deadlines| are overdue.
+	static void RecordTasksRun(PriorityClass& priority_class,
+	                           const std::vector<QueuedTask>& batch,
+	                           int64_t now, uint64_t count,
+	                           uint64_t missed_deadlines);
+
+	// Runs every task in |batch|, then clears it. Returns the number of tasks
+	// run, leaving out those of DeadlineTasks which had already been taken.
+	size_t RunTasks(std::vector<QueuedTask>& batch);
+
+	// Keeps |earliest_deadline| of |priority_class| in sync with its
+	// |deadline_index|. Must be called with the |deadlines_lock| held.
+	static void UpdateEarliestDeadline(PriorityClass& priority_class);
+
+	void EnqueueTask(Task task, size_t priority, int64_t post_time,
+	                 int64_t deadline);
+
+	static int64_t Now() {
+		return TimerWheel<Task>::Clock::now().time_since_epoch().count();
+	}
+
+	static int64_t ToTicks(std::chrono::milliseconds duration) {
+		return std::chrono::duration_cast<TimerWheel<Task>::Clock::duration>(
+				duration).count();
+	}
+
+	// Fills |thread_slots_| as selected by |options|.
+	void PlanThreadSlots(size_t thread_count, const ThreadPoolOptions& options);
+
+	// Returns the NodeQueue of the current thread, if it has one.
+	NodeQueue* LocalNodeQueue() const;
+
+	// Work-stealing helpers. ClaimWorker() prefers Workers of |node|, and
+	// returns nullptr if every Worker is already owned by a thread.
+	// ReleaseWorker() moves any tasks left in |worker| to the kNormal FIFO, such
+	// that they are not stranded. TryStealTask() and TryStealNodeTasks() look at
+	// the Workers or NodeQueues of the node of the current thread first.
+	Worker* ClaimWorker(size_t node);
+	void ReleaseWorker(Worker* worker);
+	size_t TryStealTask(Worker* thief);
+	size_t TryStealNodeTasks(std::vector<QueuedTask>& batch);
+
+	// TaskCell management. AllocateTaskCell() must be called by the thread
+	// owning |worker|, while FreeTaskCell() may be called from any thread.
+	static TaskCell* AllocateTaskCell(Worker* worker, Task task);
+	static void FreeTaskCell(TaskCell* cell);
+	static void DeleteTaskCells(TaskCell* cell);
+
+	// Runs the task in |cell|, then frees |cell|.
+	void RunTask(TaskCell* cell);
+
+	// Returns a cheap pseudo-random number, used to pick steal victims.
+	static uint32_t NextRandom();
+
+	// Worker of the current thread. Compared against |this| before use, as the
+	// thread may be running LoopExecution() for another instance.
+	static thread_local Worker* current_worker_;
+
+	// NodeQueue of the current thread. Compared against |this| before use, like
+	// |current_worker_|.
+	static thread_local NodeQueue* current_node_queue_;
+
+	// Runner whose LoopExecution() the current thread is in, if any.
+	static thread_local const MultithreadedTaskRunner* current_runner_;
+
+	const IdleStrategy idle_strategy_;
+
+	// Never zero.
+	std::array<uint32_t, kTaskPriorityCount> priority_weights_;
+
+	// Empty unless in work-stealing mode.
+	std::vector<std::unique_ptr<Worker>> workers_;
+
+	// Elastic sizing. |max_thread_count_| is zero unless elastic. Times are in
+	// steady_clock ticks.
+	const size_t min_thread_count_;
+	const size_t max_thread_count_;
+	const size_t scale_up_queue_depth_;
+	const int64_t scale_up_wait_ticks_;
+	const int64_t scale_up_interval_ticks_;
+	const int64_t idle_timeout_ticks_;
+	std::atomic<int64_t> next_scale_up_check_{0};
+	std::atomic<int64_t> last_resize_time_{0};
+
+	// Counters backing resize_stats().
+	std::atomic<uint64_t> threads_added_for_queue_depth_{0};
+	std::atomic<uint64_t> threads_added_for_wait_time_{0};
+	std::atomic<uint64_t> threads_retired_{0};
+
+	// Indexed by thread index, modulo its size. Empty with ThreadPlacement::kNone.
+	std::vector<ThreadSlot> thread_slots_;
+	std::atomic<size_t> next_thread_index_{0};
+	const std::string thread_name_prefix_;
+
+	// Number of NUMA nodes threads are placed on. One unless placed with
+	// ThreadPlacement::kNumaNodes.
+	size_t node_count_ = 1;
+
+	// Indexed by node. Empty unless threads are placed on several nodes in
+	// kSharedQueue mode.
+	std::vector<std::unique_ptr<NodeQueue>> node_queues_;
 
 	// Tracks what threads are currently being used by this TaskRunner.
+	// |threads_exited_| is notified once none are left. Threads added by an
+	// elastic pool count as starting until they are in |executing_threads_|,
+	// and threads which decided to retire count as retiring until they are out.
 	std::vector<std::thread::id> executing_threads_;
  	mutable std::mutex executing_threads_lock_;
- 	std::atomic_bool is_running_{false};
+ 	std::condition_variable threads_exited_;
+ 	size_t starting_thread_count_ = 0;
+ 	size_t retiring_thread_count_ = 0;
+ 	size_t peak_thread_count_ = 0;
+
+ 	ShutdownState shutdown_state_;
+ 	std::atomic<uint64_t> run_task_count_{0};
+ 	std::atomic<uint64_t> dropped_task_count_{0};
+ 	std::atomic<uint64_t> failed_task_count_{0};
 
-	// Set of tasks posted with PostTaskWithDelay().
- 	std::vector<DelayedTask> delayed_tasks_;
+	// Set of tasks posted with PostTaskWithDelay(). |delayed_task_count_|
+	// mirrors |delayed_tasks_.size()|, such that workers can skip taking the
+	// lock when there are none, and |next_delayed_task_time_| mirrors
+	// |delayed_tasks_.next_expiry()|, as a steady_clock duration since epoch.
+ 	TimerWheel<Task> delayed_tasks_;
  	std::mutex delayed_tasks_lock_;
+ 	std::atomic<size_t> delayed_task_count_{0};
+ 	std::atomic<int64_t> next_delayed_task_time_{
+ 			TimerWheel<Task>::TimePoint::max().time_since_epoch().count()};
 
- 	NearlyLocklessFifo<Task, TFifoElementCount> task_queue_;
+	// Indexed by TaskPriority.
+	PriorityClass priority_classes_[kTaskPriorityCount];
 
-	// Mutex used for the condition variable for waiting when no work is
-	// available. In the expected case, this should never be used.
-	std::mutex queue_empty_mutex_;
-	std::condition_variable queue_empty_cv_;
+	// Used by parked threads to wait for tasks. In the expected case, where
+	// tasks keep flowing, no thread ever gets to park.
+	EventCount work_available_;
+
+	// Counters backing idle_stats().
+	std::atomic<uint64_t> idle_spins_{0};
+	std::atomic<uint64_t> idle_yields_{0};
+	std::atomic<uint64_t> idle_sleeps_{0};
+	std::atomic<uint64_t> idle_parks_{0};
+	std::atomic<uint64_t> wakeups_{0};
+	std::atomic<int64_t> parked_nanoseconds_{0};
 };
 
-template<size_t TFifoElementCount>
-MultithreadedTaskRunner<TFifoElementCount>::MultithreadedTaskRunner() {
+template<size_t TFifoElementCount, typename TConsumerPolicy>
+thread_local typename MultithreadedTaskRunner<TFifoElementCount,
+                                              TConsumerPolicy>::Worker*
+		MultithreadedTaskRunner<TFifoElementCount, TConsumerPolicy>
+				::current_worker_ = nullptr;
+
+template<size_t TFifoElementCount, typename TConsumerPolicy>
+thread_local typename MultithreadedTaskRunner<TFifoElementCount,
+                                              TConsumerPolicy>::NodeQueue*
+		MultithreadedTaskRunner<TFifoElementCount, TConsumerPolicy>
+				::current_node_queue_ = nullptr;
+
+template<size_t TFifoElementCount, typename TConsumerPolicy>
+thread_local const MultithreadedTaskRunner<TFifoElementCount, TConsumerPolicy>*
+		MultithreadedTaskRunner<TFifoElementCount, TConsumerPolicy>
+				::current_runner_ = nullptr;
+
+template<size_t TFifoElementCount, typename TConsumerPolicy>
+MultithreadedTaskRunner<TFifoElementCount, TConsumerPolicy>
+		::MultithreadedTaskRunner(size_t worker_count,
+		                          const ThreadPoolOptions& options)
+		: idle_strategy_(options.idle_strategy),
+		  priority_weights_(options.priority_weights),
+		  min_thread_count_(worker_count),
+		  max_thread_count_(
+		  		options.max_threads > worker_count ? options.max_threads : 0),
+		  scale_up_queue_depth_(options.scale_up_queue_depth),
+		  scale_up_wait_ticks_(ToTicks(options.scale_up_wait_time)),
+		  scale_up_interval_ticks_(ToTicks(options.scale_up_interval)),
+		  idle_timeout_ticks_(ToTicks(options.idle_timeout)),
+		  thread_name_prefix_(options.thread_name_prefix) {
 	static_assert(TFifoElementCount > size_t{16});
 
-	PostTask([this]() {
-		EnqueDelayedTasks();
-	});
+	for (uint32_t& weight : priority_weights_) {
+		weight = std::max(weight, uint32_t{1});
+	}
+
+	// Plan for the largest the pool may get.
+	const size_t thread_count =
+			std::max(std::max(worker_count, max_thread_count_), size_t{1});
+	if (options.thread_placement != ThreadPlacement::kNone) {
+		PlanThreadSlots(thread_count, options);
+	}
+
+	if (options.scheduling_mode == SchedulingMode::kWorkStealing) {
+		workers_.reserve(thread_count);
+		for (size_t i = 0; i < thread_count; i++) {
+			workers_.emplace_back(new Worker(this, i % node_count_));
+		}
+	} else if (node_count_ > 1) {
+		node_queues_.reserve(node_count_);
+		for (size_t i = 0; i < node_count_; i++) {
+			node_queues_.emplace_back(new NodeQueue(this));
+		}
+	}
 }
 
-template<size_t TFifoElementCount>
-void MultithreadedTaskRunner<TFifoElementCount>::LoopExecution() {
+template<size_t TFifoElementCount, typename TConsumerPolicy>
+void MultithreadedTaskRunner<TFifoElementCount, TConsumerPolicy>
+		::PlanThreadSlots(size_t thread_count, const ThreadPoolOptions& options) {
+	std::vector<int> cpus = options.cpus;
+	if (cpus.empty()) {
+		cpus = GetCurrentThreadAffinity();
+	}
+	std::sort(cpus.begin(), cpus.end());
+	cpus.erase(std::unique(cpus.begin(), cpus.end()), cpus.end());
+	if (cpus.empty()) {
+		return;
+	}
+
+	if (options.thread_placement == ThreadPlacement::kCpus) {
+		for (size_t i = 0; i < thread_count; i++) {
+			thread_slots_.push_back(ThreadSlot{{cpus[i % cpus.size()]}, 0});
+		}
+		return;
+	}
+
+	// Only keep the nodes with CPUs threads may be placed on.
+	const CpuTopology topology = CpuTopology::Detect();
+	std::vector<std::vector<int>> node_cpus;
+	for (const NumaNode& node : topology.nodes()) {
+		std::vector<int> allowed_cpus;
+		std::set_intersection(node.cpus.begin(), node.cpus.end(), cpus.begin(),
+		                      cpus.end(), std::back_inserter(allowed_cpus));
+		if (!allowed_cpus.empty()) {
+			node_cpus.push_back(std::move(allowed_cpus));
+		}
+	}
+	if (node_cpus.empty()) {
+		node_cpus.push_back(cpus);
+	}
+
+	// Never leave a node without threads, as no thread would prefer its tasks.
+	node_count_ = std::min(node_cpus.size(), thread_count);
+	for (size_t i = 0; i < thread_count; i++) {
+		thread_slots_.push_back(ThreadSlot{node_cpus[i % node_count_],
+		                                   i % node_count_});
+	}
+}
+
+template<size_t TFifoElementCount, typename TConsumerPolicy>
+MultithreadedTaskRunner<TFifoElementCount, TConsumerPolicy>
+		::~MultithreadedTaskRunner() {
+	for (auto& worker : workers_) {
+		while (!worker->tasks.is_empty()) {
+			Optional<TaskCell*> cell = worker->tasks.Pop();
+			if (cell) {
+				delete cell.value();
+			}
+		}
+	}
+}
+
+template<size_t TFifoElementCount, typename TConsumerPolicy>
+void MultithreadedTaskRunner<TFifoElementCount, TConsumerPolicy>
+		::LoopExecution() {
 	const auto current_id = std::this_thread::get_id();
 
 	{
@@ -84,16 +605,91 @@ void MultithreadedTaskRunner<TFifoElementCount>::LoopExecution() {
 				}) == executing_threads_.end());
 
 		executing_threads_.push_back(current_id);
+		peak_thread_count_ = std::max(peak_thread_count_,
+		                              executing_threads_.size());
+		if (starting_thread_count_) {
+			starting_thread_count_--;
+		}
 	}
 
-	is_running_.store(true);
-	while(is_running_.load()) {
-		while (!TryExecuteTask()) {
-			// NOTE: Do not use std::condition_variable as would introduce contention
-			// for a mutex.
-			std::this_thread::sleep_for(std::chrono::microseconds(10));
+	const size_t thread_index =
+			next_thread_index_.fetch_add(1, std::memory_order_relaxed);
+	size_t node = 0;
+	if (!thread_slots_.empty()) {
+		const ThreadSlot& slot = thread_slots_[thread_index % thread_slots_.size()];
+		SetCurrentThreadAffinity(slot.cpus);
+		node = slot.node;
+	}
+	if (!thread_name_prefix_.empty()) {
+		SetCurrentThreadName(thread_name_prefix_ + "-" +
+		                     std::to_string(thread_index));
+	}
+
+	std::vector<QueuedTask> batch;
+	batch.reserve(kMaxTaskBatchSize);
+	PrioritySelector selector;
+
+	Worker* const worker = ClaimWorker(node);
+	Worker* const previous_worker = current_worker_;
+	current_worker_ = worker;
+
+	NodeQueue* const previous_node_queue = current_node_queue_;
+	current_node_queue_ =
+			node_queues_.empty() ? nullptr : node_queues_[node].get();
+
+	const MultithreadedTaskRunner* const previous_runner = current_runner_;
+	current_runner_ = this;
+
+	size_t idle_rounds = 0;
+	int64_t idle_since = 0;
+	bool is_retiring = false;
+	uint64_t run_task_count = 0;
+	while (!shutdown_state_.ShouldStop()) {
+		size_t batch_count = 0;
+		while (batch_count < kBatchesPerDelayedTaskCheck) {
+			const size_t count = TryExecuteTasks(worker, selector, batch);
+			if (!count) {
+				break;
+			}
+			run_task_count += count;
+			batch_count++;
+
+			if (!shutdown_state_.is_running() && shutdown_state_.ShouldStop()) {
+				break;
+			}
+		}
+
+		// Tasks keep coming faster than this thread runs them.
+		if (is_elastic() && batch_count == kBatchesPerDelayedTaskCheck) {
+			MaybeAddThread(Now());
+		}
+
+		if (PostExpiredDelayedTasks() || batch_count) {
+			idle_rounds = 0;
+		} else if (!shutdown_state_.is_running()) {
+			break;
+		} else {
+			int64_t wake_up_time = kNoDeadline;
+			if (is_elastic()) {
+				if (idle_rounds == 0) {
+					idle_since = Now();
+				} else if (TryRetireThread(idle_since)) {
+					is_retiring = true;
+					break;
+				}
+				wake_up_time = idle_since + idle_timeout_ticks_;
+			}
+			WaitForWork(idle_rounds++, wake_up_time);
 		}
 	}
+	run_task_count_.fetch_add(run_task_count, std::memory_order_relaxed);
+
+	current_worker_ = previous_worker;
+	current_node_queue_ = previous_node_queue;
+	current_runner_ = previous_runner;
+	if (worker) {
+		ReleaseWorker(worker);
+	}
 
 	{
 		const auto current_id = std::this_thread::get_id();
@@ -107,15 +703,89 @@ void MultithreadedTaskRunner<TFifoElementCount>::LoopExecution() {
 						});
 		assert(it != executing_threads_.end());
 		executing_threads_.erase(it);
+		if (is_retiring) {
+			retiring_thread_count_--;
+		}
+
+		if (executing_threads_.empty() && !starting_thread_count_) {
+			threads_exited_.notify_all();
+		}
+	}
+
+	if (is_retiring) {
+		ReleaseCurrentThread();
+	}
+}
+
+template<size_t TFifoElementCount, typename TConsumerPolicy>
+void MultithreadedTaskRunner<TFifoElementCount, TConsumerPolicy>
+		::Shutdown(ShutdownMode mode, Timespan timeout) {
+	shutdown_state_.Begin(mode, timeout);
+
+	// Whatever the IdleStrategy, as parked threads must notice.
+	work_available_.NotifyAll();
+}
+
+template<size_t TFifoElementCount, typename TConsumerPolicy>
+ShutdownStats MultithreadedTaskRunner<TFifoElementCount, TConsumerPolicy>
+		::FinishShutdown() {
+	{
+		std::unique_lock<std::mutex> lock(executing_threads_lock_);
+		threads_exited_.wait(lock, [this]() {
+			return executing_threads_.empty() && !starting_thread_count_;
+		});
+	}
+
+	// Drop whatever is posted from now on, then whatever was left. Tasks left in
+	// work-stealing deques were moved to the kNormal FIFO by ReleaseWorker().
+	shutdown_state_.Begin(ShutdownMode::kDropPending, Timespan::zero());
+	uint64_t dropped_task_count = 0;
+	{
+		std::lock_guard<std::mutex> lock(delayed_tasks_lock_);
+		dropped_task_count += delayed_tasks_.Clear();
+		delayed_task_count_.store(0, std::memory_order_relaxed);
+		next_delayed_task_time_.store(
+				TimerWheel<Task>::TimePoint::max().time_since_epoch().count(),
+				std::memory_order_relaxed);
+	}
+
+	for (PriorityClass& priority_class : priority_classes_) {
+		{
+			std::lock_guard<std::mutex> lock(priority_class.deadlines_lock);
+			priority_class.deadline_index.clear();
+			UpdateEarliestDeadline(priority_class);
+		}
 
-		if (executing_threads_.empty()) {
-			is_running_.store(false);
+		while (!priority_class.tasks.is_empty()) {
+			Optional<QueuedTask> queued_task = priority_class.tasks.Dequeue();
+			if (queued_task && (queued_task.value().task ||
+			                    !queued_task.value().deadline_task->is_taken)) {
+				dropped_task_count++;
+			}
 		}
 	}
+
+	for (auto& node_queue : node_queues_) {
+		while (!node_queue->tasks.is_empty()) {
+			if (node_queue->tasks.Dequeue()) {
+				dropped_task_count++;
+			}
+		}
+	}
+
+	ShutdownStats stats;
+	stats.tasks_run = run_task_count_.load(std::memory_order_relaxed);
+	stats.tasks_dropped =
+			dropped_task_count_.fetch_add(dropped_task_count,
+			                              std::memory_order_relaxed) +
+			dropped_task_count;
+	stats.tasks_failed = failed_task_count_.load(std::memory_order_relaxed);
+	return stats;
 }
 
-template<size_t TFifoElementCount>
-bool MultithreadedTaskRunner<TFifoElementCount>::IsRunningOnTaskRunner() const {
+template<size_t TFifoElementCount, typename TConsumerPolicy>
+bool MultithreadedTaskRunner<TFifoElementCount, TConsumerPolicy>
+		::IsRunningOnTaskRunner() const {
 	const auto current_id = std::this_thread::get_id();
 
 	std::lock_guard<std::mutex> lock(executing_threads_lock_);
@@ -125,69 +795,847 @@ bool MultithreadedTaskRunner<TFifoElementCount>::IsRunningOnTaskRunner() const {
 				}) != executing_threads_.end();
 }
 
-template<size_t TFifoElementCount>
-bool MultithreadedTaskRunner<TFifoElementCount>::TryExecuteTask() {
-	auto task = task_queue_.Dequeue();
-	if (!task) {
+template<size_t TFifoElementCount, typename TConsumerPolicy>
+bool MultithreadedTaskRunner<TFifoElementCount, TConsumerPolicy>
+		::RunPendingTask() {
+	if (current_runner_ != this) {
 		return false;
 	}
 
-	task.value()();
+	// The batch of LoopExecution() is still being run, so use fresh state.
+	Worker* worker = current_worker_;
+	PrioritySelector selector;
+	std::vector<QueuedTask> batch;
+	batch.reserve(kMaxTaskBatchSize);
+	const size_t count = TryExecuteTasks(
+			worker && worker->runner == this ? worker : nullptr, selector, batch);
+	if (!count) {
+		return false;
+	}
+
+	run_task_count_.fetch_add(count, std::memory_order_relaxed);
 	return true;
 }
 
-template<size_t TFifoElementCount>
-void MultithreadedTaskRunner<TFifoElementCount>::PostPackagedTask(Task task) {
-	task_queue_.Enqueue(std::move(task));
+template<size_t TFifoElementCount, typename TConsumerPolicy>
+IdleStats MultithreadedTaskRunner<TFifoElementCount, TConsumerPolicy>
+		::idle_stats() const {
+	IdleStats stats;
+	stats.spins = idle_spins_.load(std::memory_order_relaxed);
+	stats.yields = idle_yields_.load(std::memory_order_relaxed);
+	stats.sleeps = idle_sleeps_.load(std::memory_order_relaxed);
+	stats.parks = idle_parks_.load(std::memory_order_relaxed);
+	stats.wakeups = wakeups_.load(std::memory_order_relaxed);
+	stats.parked_time = std::chrono::nanoseconds(
+			parked_nanoseconds_.load(std::memory_order_relaxed));
+	return stats;
 }
 
-template<size_t TFifoElementCount>
-void MultithreadedTaskRunner<TFifoElementCount>::PostPackagedTaskWithDelay(
-		TaskRunner::Task task, TaskRunner::Timespan delay) {
-	std::lock_guard<std::mutex> lock(delayed_tasks_lock_);
-	delayed_tasks_.emplace_back(std::move(task),
-															std::chrono::system_clock::now() + delay);
+template<size_t TFifoElementCount, typename TConsumerPolicy>
+TaskPriorityStats MultithreadedTaskRunner<TFifoElementCount, TConsumerPolicy>
+		::priority_stats(TaskPriority priority) const {
+	const PriorityClass& priority_class =
+			priority_classes_[static_cast<size_t>(priority)];
+
+	TaskPriorityStats stats;
+	stats.queue_depth = priority_class.tasks.size();
+	if (priority == TaskPriority::kNormal) {
+		for (const auto& worker : workers_) {
+			stats.queue_depth += worker->tasks.size();
+		}
+		for (const auto& node_queue : node_queues_) {
+			stats.queue_depth += node_queue->tasks.size();
+		}
+	}
+
+	using Ticks = TimerWheel<Task>::Clock::duration;
+	stats.tasks_run = priority_class.tasks_run.load(std::memory_order_relaxed);
+	stats.total_wait_time = std::chrono::duration_cast<std::chrono::nanoseconds>(
+			Ticks(priority_class.total_wait_ticks.load(std::memory_order_relaxed)));
+	stats.max_wait_time = std::chrono::duration_cast<std::chrono::nanoseconds>(
+			Ticks(priority_class.max_wait_ticks.load(std::memory_order_relaxed)));
+	stats.deadline_jumps =
+			priority_class.deadline_jumps.load(std::memory_order_relaxed);
+	stats.missed_deadlines =
+			priority_class.missed_deadlines.load(std::memory_order_relaxed);
+	return stats;
 }
 
-template<size_t TFifoElementCount>
-void MultithreadedTaskRunner<TFifoElementCount>::EnqueDelayedTasks() {
+template<size_t TFifoElementCount, typename TConsumerPolicy>
+ResizeStats MultithreadedTaskRunner<TFifoElementCount, TConsumerPolicy>
+		::resize_stats() const {
+	ResizeStats stats;
 	{
-		std::lock_guard<std::mutex> lock(delayed_tasks_lock_);
+		std::lock_guard<std::mutex> lock(executing_threads_lock_);
+		stats.thread_count = executing_threads_.size();
+		stats.peak_thread_count = peak_thread_count_;
+	}
+	stats.threads_added_for_queue_depth =
+			threads_added_for_queue_depth_.load(std::memory_order_relaxed);
+	stats.threads_added_for_wait_time =
+			threads_added_for_wait_time_.load(std::memory_order_relaxed);
+	stats.threads_retired = threads_retired_.load(std::memory_order_relaxed);
+	return stats;
+}
 
-		// NOTE: Do not use a condition_variable here or it could cause deadlock on
-		// a single-threaded runtime.
-		if (!delayed_tasks_.empty()) {
-			auto time_now = std::chrono::system_clock::now();
-
-			// Sort the tasks is deceasing delay time order.
-			//
-			// TODO: Manually sort these because we know the pre-existing tasks are
-			// already sorted.
-			std::sort(delayed_tasks_.rbegin(), delayed_tasks_.rend(),
-					[](const DelayedTask& first, const DelayedTask& second) {
-				return first.second < second.second;
-			});
+template<size_t TFifoElementCount, typename TConsumerPolicy>
+void MultithreadedTaskRunner<TFifoElementCount, TConsumerPolicy>
+		::MaybeAddThread(int64_t now) {
+	// Only one thread checks per interval.
+	int64_t next_check = next_scale_up_check_.load(std::memory_order_relaxed);
+	if (now < next_check ||
+	    !next_scale_up_check_.compare_exchange_strong(
+	        next_check, now + scale_up_interval_ticks_,
+	        std::memory_order_relaxed)) {
+		return;
+	}
+
+	const size_t queued_task_count = QueuedTaskCount();
+	int64_t wait_ticks = 0;
+	for (const PriorityClass& priority_class : priority_classes_) {
+		wait_ticks = std::max(
+				wait_ticks,
+				priority_class.last_wait_ticks.load(std::memory_order_relaxed));
+	}
 
-			// Post the tasks that have been waiting long enough. Because the elements
-			// are sorted with the least timestamps at the end, the last element is
-			// always the one removed so this operation is fast.
-			auto it = delayed_tasks_.rbegin();
-			for (; it != delayed_tasks_.rend(); it++) {
-				if (it->second <= time_now) {
-					Task& task = it->first;
-					PostTask(std::move(task));
+	bool is_for_queue_depth;
+	{
+		std::lock_guard<std::mutex> lock(executing_threads_lock_);
+		const size_t thread_count = executing_threads_.size() +
+		                            starting_thread_count_ -
+		                            retiring_thread_count_;
+		if (thread_count >= max_thread_count_ || !shutdown_state_.is_running()) {
+			return;
+		}
+
+		is_for_queue_depth =
+				queued_task_count > scale_up_queue_depth_ * thread_count;
+		if (!is_for_queue_depth && wait_ticks <= scale_up_wait_ticks_) {
+			return;
+		}
+		starting_thread_count_++;
+	}
+
+	last_resize_time_.store(now, std::memory_order_relaxed);
+	if (is_for_queue_depth) {
+		threads_added_for_queue_depth_.fetch_add(1, std::memory_order_relaxed);
+	} else {
+		threads_added_for_wait_time_.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	std::shared_ptr<MultithreadedTaskRunner> task_runner =
+			this->shared_from_this();
+	OwnThread(std::thread([task_runner]() {
+		task_runner->LoopExecution();
+	}));
+}
+
+template<size_t TFifoElementCount, typename TConsumerPolicy>
+bool MultithreadedTaskRunner<TFifoElementCount, TConsumerPolicy>
+		::TryRetireThread(int64_t& idle_since) {
+	const int64_t now = Now();
+	if (now - idle_since < idle_timeout_ticks_) {
+		return false;
+	}
+	idle_since = now;
+
+	if (now - last_resize_time_.load(std::memory_order_relaxed) <
+	    idle_timeout_ticks_) {
+		return false;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(executing_threads_lock_);
+		if (executing_threads_.size() - retiring_thread_count_ <=
+		    min_thread_count_) {
+			return false;
+		}
+		retiring_thread_count_++;
+	}
+
+	last_resize_time_.store(now, std::memory_order_relaxed);
+	threads_retired_.fetch_add(1, std::memory_order_relaxed);
+	return true;
+}
+
+template<size_t TFifoElementCount, typename TConsumerPolicy>
+size_t MultithreadedTaskRunner<TFifoElementCount, TConsumerPolicy>
+		::QueuedTaskCount() const {
+	size_t count = 0;
+	for (const PriorityClass& priority_class : priority_classes_) {
+		count += priority_class.tasks.size();
+	}
+	for (const auto& worker : workers_) {
+		count += worker->tasks.size();
+	}
+	for (const auto& node_queue : node_queues_) {
+		count += node_queue->tasks.size();
+	}
+	return count;
+}
+
+template<size_t TFifoElementCount, typename TConsumerPolicy>
+void MultithreadedTaskRunner<TFifoElementCount, TConsumerPolicy>
+		::WaitForWork(size_t idle_rounds, int64_t wake_up_time) {
+	if (idle_strategy_ == IdleStrategy::kSleep) {
+		idle_sleeps_.fetch_add(1, std::memory_order_relaxed);
+		std::this_thread::sleep_for(std::chrono::microseconds(10));
+		return;
+	}
+
+	if (idle_rounds < kIdleSpinRounds) {
+		idle_spins_.fetch_add(1, std::memory_order_relaxed);
+		for (size_t i = 0; i < kSpinsPerIdleRound; i++) {
+			CPU_RELAX();
+		}
+		return;
+	}
+
+	if (idle_strategy_ == IdleStrategy::kSpin ||
+	    idle_rounds < kIdleSpinRounds + kIdleYieldRounds) {
+		idle_yields_.fetch_add(1, std::memory_order_relaxed);
+		std::this_thread::yield();
+		return;
+	}
+
+	Park(wake_up_time);
+}
+
+template<size_t TFifoElementCount, typename TConsumerPolicy>
+void MultithreadedTaskRunner<TFifoElementCount, TConsumerPolicy>
+		::Park(int64_t wake_up_time) {
+	const EventCount::Key key = work_available_.PrepareWait();
+	if (HasPendingWork() || !shutdown_state_.is_running()) {
+		work_available_.CancelWait();
+		return;
+	}
+
+	idle_parks_.fetch_add(1, std::memory_order_relaxed);
+	const auto park_start = TimerWheel<Task>::Clock::now();
+
+	// Wake up in time for the next delayed task, which nobody will notify about.
+	wake_up_time = std::min(
+			wake_up_time, next_delayed_task_time_.load(std::memory_order_relaxed));
+	if (wake_up_time == kNoDeadline) {
+		work_available_.Wait(key);
+	} else {
+		work_available_.WaitUntil(
+				key, TimerWheel<Task>::TimePoint(
+						TimerWheel<Task>::Clock::duration(wake_up_time)));
+	}
+
+	const auto parked_time = std::chrono::duration_cast<std::chrono::nanoseconds>(
+			TimerWheel<Task>::Clock::now() - park_start);
+	parked_nanoseconds_.fetch_add(parked_time.count(), std::memory_order_relaxed);
+}
+
+template<size_t TFifoElementCount, typename TConsumerPolicy>
+bool MultithreadedTaskRunner<TFifoElementCount, TConsumerPolicy>
+		::HasPendingWork() const {
+	for (const PriorityClass& priority_class : priority_classes_) {
+		if (!priority_class.tasks.is_empty()) {
+			return true;
+		}
+	}
+
+	for (const auto& other : workers_) {
+		if (!other->tasks.is_empty()) {
+			return true;
+		}
+	}
+
+	for (const auto& node_queue : node_queues_) {
+		if (!node_queue->tasks.is_empty()) {
+			return true;
+		}
+	}
+
+	return next_delayed_task_time_.load(std::memory_order_relaxed) <=
+	    TimerWheel<Task>::Clock::now().time_since_epoch().count();
+}
+
+template<size_t TFifoElementCount, typename TConsumerPolicy>
+void MultithreadedTaskRunner<TFifoElementCount, TConsumerPolicy>
+		::NotifyWorker() {
+	if (idle_strategy_ != IdleStrategy::kSpinThenPark) {
+		return;
+	}
+
+	if (work_available_.NotifyOne()) {
+		wakeups_.fetch_add(1, std::memory_order_relaxed);
+	}
+}
+
+template<size_t TFifoElementCount, typename TConsumerPolicy>
+size_t MultithreadedTaskRunner<TFifoElementCount, TConsumerPolicy>
+		::TryExecuteTasks(Worker* worker, PrioritySelector& selector,
+		                  std::vector<QueuedTask>& batch) {
+	if (selector.deadline_picks < kMaxConsecutiveDeadlinePicks) {
+		const size_t count = TryExecuteOverdueTasks(batch);
+		if (count) {
+			selector.deadline_picks++;
+			return count;
+		}
+	}
+	selector.deadline_picks = 0;
+
+	bool has_tasks[kTaskPriorityCount];
+	bool has_any_tasks = false;
+	for (size_t i = 0; i < kTaskPriorityCount; i++) {
+		has_tasks[i] = !priority_classes_[i].tasks.is_empty();
+		has_any_tasks = has_any_tasks || has_tasks[i];
+	}
+
+	NodeQueue* const node_queue = LocalNodeQueue();
+	if ((worker && !worker->tasks.is_empty()) ||
+	    (node_queue && !node_queue->tasks.is_empty())) {
+		has_tasks[kNormalPriority] = true;
+		has_any_tasks = true;
+	}
+
+	if (has_any_tasks) {
+		const size_t priority = SelectPriority(selector, has_tasks);
+		size_t count = TryExecuteTasksOfPriority(worker, priority, batch);
+		if (count) {
+			return count;
+		}
+
+		// Other threads took the tasks first, so take whatever else is left.
+		for (size_t i = 0; i < kTaskPriorityCount; i++) {
+			if (i != priority && has_tasks[i]) {
+				count = TryExecuteTasksOfPriority(worker, i, batch);
+				if (count) {
+					return count;
+				}
+			}
+		}
+	}
+
+	if (!workers_.empty()) {
+		return TryStealTask(worker);
+	}
+	return node_queues_.empty() ? 0 : TryStealNodeTasks(batch);
+}
+
+template<size_t TFifoElementCount, typename TConsumerPolicy>
+size_t MultithreadedTaskRunner<TFifoElementCount, TConsumerPolicy>
+		::SelectPriority(PrioritySelector& selector,
+		                 const bool (&has_tasks)[kTaskPriorityCount]) {
+	// Smooth weighted round-robin: every priority with tasks earns its weight,
+	// and the one with the most credit pays for its turn with the weights of all
+	// of them.
+	int64_t total_weight = 0;
+	size_t selected = kTaskPriorityCount;
+	for (size_t i = 0; i < kTaskPriorityCount; i++) {
+		if (!has_tasks[i]) {
+			continue;
+		}
+
+		selector.credits[i] += priority_weights_[i];
+		total_weight += priority_weights_[i];
+		if (selected == kTaskPriorityCount ||
+		    selector.credits[i] > selector.credits[selected]) {
+			selected = i;
+		}
+	}
+
+	selector.credits[selected] -= total_weight;
+	return selected;
+}
+
+template<size_t TFifoElementCount, typename TConsumerPolicy>
+size_t MultithreadedTaskRunner<TFifoElementCount, TConsumerPolicy>
+		::TryExecuteTasksOfPriority(Worker* worker, size_t priority,
+		                            std::vector<QueuedTask>& batch) {
+	// Tasks posted by this thread come first, as nobody else is likely to be
+	// looking at them.
+	if (worker && priority == kNormalPriority) {
+		Optional<TaskCell*> cell = worker->tasks.Steal();
+		if (cell) {
+			RunTask(cell.value());
+			return 1;
+		}
+	}
+
+	// Likewise for tasks posted by threads of the same node.
+	if (priority == kNormalPriority) {
+		NodeQueue* node_queue = LocalNodeQueue();
+		const size_t count = node_queue ? TryExecuteNodeTasks(*node_queue, batch)
+		                                : 0;
+		if (count) {
+			return count;
+		}
+	}
+
+	// Keep going if every task dequeued had already run for being overdue.
+	PriorityClass& priority_class = priority_classes_[priority];
+	while (priority_class.tasks.DequeueBulk(std::back_inserter(batch),
+	                                        kMaxTaskBatchSize)) {
+		OnTasksDequeued(priority_class, batch);
+		const size_t count = RunTasks(batch);
+		if (count) {
+			return count;
+		}
+	}
+
+	return 0;
+}
+
+template<size_t TFifoElementCount, typename TConsumerPolicy>
+size_t MultithreadedTaskRunner<TFifoElementCount, TConsumerPolicy>
+		::TryExecuteNodeTasks(NodeQueue& node_queue,
+		                      std::vector<QueuedTask>& batch) {
+	if (!node_queue.tasks.DequeueBulk(std::back_inserter(batch),
+	                                  kMaxTaskBatchSize)) {
+		return 0;
+	}
+
+	// Tasks in a NodeQueue never have a deadline.
+	RecordTasksRun(priority_classes_[kNormalPriority], batch, Now(), batch.size(),
+	               0);
+	return RunTasks(batch);
+}
+
+template<size_t TFifoElementCount, typename TConsumerPolicy>
+size_t MultithreadedTaskRunner<TFifoElementCount, TConsumerPolicy>
+		::TryExecuteOverdueTasks(std::vector<QueuedTask>& batch) {
+	int64_t now = 0;
+	for (PriorityClass& priority_class : priority_classes_) {
+		const int64_t earliest_deadline =
+				priority_class.earliest_deadline.load(std::memory_order_relaxed);
+		if (earliest_deadline == kNoDeadline) {
+			continue;
+		}
+
+		if (!now) {
+			now = Now();
+		}
+		if (earliest_deadline > now) {
+			continue;
+		}
+
+		{
+			std::lock_guard<std::mutex> lock(priority_class.deadlines_lock);
+			DeadlineIndex& deadline_index = priority_class.deadline_index;
+			while (batch.size() < kMaxTaskBatchSize && !deadline_index.empty() &&
+			       deadline_index.begin()->first <= now) {
+				DeadlineTask* deadline_task = deadline_index.begin()->second;
+				deadline_task->is_taken = true;
+				deadline_index.erase(deadline_index.begin());
+				batch.push_back(QueuedTask{std::move(deadline_task->task),
+				                           deadline_task->post_time, nullptr});
+			}
+			UpdateEarliestDeadline(priority_class);
+		}
+
+		if (!batch.empty()) {
+			priority_class.deadline_jumps.fetch_add(batch.size(),
+			                                        std::memory_order_relaxed);
+			RecordTasksRun(priority_class, batch, now, batch.size(), batch.size());
+			return RunTasks(batch);
+		}
+	}
+
+	return 0;
+}
+
+template<size_t TFifoElementCount, typename TConsumerPolicy>
+void MultithreadedTaskRunner<TFifoElementCount, TConsumerPolicy>
+		::OnTasksDequeued(PriorityClass& priority_class,
+		                  std::vector<QueuedTask>& batch) {
+	const int64_t now = Now();
+	uint64_t count = batch.size();
+	uint64_t missed_deadlines = 0;
+
+	bool has_deadline_tasks = false;
+	for (const QueuedTask& queued_task : batch) {
+		has_deadline_tasks = has_deadline_tasks || queued_task.deadline_task;
+	}
+
+	if (has_deadline_tasks) {
+		std::lock_guard<std::mutex> lock(priority_class.deadlines_lock);
+		for (QueuedTask& queued_task : batch) {
+			DeadlineTask* deadline_task = queued_task.deadline_task.get();
+			if (!deadline_task) {
+				continue;
+			}
+
+			// Already run for being overdue.
+			if (deadline_task->is_taken) {
+				count--;
+				continue;
+			}
+
+			if (deadline_task->deadline < now) {
+				missed_deadlines++;
+			}
+			priority_class.deadline_index.erase(deadline_task->position);
+			queued_task.task = std::move(deadline_task->task);
+		}
+		UpdateEarliestDeadline(priority_class);
+	}
+
+	RecordTasksRun(priority_class, batch, now, count, missed_deadlines);
+}
+
+template<size_t TFifoElementCount, typename TConsumerPolicy>
+void MultithreadedTaskRunner<TFifoElementCount, TConsumerPolicy>
+		::RecordTasksRun(PriorityClass& priority_class,
+		                 const std::vector<QueuedTask>& batch, int64_t now,
+		                 uint64_t count, uint64_t missed_deadlines) {
+	int64_t total_wait_ticks = 0;
+	int64_t max_wait_ticks = 0;
+	for (const QueuedTask& queued_task : batch) {
+		if (queued_task.task) {
+			const int64_t wait_ticks = now - queued_task.post_time;
+			total_wait_ticks += wait_ticks;
+			max_wait_ticks = std::max(max_wait_ticks, wait_ticks);
+		}
+	}
+
+	priority_class.tasks_run.fetch_add(count, std::memory_order_relaxed);
+	priority_class.total_wait_ticks.fetch_add(total_wait_ticks,
+	                                          std::memory_order_relaxed);
+	priority_class.last_wait_ticks.store(max_wait_ticks,
+	                                     std::memory_order_relaxed);
+	if (missed_deadlines) {
+		priority_class.missed_deadlines.fetch_add(missed_deadlines,
+		                                          std::memory_order_relaxed);
+	}
+
+	int64_t previous_max_wait_ticks =
+			priority_class.max_wait_ticks.load(std::memory_order_relaxed);
+	while (previous_max_wait_ticks < max_wait_ticks &&
+	       !priority_class.max_wait_ticks.compare_exchange_weak(
+	           previous_max_wait_ticks, max_wait_ticks,
+	           std::memory_order_relaxed)) {
+	}
+}
+
+template<size_t TFifoElementCount, typename TConsumerPolicy>
+size_t MultithreadedTaskRunner<TFifoElementCount, TConsumerPolicy>
+		::RunTasks(std::vector<QueuedTask>& batch) {
+	size_t count = 0;
+	for (QueuedTask& queued_task : batch) {
+		if (queued_task.task) {
+			if (!RunTaskCatchingExceptions(queued_task.task)) {
+				failed_task_count_.fetch_add(1, std::memory_order_relaxed);
+			}
+			count++;
+		}
+	}
+	batch.clear();
+	return count;
+}
+
+template<size_t TFifoElementCount, typename TConsumerPolicy>
+void MultithreadedTaskRunner<TFifoElementCount, TConsumerPolicy>
+		::UpdateEarliestDeadline(PriorityClass& priority_class) {
+	const DeadlineIndex& deadline_index = priority_class.deadline_index;
+	priority_class.earliest_deadline.store(
+			deadline_index.empty() ? kNoDeadline : deadline_index.begin()->first,
+			std::memory_order_relaxed);
+}
+
+template<size_t TFifoElementCount, typename TConsumerPolicy>
+void MultithreadedTaskRunner<TFifoElementCount, TConsumerPolicy>
+		::EnqueueTask(Task task, size_t priority, int64_t post_time,
+		              int64_t deadline) {
+	PriorityClass& priority_class = priority_classes_[priority];
+	if (deadline == kNoDeadline) {
+		priority_class.tasks.Enqueue(
+				QueuedTask{std::move(task), post_time, nullptr});
+		return;
+	}
+
+	std::unique_ptr<DeadlineTask> deadline_task(
+			new DeadlineTask{std::move(task), post_time, deadline, false, {}});
+	{
+		std::lock_guard<std::mutex> lock(priority_class.deadlines_lock);
+		deadline_task->position = priority_class.deadline_index.emplace(
+				deadline, deadline_task.get());
+		UpdateEarliestDeadline(priority_class);
+	}
+
+	priority_class.tasks.Enqueue(
+			QueuedTask{Task(), post_time, std::move(deadline_task)});
+}
+
+template<size_t TFifoElementCount, typename TConsumerPolicy>
+typename MultithreadedTaskRunner<TFifoElementCount, TConsumerPolicy>::Worker*
+MultithreadedTaskRunner<TFifoElementCount, TConsumerPolicy>
+		::ClaimWorker(size_t node) {
+	for (int pass = 0; pass < 2; pass++) {
+		for (auto& worker : workers_) {
+			if ((pass == 1 || worker->node == node) &&
+			    !worker->is_claimed.exchange(true, std::memory_order_acquire)) {
+				return worker.get();
+			}
+		}
+	}
+
+	return nullptr;
+}
+
+template<size_t TFifoElementCount, typename TConsumerPolicy>
+typename MultithreadedTaskRunner<TFifoElementCount, TConsumerPolicy>::NodeQueue*
+MultithreadedTaskRunner<TFifoElementCount, TConsumerPolicy>
+		::LocalNodeQueue() const {
+	NodeQueue* node_queue = current_node_queue_;
+	return node_queue && node_queue->runner == this ? node_queue : nullptr;
+}
+
+template<size_t TFifoElementCount, typename TConsumerPolicy>
+void MultithreadedTaskRunner<TFifoElementCount, TConsumerPolicy>
+		::ReleaseWorker(Worker* worker) {
+	while (!worker->tasks.is_empty()) {
+		Optional<TaskCell*> cell = worker->tasks.Steal();
+		if (cell) {
+			EnqueueTask(std::move(cell.value()->task), kNormalPriority, Now(),
+			            kNoDeadline);
+			FreeTaskCell(cell.value());
+		}
+	}
+
+	worker->is_claimed.store(false, std::memory_order_release);
+}
+
+template<size_t TFifoElementCount, typename TConsumerPolicy>
+size_t MultithreadedTaskRunner<TFifoElementCount, TConsumerPolicy>
+		::TryStealTask(Worker* thief) {
+	// Start at a random victim so that thieves spread out instead of all
+	// contending on the same deque. Victims on the node of |thief| come first,
+	// as their tasks are likely to use memory local to it.
+	const size_t worker_count = workers_.size();
+	for (int pass = node_count_ > 1 && thief ? 0 : 1; pass < 2; pass++) {
+		size_t victim = NextRandom() % worker_count;
+		for (size_t i = 0; i < worker_count; i++) {
+			Worker* worker = workers_[victim].get();
+			if (worker != thief && (pass == 1 || worker->node == thief->node)) {
+				Optional<TaskCell*> cell = worker->tasks.Steal();
+				if (cell) {
+					RunTask(cell.value());
+					return 1;
 				}
 			}
-			delayed_tasks_.erase(it.base(), delayed_tasks_.end());
+
+			victim = victim + 1 == worker_count ? 0 : victim + 1;
+		}
+	}
+
+	return 0;
+}
+
+template<size_t TFifoElementCount, typename TConsumerPolicy>
+size_t MultithreadedTaskRunner<TFifoElementCount, TConsumerPolicy>
+		::TryStealNodeTasks(std::vector<QueuedTask>& batch) {
+	// The local NodeQueue was already looked at. Go round the others from a
+	// random one, such that thieves spread out.
+	NodeQueue* const local_node_queue = LocalNodeQueue();
+	size_t node = NextRandom() % node_queues_.size();
+	for (size_t i = 0; i < node_queues_.size(); i++) {
+		NodeQueue* node_queue = node_queues_[node].get();
+		if (node_queue != local_node_queue) {
+			const size_t count = TryExecuteNodeTasks(*node_queue, batch);
+			if (count) {
+				return count;
+			}
+		}
+
+		node = node + 1 == node_queues_.size() ? 0 : node + 1;
+	}
+
+	return 0;
+}
+
+template<size_t TFifoElementCount, typename TConsumerPolicy>
+MultithreadedTaskRunner<TFifoElementCount, TConsumerPolicy>::Worker::~Worker() {
+	DeleteTaskCells(free_cells);
+	DeleteTaskCells(returned_cells.load());
+}
+
+template<size_t TFifoElementCount, typename TConsumerPolicy>
+void MultithreadedTaskRunner<TFifoElementCount, TConsumerPolicy>
+		::RunTask(TaskCell* cell) {
+	if (!RunTaskCatchingExceptions(cell->task)) {
+		failed_task_count_.fetch_add(1, std::memory_order_relaxed);
+	}
+	FreeTaskCell(cell);
+}
+
+template<size_t TFifoElementCount, typename TConsumerPolicy>
+typename MultithreadedTaskRunner<TFifoElementCount, TConsumerPolicy>::TaskCell*
+MultithreadedTaskRunner<TFifoElementCount, TConsumerPolicy>
+		::AllocateTaskCell(Worker* worker, Task task) {
+	if (!worker->free_cells) {
+		worker->free_cells =
+				worker->returned_cells.exchange(nullptr, std::memory_order_acquire);
+	}
+
+	TaskCell* cell = worker->free_cells;
+	if (!cell) {
+		return new TaskCell{std::move(task), worker, nullptr};
+	}
+
+	worker->free_cells = cell->next_free;
+	cell->task = std::move(task);
+	return cell;
+}
+
+template<size_t TFifoElementCount, typename TConsumerPolicy>
+void MultithreadedTaskRunner<TFifoElementCount, TConsumerPolicy>
+		::FreeTaskCell(TaskCell* cell) {
+	Worker* owner = cell->owner;
+	if (owner == current_worker_) {
+		cell->next_free = owner->free_cells;
+		owner->free_cells = cell;
+		return;
+	}
+
+	TaskCell* top = owner->returned_cells.load(std::memory_order_relaxed);
+	do {
+		cell->next_free = top;
+	} while (!owner->returned_cells.compare_exchange_weak(
+			top, cell, std::memory_order_release, std::memory_order_relaxed));
+}
+
+template<size_t TFifoElementCount, typename TConsumerPolicy>
+void MultithreadedTaskRunner<TFifoElementCount, TConsumerPolicy>
+		::DeleteTaskCells(TaskCell* cell) {
+	while (cell) {
+		TaskCell* next = cell->next_free;
+		delete cell;
+		cell = next;
+	}
+}
+
+template<size_t TFifoElementCount, typename TConsumerPolicy>
+uint32_t MultithreadedTaskRunner<TFifoElementCount, TConsumerPolicy>
+		::NextRandom() {
+	// xorshift32, seeded per thread. The seed must be non-zero.
+	static thread_local uint32_t state =
+			static_cast<uint32_t>(
+					std::hash<std::thread::id>()(std::this_thread::get_id())) | 1u;
+	state ^= state << 13;
+	state ^= state >> 17;
+	state ^= state << 5;
+	return state;
+}
+
+template<size_t TFifoElementCount, typename TConsumerPolicy>
+void MultithreadedTaskRunner<TFifoElementCount, TConsumerPolicy>
+		::PostClosure(Task task) {
+	if (shutdown_state_.is_stopping()) {
+		dropped_task_count_.fetch_add(1, std::memory_order_relaxed);
+		return;
+	}
+
+	Worker* worker = current_worker_;
+	NodeQueue* node_queue = LocalNodeQueue();
+	if (worker && worker->runner == this) {
+		worker->tasks.Push(AllocateTaskCell(worker, std::move(task)));
+	} else if (node_queue) {
+		node_queue->tasks.Enqueue(QueuedTask{std::move(task), Now(), nullptr});
+	} else {
+		const int64_t now = Now();
+		EnqueueTask(std::move(task), kNormalPriority, now, kNoDeadline);
+		if (is_elastic()) {
+			MaybeAddThread(now);
 		}
 	}
 
-	// Re-run this task again soon. 
-	// NOTE: Cannot be called "WithDelay" or the delayed tasks will never be
-	// enqueued.
-	PostTask([this]() {
-		EnqueDelayedTasks();
-	});
+	NotifyWorker();
+}
+
+template<size_t TFifoElementCount, typename TConsumerPolicy>
+void MultithreadedTaskRunner<TFifoElementCount, TConsumerPolicy>
+		::PostClosureWithPriority(Task task, TaskPriority priority,
+		                          Timespan deadline) {
+	if (priority == TaskPriority::kNormal && deadline == Timespan::max()) {
+		PostClosure(std::move(task));
+		return;
+	}
+
+	if (shutdown_state_.is_stopping()) {
+		dropped_task_count_.fetch_add(1, std::memory_order_relaxed);
+		return;
+	}
+
+	const int64_t now = Now();
+	const int64_t deadline_time =
+			deadline == Timespan::max()
+					? kNoDeadline
+					: now + std::chrono::duration_cast<TimerWheel<Task>::Clock::duration>(
+							deadline).count();
+	EnqueueTask(std::move(task), static_cast<size_t>(priority), now,
+	            deadline_time);
+	if (is_elastic()) {
+		MaybeAddThread(now);
+	}
+	NotifyWorker();
+}
+
+template<size_t TFifoElementCount, typename TConsumerPolicy>
+void MultithreadedTaskRunner<TFifoElementCount, TConsumerPolicy>
+		::PostClosureWithDelay(Task task, Timespan delay) {
+	if (shutdown_state_.is_stopping()) {
+		dropped_task_count_.fetch_add(1, std::memory_order_relaxed);
+		return;
+	}
+
+	bool is_earliest_delayed_task;
+	{
+		std::lock_guard<std::mutex> lock(delayed_tasks_lock_);
+		delayed_tasks_.Schedule(std::move(task),
+		                        TimerWheel<Task>::Clock::now() + delay);
+		delayed_task_count_.store(delayed_tasks_.size(),
+		                          std::memory_order_relaxed);
+
+		const int64_t next_delayed_task_time =
+				delayed_tasks_.next_expiry().time_since_epoch().count();
+		is_earliest_delayed_task =
+				next_delayed_task_time <
+				next_delayed_task_time_.exchange(next_delayed_task_time,
+				                                 std::memory_order_relaxed);
+	}
+
+	// Parked threads are waiting until the previous earliest delayed task.
+	if (is_earliest_delayed_task) {
+		NotifyWorker();
+	}
+}
+
+template<size_t TFifoElementCount, typename TConsumerPolicy>
+size_t MultithreadedTaskRunner<TFifoElementCount, TConsumerPolicy>
+		::PostExpiredDelayedTasks() {
+	if (delayed_task_count_.load(std::memory_order_relaxed) == 0) {
+		return 0;
+	}
+
+	// NOTE: Never wait for the lock, as whichever thread holds it will post the
+	// same tasks this thread would have.
+	std::unique_lock<std::mutex> lock(delayed_tasks_lock_, std::try_to_lock);
+	if (!lock.owns_lock()) {
+		return 0;
+	}
+
+	// Post once the lock is released, as posting may wake or add threads.
+	std::vector<Task> expired_tasks;
+	delayed_tasks_.Advance(
+			TimerWheel<Task>::Clock::now(),
+			[&expired_tasks](Task&& task) {
+				expired_tasks.push_back(std::move(task));
+			});
+	delayed_task_count_.store(delayed_tasks_.size(), std::memory_order_relaxed);
+	next_delayed_task_time_.store(
+			delayed_tasks_.next_expiry().time_since_epoch().count(),
+			std::memory_order_relaxed);
+	lock.unlock();
+
+	for (Task& task : expired_tasks) {
+		PostClosure(std::move(task));
+	}
+	return expired_tasks.size();
 }
 
 }  // namespace util
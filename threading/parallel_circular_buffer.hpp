@@ -1,11 +1,17 @@
 #ifndef A945298F_4894_40C9_A195_222F7928487B
 #define A945298F_4894_40C9_A195_222F7928487B
 
+#include <array>
 #include <atomic>
 #include <cassert>
 #include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <thread>
+#include <type_traits>
 
 #include "memory/include/optional.hpp"
+#include "threading/include/queue_policies.hpp"
 #include "util/include/compiler_hints.hpp"
 
 namespace util {
@@ -14,28 +20,41 @@ namespace util {
 // buffer. After construction, TryEnqueue() and Dequeue() may be called from any
 // thread.
 //
+// The buffer is a bounded array of slots, each of which carries its own
+// sequence number. Producers and consumers each hold a monotonically increasing
+// ticket (|enqueue_ticket_| and |dequeue_ticket_|) which maps to a slot through
+// index arithmetic. A slot's sequence number tells the holder of a ticket
+// whether that slot is ready for it, so claiming a slot takes a single CAS on
+// the matching ticket and publishing it takes a single release store.
+//
 // NOTE: If more than 1 producer or consumer call functions of this class
 // simultaneously, the order of execution of these calls is not guaranteed. It
 // is guaranteed that if elements A and B are pushed to the buffer by some
 // thread X and read by some thread T, A will be read before B. In other words,
 // if this class is used with a single producer and single consumer, it will
 // behave exactly as a "normal" FIFO queue.
-template<typename TDataType, size_t TFifoElementCount = 1024>
+//
+// |TLayoutPolicy| controls the padding of the tickets and slots, and
+// |TProducerPolicy| and |TConsumerPolicy| allow either side to skip the CAS on
+// its ticket when it has a single thread, as described in queue_policies.hpp.
+template<typename TDataType,
+         size_t TFifoElementCount = 1024,
+         typename TLayoutPolicy = PaddedCountersLayout,
+         typename TProducerPolicy = MultiProducer,
+         typename TConsumerPolicy = MultiConsumer>
 class ParallelCircularBuffer{
  public:
   // This class can only be used with movable types.
 	static_assert(std::is_move_constructible<TDataType>::value);
   static_assert(TFifoElementCount >= size_t{2});
 
+  // Tickets are mapped to slots by masking, so the size must be a power of 2.
+  static_assert((TFifoElementCount & (TFifoElementCount - 1)) == 0);
+
  	explicit ParallelCircularBuffer() {
-    for (int i = 1; i < data_.size() - 1; i++) {
-      data_[i].SetLinkedDatas(&data_[i - 1], &data_[i + 1]);
+    for (size_t i = 0; i < TFifoElementCount; i++) {
+      data_[i].sequence.store(i, std::memory_order_relaxed);
     }
-    Data* first = &data_[0];
-    Data* last = &data_[TFifoElementCount - 1];
-
-    first->SetLinkedDatas(last, &data_[1]);
-    last->SetLinkedDatas(&data_[TFifoElementCount - 2], first);
   }
 
 	~ParallelCircularBuffer() = default;
@@ -50,189 +69,264 @@ class ParallelCircularBuffer{
   // Retrieves the next available queue item, if one exists.
 	Optional<TDataType> Dequeue();
 
+  // Bulk versions of the above. Each reserves a contiguous range of slots with
+  // a single atomic operation, then moves the elements in or out as a group.
+  //
+  // TryEnqueueBulk() takes ownership of as many elements from the front of
+  // [|first|, |last|) as fit, returning how many were taken. DequeueBulk()
+  // writes up to |max| elements to |out|, returning how many were written.
+  //
+  // NOTE: After reserving its range, the caller may briefly spin on a slot
+  // whose previous reader or writer claimed it but has not yet finished.
+  template<typename TIterator>
+  size_t TryEnqueueBulk(TIterator first, TIterator last);
+  template<typename TOutputIterator>
+  size_t DequeueBulk(TOutputIterator out, size_t max);
+
+  // NOTE: Both accessors below are snapshots and may be stale by the time they
+  // return if other threads are using the buffer.
 	bool is_empty() const {
-		auto result = remaining_elements_.load(std::memory_order_relaxed) == 0;
-    assert(result > 0);
-    return result;
+    return size() == 0;
 	}
 
- private:
-  // Helper to simplify ownership details on access to Data class below.
-  template<typename TDataClass>
-  class DataWrapper {
-   public:
-    TDataClass* TakeOwnership();
-
-    bool is_written_to() const {
-      return is_written_to_.load(std::memory_order_relaxed);
-    }
+  size_t size() const {
+    const size_t dequeued = dequeue_ticket_.load(std::memory_order_relaxed);
+    const size_t enqueued = enqueue_ticket_.load(std::memory_order_relaxed);
 
-   protected:
-    void SetWritable() {
-      is_written_to_.store(false, std::memory_order_relaxed);
-    }
+    // Tickets are read without synchronization, so a consumer may be observed
+    // ahead of the producers it raced with.
+    return enqueued > dequeued ? enqueued - dequeued : 0;
+  }
 
-   private:
-    std::atomic_bool is_written_to_{ false };
+ private:
+  static constexpr size_t kIndexMask = TFifoElementCount - 1;
+
+  // A single element of the buffer. |sequence| is equal to the ticket of the
+  // producer allowed to write to this slot when the slot is empty, and to that
+  // ticket plus one when the slot holds data ready for the matching consumer.
+  // Once read, it advances by |TFifoElementCount| to the next lap's producer.
+  struct alignas(StricterAlignment(TLayoutPolicy::kSlotAlignment,
+                                   alignof(Optional<TDataType>))) Slot {
+    std::atomic<size_t> sequence{ 0 };
+		Optional<TDataType> data;
   };
 
-	// Thread-safe wrapper around TDataType. It's expected that |data_lock_| will
-	// only be locked in edge cases where the queue is near-empty, at which point
-	// the performance hit of locking a mutex will be insignificant.
-	class Data : public DataWrapper<Data> {
-	 public:
-    Data() = default;
-    Data(const Data& other) = delete;
-    Data(Data&& other) = delete;
-
-	 	void StoreData(TDataType&& data);
-	 	Optional<TDataType> TakeData();
+  // Signed distance between a slot's sequence and a ticket, robust against
+  // overflow of the ticket counters.
+  static intptr_t Distance(size_t sequence, size_t ticket) {
+    return static_cast<intptr_t>(sequence - ticket);
+  }
 
-    void SetLinkedDatas(Data* last, Data* next);
+  // Moves |counter| from |ticket| to |ticket| + |count|, returning false and
+  // updating |ticket| if some other thread moved it first. When only one thread
+  // may ever move |counter|, this is a plain store.
+  static bool TryClaimTickets(std::atomic<size_t>& counter, size_t& ticket,
+                              size_t count, std::true_type /* concurrent */) {
+    return counter.compare_exchange_weak(ticket, ticket + count,
+        std::memory_order_relaxed, std::memory_order_relaxed);
+  }
+  static bool TryClaimTickets(std::atomic<size_t>& counter, size_t& ticket,
+                              size_t count, std::false_type /* concurrent */) {
+    counter.store(ticket + count, std::memory_order_relaxed);
+    return true;
+  }
 
-    Data* next() { return next_ptr_; }
-    Data* previous() { return last_ptr_; }
+  bool TryClaimEnqueueTickets(size_t& ticket, size_t count) {
+    return TryClaimTickets(enqueue_ticket_, ticket, count,
+        std::integral_constant<bool, TProducerPolicy::kIsConcurrent>());
+  }
+  bool TryClaimDequeueTickets(size_t& ticket, size_t count) {
+    return TryClaimTickets(dequeue_ticket_, ticket, count,
+        std::integral_constant<bool, TConsumerPolicy::kIsConcurrent>());
+  }
 
-    bool is_readable() const {
-      return is_readable_.load(std::memory_order_relaxed);
+  // Waits until |slot| reaches |sequence|. Only used once the caller holds the
+  // ticket for |slot|, so the wait is bounded by another thread finishing its
+  // own operation on that slot.
+  static void WaitForSequence(const Slot& slot, size_t sequence) {
+    constexpr int kSpinsBeforeYield = 64;
+    int spins = 0;
+    while (slot.sequence.load(std::memory_order_acquire) != sequence) {
+      if (++spins < kSpinsBeforeYield) {
+        CPU_RELAX();
+      } else {
+        std::this_thread::yield();
+      }
     }
-	 private:
-		std::atomic_bool is_readable_{ false };
-		Optional<TDataType> data_;
-
-    Data* next_ptr_ = nullptr;
-    Data* last_ptr_ = nullptr;
-	};
+  }
 
  	// Array backing the lockless FIFO used to store tasks.
- 	std::array<Data, TFifoElementCount> data_;
-
-  // The next element for which reading has yet to complete (i.e. it is either
-  // unread or reading is in progress).
-  std::atomic<Data*> read_element_{ &data_[0] };
-  
-  // The current element to be written to (i.e. either writing has not yet
-  // begun or writing is in progress).
-  std::atomic<Data*> write_element_{ &data_[0] };
-
-  // Tracks the number of elements in the queue.
-  std::atomic_int32_t remaining_elements_{ 0 };
-};
+ 	std::array<Slot, TFifoElementCount> data_;
 
-template<typename TDataType, size_t TFifoElementCount>
-template<typename TDataClass>
-TDataClass* ParallelCircularBuffer<TDataType, TFifoElementCount>::DataWrapper<TDataClass>
-		::TakeOwnership() {
-  bool expected = false;
-  if (!is_written_to_.compare_exchange_strong(expected, true,
-      std::memory_order_relaxed, std::memory_order_relaxed)) {
-    return nullptr;
-  }
+  // Ticket of the next element to be written to.
+  alignas(StricterAlignment(TLayoutPolicy::kCounterAlignment,
+                            alignof(std::atomic<size_t>)))
+  std::atomic<size_t> enqueue_ticket_{ 0 };
 
-  return static_cast<TDataClass*>(this);
-} 
+  // Ticket of the next element to be read.
+  alignas(StricterAlignment(TLayoutPolicy::kCounterAlignment,
+                            alignof(std::atomic<size_t>)))
+  std::atomic<size_t> dequeue_ticket_{ 0 };
+};
 
-template<typename TDataType, size_t TFifoElementCount>
-void ParallelCircularBuffer<TDataType, TFifoElementCount>::Data
-		::StoreData(TDataType&& data) {
-  assert(!is_readable_.load(std::memory_order_relaxed));
+template<typename TDataType,
+         size_t TFifoElementCount,
+         typename TLayoutPolicy,
+         typename TProducerPolicy,
+         typename TConsumerPolicy>
+bool
+ParallelCircularBuffer<TDataType, TFifoElementCount, TLayoutPolicy,
+                       TProducerPolicy, TConsumerPolicy>
+    ::TryEnqueue(TDataType& data) {
+  size_t ticket = enqueue_ticket_.load(std::memory_order_relaxed);
+  Slot* slot;
+  for (;;) {
+    slot = &data_[ticket & kIndexMask];
+    const size_t sequence = slot->sequence.load(std::memory_order_acquire);
+    const intptr_t distance = Distance(sequence, ticket);
+    if (distance == 0) {
+      // The slot is free for this ticket, so try to claim it.
+      if (TryClaimEnqueueTickets(ticket, 1)) {
+        break;
+      }
+    } else if (distance < 0) {
+      // The slot still holds data from the previous lap, so the buffer is full.
+      return false;
+    } else {
+      // Another producer claimed this ticket first.
+      ticket = enqueue_ticket_.load(std::memory_order_relaxed);
+    }
+  }
 
-	data_ = std::move(data);
-  is_readable_.store(true, std::memory_order_relaxed);
+  slot->data = std::move(data);
+  slot->sequence.store(ticket + 1, std::memory_order_release);
+  return true;
 }
 
-template<typename TDataType, size_t TFifoElementCount>
-Optional<TDataType> ParallelCircularBuffer<TDataType, TFifoElementCount>
-		::Data::TakeData() {
-  bool expected_readable = true;
-	if (!is_readable_.compare_exchange_strong(expected_readable, false,
-          std::memory_order_relaxed, std::memory_order_relaxed)) {
-    return nullopt;
+template<typename TDataType,
+         size_t TFifoElementCount,
+         typename TLayoutPolicy,
+         typename TProducerPolicy,
+         typename TConsumerPolicy>
+Optional<TDataType>
+ParallelCircularBuffer<TDataType, TFifoElementCount, TLayoutPolicy,
+                       TProducerPolicy, TConsumerPolicy>
+		::Dequeue() {
+  size_t ticket = dequeue_ticket_.load(std::memory_order_relaxed);
+  Slot* slot;
+  for (;;) {
+    slot = &data_[ticket & kIndexMask];
+    const size_t sequence = slot->sequence.load(std::memory_order_acquire);
+    const intptr_t distance = Distance(sequence, ticket + 1);
+    if (distance == 0) {
+      // The slot has been published for this ticket, so try to claim it.
+      if (TryClaimDequeueTickets(ticket, 1)) {
+        break;
+      }
+    } else if (distance < 0) {
+      // Nothing has been published to this slot yet, so the buffer is empty.
+      return nullopt;
+    } else {
+      // Another consumer claimed this ticket first.
+      ticket = dequeue_ticket_.load(std::memory_order_relaxed);
+    }
   }
 
-  auto result = std::move(data_);
-  this->SetWritable();
+  Optional<TDataType> result = std::move(slot->data);
+  slot->sequence.store(ticket + TFifoElementCount, std::memory_order_release);
   return result;
 }
 
-template<typename TDataType, size_t TFifoElementCount>
-bool ParallelCircularBuffer<TDataType, TFifoElementCount>::TryEnqueue(
-    TDataType& data) {
-	// Try to enqueue it, skipping slots that are filled. If it hits the _last_
-  // one being read, return empty.
-  Data* local_read = read_element_.load(std::memory_order_relaxed);
-  Data* local_write = write_element_.load(std::memory_order_relaxed);
-  
-  for (Data* current_ptr = local_write;
-       current_ptr != local_read;
-       current_ptr = current_ptr->next()) {
-    // Gets the next available read-able data.
-    auto* new_location = current_ptr->TakeOwnership();
-    if (!!new_location) {
-      new_location->StoreData(std::move(data));
-
-      // Iteratively update |read_element_|, swapping it with
-      // |local_read->next()| until |local_read| is out of sync with
-      // |read_element| (meaning some other thread got here first) or it's
-      // updated all the way to the current write ptr.
-      bool has_updated = false;
-      while(!local_write->is_written_to()) {
-        if (!read_element_.compare_exchange_strong(
-            local_write, local_write->next(), std::memory_order_relaxed,
-            std::memory_order_relaxed)) {
-              break;
-        }
-        has_updated = true;
-      }
-      
-      remaining_elements_.fetch_add(1, std::memory_order_relaxed);
-      return true;
+template<typename TDataType,
+         size_t TFifoElementCount,
+         typename TLayoutPolicy,
+         typename TProducerPolicy,
+         typename TConsumerPolicy>
+template<typename TIterator>
+size_t
+ParallelCircularBuffer<TDataType, TFifoElementCount, TLayoutPolicy,
+                       TProducerPolicy, TConsumerPolicy>
+    ::TryEnqueueBulk(TIterator first, TIterator last) {
+  const size_t requested = static_cast<size_t>(std::distance(first, last));
+  if (requested == 0) {
+    return 0;
+  }
+
+  size_t ticket = enqueue_ticket_.load(std::memory_order_relaxed);
+  size_t count;
+  for (;;) {
+    // Every slot up to |TFifoElementCount| tickets past the last one claimed by
+    // a consumer is either free or about to be freed by that consumer.
+    const size_t dequeued = dequeue_ticket_.load(std::memory_order_relaxed);
+    if (Distance(ticket, dequeued) < 0) {
+      ticket = enqueue_ticket_.load(std::memory_order_relaxed);
+      continue;
+    }
+
+    const size_t available = TFifoElementCount - (ticket - dequeued);
+    count = requested < available ? requested : available;
+    if (count == 0) {
+      return 0;
+    }
+
+    if (TryClaimEnqueueTickets(ticket, count)) {
+      break;
     }
   }
 
-  // Try again more elements have been written since this function started.
-  if (local_read != read_element_.load(std::memory_order_relaxed)) {
-    return TryEnqueue(data);
+  for (size_t i = 0; i < count; i++, ++first) {
+    Slot& slot = data_[(ticket + i) & kIndexMask];
+    WaitForSequence(slot, ticket + i);
+    slot.data = std::move(*first);
+    slot.sequence.store(ticket + i + 1, std::memory_order_release);
   }
 
-  return false;
+  return count;
 }
 
-template<typename TDataType, size_t TFifoElementCount>
-Optional<TDataType> ParallelCircularBuffer<TDataType, TFifoElementCount>
-		::Dequeue() {
-  Data* local_read = read_element_.load(std::memory_order_relaxed);
-  Data* local_write = write_element_.load(std::memory_order_relaxed);
-  
-  for (Data* current_ptr = local_read;
-       current_ptr->is_readable();
-       current_ptr = current_ptr->next()) {
-    // Gets the next available read-able data.
-    auto data = current_ptr->TakeData();
-    if (!!data) {
-      // Iteratively update |read_element_|, swapping it with
-      // |local_read->next()| until |local_read| is out of sync with
-      // |read_element| (meaning some other thread got here first) or it's
-      // updated all the way to the current write ptr.
-      while(!local_read->is_readable()) {
-        if (!read_element_.compare_exchange_strong(
-            local_read, local_read->next(), std::memory_order_relaxed,
-            std::memory_order_relaxed)) {
-              break;
-        }
-      }
+template<typename TDataType,
+         size_t TFifoElementCount,
+         typename TLayoutPolicy,
+         typename TProducerPolicy,
+         typename TConsumerPolicy>
+template<typename TOutputIterator>
+size_t
+ParallelCircularBuffer<TDataType, TFifoElementCount, TLayoutPolicy,
+                       TProducerPolicy, TConsumerPolicy>
+    ::DequeueBulk(TOutputIterator out, size_t max) {
+  if (max == 0) {
+    return 0;
+  }
+
+  size_t ticket = dequeue_ticket_.load(std::memory_order_relaxed);
+  size_t count;
+  for (;;) {
+    // Every ticket below |enqueued| has been claimed by a producer, so its
+    // slot is either published or about to be.
+    const size_t enqueued = enqueue_ticket_.load(std::memory_order_relaxed);
+    const intptr_t available = Distance(enqueued, ticket);
+    if (available <= 0) {
+      return 0;
+    }
 
-      remaining_elements_.fetch_sub(1, std::memory_order_relaxed);
-      return data;
+    count = max < static_cast<size_t>(available)
+        ? max : static_cast<size_t>(available);
+    if (TryClaimDequeueTickets(ticket, count)) {
+      break;
     }
   }
 
-  // Try again more elements have been written since this function started.
-  if (local_write != write_element_.load(std::memory_order_relaxed)) {
-    return Dequeue();
+  for (size_t i = 0; i < count; i++) {
+    Slot& slot = data_[(ticket + i) & kIndexMask];
+    WaitForSequence(slot, ticket + i + 1);
+    *out = std::move(slot.data).value();
+    ++out;
+    slot.data.reset();
+    slot.sequence.store(ticket + i + TFifoElementCount,
+                        std::memory_order_release);
   }
 
-  return nullopt;
+  return count;
 }
 
 }  // namespace util
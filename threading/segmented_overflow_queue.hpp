@@ -0,0 +1,306 @@
+#ifndef FA614EDC_35C9_4F98_B6F9_AAD7FD781BD6
+#define FA614EDC_35C9_4F98_B6F9_AAD7FD781BD6
+
+#include <array>
+#include <atomic>
+#include <cassert>
+#include <cstddef>
+#include <type_traits>
+
+#include "memory/include/optional.hpp"
+#include "util/include/compiler_hints.hpp"
+
+namespace util {
+
+// An unbounded, lock-free queue for any number of producers and a single
+// consumer, used by NearlyLocklessFifo to hold elements which did not fit in
+// its ring buffer.
+//
+// Elements are stored in a linked list of fixed-size segments. Producers claim
+// a slot of the tail segment with a single fetch_add, and append a new segment
+// once the tail is full. Drained segments are recycled through a small pool,
+// such that a burst only allocates the first time it happens, and segments
+// above |TMaxPooledSegments| are freed once the burst ends.
+//
+// NOTE: Push() may be called from any thread. All other non-const functions
+// are "consumer" functions and must never be called concurrently with each
+// other, although they may be called from different threads provided those
+// calls are ordered by some other synchronization.
+template<typename TDataType,
+         size_t TSegmentSize = 64,
+         size_t TMaxPooledSegments = 4>
+class SegmentedOverflowQueue {
+ public:
+  static_assert(std::is_move_constructible<TDataType>::value);
+  static_assert(TSegmentSize >= size_t{1});
+
+  SegmentedOverflowQueue() {
+    head_ = new Segment();
+    tail_.store(head_, std::memory_order_relaxed);
+  }
+
+  ~SegmentedOverflowQueue() {
+    DeleteSegments(head_, &Segment::next);
+    DeleteSegments(retired_segments_, &Segment::next_free);
+    DeleteSegments(returned_segments_.load(), &Segment::next_free);
+    DeleteSegments(free_segments_.load(), &Segment::next_free);
+  }
+
+  SegmentedOverflowQueue(const SegmentedOverflowQueue& other) = delete;
+  SegmentedOverflowQueue(SegmentedOverflowQueue&& other) = delete;
+
+  // Takes ownership of |data|, placing it at the back of the queue.
+  void Push(TDataType&& data);
+
+  // Returns the element at the front of the queue, or nullptr if the queue is
+  // empty or the producer of the front element has not yet finished writing
+  // it. The returned element stays owned by the queue until PopFront().
+  TDataType* Front();
+
+  // Removes the element last returned by Front().
+  void PopFront();
+
+  // NOTE: The below are snapshots, which may be stale by the time they return
+  // if other threads are using the queue.
+  bool is_empty() const {
+    return size() == 0;
+  }
+
+  size_t size() const {
+    return depth_.load(std::memory_order_relaxed);
+  }
+
+  // Number of segments currently linked into the queue.
+  size_t linked_segments() const {
+    return linked_segments_.load(std::memory_order_relaxed);
+  }
+
+  // Number of segments which are allocated but not linked into the queue.
+  size_t pooled_segments() const {
+    return pooled_segments_.load(std::memory_order_relaxed);
+  }
+
+ private:
+  struct Slot {
+    std::atomic_bool is_published{ false };
+    Optional<TDataType> data;
+  };
+
+  struct Segment {
+    // Index of the next slot to be claimed by a producer. May grow past
+    // |TSegmentSize|, in which case the segment is full.
+    std::atomic<size_t> write_index{ 0 };
+
+    // Next segment in the queue.
+    std::atomic<Segment*> next{ nullptr };
+
+    // Next segment in |free_segments_|, |returned_segments_| or
+    // |retired_segments_|.
+    std::atomic<Segment*> next_free{ nullptr };
+
+    // Index of the next slot to be read. Only accessed by the consumer.
+    size_t read_index = 0;
+
+    std::array<Slot, TSegmentSize> slots;
+  };
+
+  // Returns a segment from |free_segments_|, or a newly allocated one.
+  Segment* AcquireSegment();
+
+  // Hands a fully consumed segment back for reuse. Retired segments may still
+  // be referenced by producers which read |tail_| before it moved on, so they
+  // are only made available for reuse once no producer is active.
+  void RetireSegment(Segment* segment);
+  void RecycleRetiredSegments();
+
+  static void DeleteSegments(Segment* segment,
+                             std::atomic<Segment*> Segment::*next) {
+    while (segment) {
+      Segment* current = segment;
+      segment = (current->*next).load(std::memory_order_relaxed);
+      delete current;
+    }
+  }
+
+  // Segment currently being read. Only accessed by the consumer.
+  Segment* head_ = nullptr;
+
+  // Segment currently being written to.
+  std::atomic<Segment*> tail_{ nullptr };
+
+  // Number of threads currently inside of Push().
+  std::atomic<size_t> active_producers_{ 0 };
+
+  // Treiber stack of segments ready for reuse. Only the consumer pushes to
+  // it, and only while no producer is active, so that producers popping from
+  // it cannot observe an ABA.
+  std::atomic<Segment*> free_segments_{ nullptr };
+
+  // Segments acquired by producers but never linked into the queue. Producers
+  // push to it and the consumer takes the whole stack at once.
+  std::atomic<Segment*> returned_segments_{ nullptr };
+
+  // Segments waiting for all producers to leave Push(). Consumer only.
+  Segment* retired_segments_ = nullptr;
+
+  // Statistics.
+  std::atomic<size_t> depth_{ 0 };
+  std::atomic<size_t> linked_segments_{ 1 };
+  std::atomic<size_t> pooled_segments_{ 0 };
+};
+
+template<typename TDataType, size_t TSegmentSize, size_t TMaxPooledSegments>
+void SegmentedOverflowQueue<TDataType, TSegmentSize, TMaxPooledSegments>
+    ::Push(TDataType&& data) {
+  active_producers_.fetch_add(1);
+  depth_.fetch_add(1, std::memory_order_relaxed);
+
+  Segment* tail = tail_.load();
+  for (;;) {
+    const size_t index =
+        tail->write_index.fetch_add(1, std::memory_order_relaxed);
+    if (LIKELY(index < TSegmentSize)) {
+      Slot& slot = tail->slots[index];
+      slot.data = std::move(data);
+      slot.is_published.store(true, std::memory_order_release);
+      break;
+    }
+
+    // The tail is full, so link a new segment after it unless some other
+    // producer already has, then help move |tail_| forward.
+    Segment* next = tail->next.load(std::memory_order_acquire);
+    if (!next) {
+      Segment* segment = AcquireSegment();
+      if (tail->next.compare_exchange_strong(next, segment)) {
+        next = segment;
+        linked_segments_.fetch_add(1, std::memory_order_relaxed);
+      } else {
+        // Another producer linked its own segment first. Other producers may
+        // still be reading |segment| from when it was in |free_segments_|, so
+        // hand it to the consumer to be recycled.
+        Segment* top = returned_segments_.load();
+        do {
+          segment->next_free.store(top, std::memory_order_relaxed);
+        } while (!returned_segments_.compare_exchange_weak(top, segment));
+      }
+    }
+
+    if (tail_.compare_exchange_strong(tail, next)) {
+      tail = next;
+    }
+  }
+
+  active_producers_.fetch_sub(1);
+}
+
+template<typename TDataType, size_t TSegmentSize, size_t TMaxPooledSegments>
+TDataType* SegmentedOverflowQueue<TDataType, TSegmentSize, TMaxPooledSegments>
+    ::Front() {
+  for (;;) {
+    if (head_->read_index < TSegmentSize) {
+      Slot& slot = head_->slots[head_->read_index];
+      if (!slot.is_published.load(std::memory_order_acquire)) {
+        return nullptr;
+      }
+      return &slot.data.value();
+    }
+
+    Segment* next = head_->next.load(std::memory_order_acquire);
+    if (!next) {
+      return nullptr;
+    }
+
+    Segment* drained = head_;
+    head_ = next;
+    RetireSegment(drained);
+  }
+}
+
+template<typename TDataType, size_t TSegmentSize, size_t TMaxPooledSegments>
+void SegmentedOverflowQueue<TDataType, TSegmentSize, TMaxPooledSegments>
+    ::PopFront() {
+  assert(head_->read_index < TSegmentSize);
+
+  Slot& slot = head_->slots[head_->read_index++];
+  assert(slot.is_published.load(std::memory_order_relaxed));
+  slot.data.reset();
+  slot.is_published.store(false, std::memory_order_relaxed);
+  depth_.fetch_sub(1, std::memory_order_relaxed);
+
+  if (retired_segments_ ||
+      returned_segments_.load(std::memory_order_relaxed)) {
+    RecycleRetiredSegments();
+  }
+}
+
+template<typename TDataType, size_t TSegmentSize, size_t TMaxPooledSegments>
+typename SegmentedOverflowQueue<TDataType, TSegmentSize, TMaxPooledSegments>
+    ::Segment*
+SegmentedOverflowQueue<TDataType, TSegmentSize, TMaxPooledSegments>
+    ::AcquireSegment() {
+  Segment* segment = free_segments_.load();
+  while (segment &&
+         !free_segments_.compare_exchange_weak(
+             segment, segment->next_free.load(std::memory_order_relaxed))) {}
+
+  if (!segment) {
+    return new Segment();
+  }
+
+  pooled_segments_.fetch_sub(1, std::memory_order_relaxed);
+  return segment;
+}
+
+template<typename TDataType, size_t TSegmentSize, size_t TMaxPooledSegments>
+void SegmentedOverflowQueue<TDataType, TSegmentSize, TMaxPooledSegments>
+    ::RetireSegment(Segment* segment) {
+  linked_segments_.fetch_sub(1, std::memory_order_relaxed);
+  segment->next_free.store(retired_segments_, std::memory_order_relaxed);
+  retired_segments_ = segment;
+  RecycleRetiredSegments();
+}
+
+template<typename TDataType, size_t TSegmentSize, size_t TMaxPooledSegments>
+void SegmentedOverflowQueue<TDataType, TSegmentSize, TMaxPooledSegments>
+    ::RecycleRetiredSegments() {
+  // A producer that loaded a retired segment from |tail_| is still inside of
+  // Push(). Once none are, |tail_| has moved past every retired segment, so
+  // nothing else can reference them.
+  if (active_producers_.load() != 0) {
+    return;
+  }
+
+  Segment* returned = returned_segments_.exchange(nullptr);
+  while (returned) {
+    Segment* segment = returned;
+    returned = segment->next_free.load(std::memory_order_relaxed);
+    segment->next_free.store(retired_segments_, std::memory_order_relaxed);
+    retired_segments_ = segment;
+  }
+
+  while (retired_segments_) {
+    Segment* segment = retired_segments_;
+    retired_segments_ =
+        segment->next_free.load(std::memory_order_relaxed);
+
+    if (pooled_segments_.load(std::memory_order_relaxed) >=
+            TMaxPooledSegments) {
+      delete segment;
+      continue;
+    }
+
+    segment->write_index.store(0, std::memory_order_relaxed);
+    segment->next.store(nullptr, std::memory_order_relaxed);
+    segment->read_index = 0;
+
+    Segment* top = free_segments_.load();
+    do {
+      segment->next_free.store(top, std::memory_order_relaxed);
+    } while (!free_segments_.compare_exchange_weak(top, segment));
+    pooled_segments_.fetch_add(1, std::memory_order_relaxed);
+  }
+}
+
+}  // namespace util
+
+#endif /* FA614EDC_35C9_4F98_B6F9_AAD7FD781BD6 */
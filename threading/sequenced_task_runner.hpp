@@ -0,0 +1,129 @@
+#ifndef E5246998_318C_4591_BD7D_218B9E8AA2A7
+#define E5246998_318C_4591_BD7D_218B9E8AA2A7
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <utility>
+
+#include "memory/include/optional.hpp"
+#include "threading/include/nearly_lockless_fifo.hpp"
+#include "threading/include/task_priority.hpp"
+#include "threading/include/task_runner.hpp"
+
+namespace util {
+
+// A TaskRunner which runs its tasks one at a time, in the order in which they
+// were posted, on the threads of another TaskRunner. Unlike a
+// SingleThreadedTaskRunner it owns no thread, so any number of sequences can
+// share a single thread pool, and idle sequences cost nothing but memory.
+//
+// Tasks are stored in a small MpscFifo. Whichever post finds the sequence idle
+// posts a run to the underlying TaskRunner, which runs up to |kMaxTasksPerRun|
+// tasks, then posts the next run if any tasks remain, such that a busy
+// sequence takes turns with the rest of the pool rather than hogging a thread.
+// As at most one run of a sequence is ever posted, the FIFO only ever has a
+// single consumer, and each run happens after the previous one.
+//
+// Objects must be owned by a std::shared_ptr, as each posted run keeps the
+// sequence alive until it ran.
+template<size_t TFifoElementCount>
+class SequencedTaskRunner
+    : public TaskRunner,
+      public std::enable_shared_from_this<
+          SequencedTaskRunner<TFifoElementCount>> {
+ public:
+  // Runs of the sequence are posted to |task_runner| with |priority|.
+  SequencedTaskRunner(std::shared_ptr<TaskRunner> task_runner,
+                      TaskPriority priority)
+      : task_runner_(std::move(task_runner)), priority_(priority) {}
+  ~SequencedTaskRunner() override = default;
+
+  SequencedTaskRunner(const SequencedTaskRunner& other) = delete;
+  SequencedTaskRunner(SequencedTaskRunner&& other) = delete;
+  SequencedTaskRunner& operator=(const SequencedTaskRunner& other) = delete;
+  SequencedTaskRunner& operator=(SequencedTaskRunner&& other) = delete;
+
+  // TaskRunner implementation.
+  void PostClosure(Task task) final {
+    tasks_.Enqueue(std::move(task));
+    if (pending_task_count_.fetch_add(1, std::memory_order_acq_rel) == 0) {
+      PostRun();
+    }
+  }
+
+  void PostClosureWithDelay(Task task, Timespan delay) final {
+    task_runner_->PostTaskWithDelay(
+        DelayedTask{this->shared_from_this(), std::move(task)}, delay);
+  }
+
+  // True only while running a task of this sequence, whichever thread of the
+  // underlying TaskRunner it runs on.
+  bool IsRunningOnTaskRunner() const override {
+    return current_sequence_ == this;
+  }
+
+ private:
+  // Posts a task of the sequence once its delay passed.
+  struct DelayedTask {
+    void operator()() {
+      sequence->PostClosure(std::move(task));
+    }
+
+    std::shared_ptr<SequencedTaskRunner> sequence;
+    Task task;
+  };
+
+  // Maximum number of tasks run by a single run of the sequence.
+  static constexpr size_t kMaxTasksPerRun = 16;
+
+  void PostRun() {
+    std::shared_ptr<SequencedTaskRunner> sequence = this->shared_from_this();
+    task_runner_->PostTask([sequence]() { sequence->RunTasks(); }, priority_);
+  }
+
+  void RunTasks() {
+    const SequencedTaskRunner* previous_sequence = current_sequence_;
+    current_sequence_ = this;
+
+    size_t count = 0;
+    while (count < kMaxTasksPerRun) {
+      Optional<Task> task = tasks_.Dequeue();
+      if (!task) {
+        break;
+      }
+
+      RunTaskCatchingExceptions(task.value());
+      count++;
+    }
+
+    current_sequence_ = previous_sequence;
+
+    // NOTE: |count| may be zero if the FIFO briefly reported a task as missing
+    // while its overflow was being flushed, in which case the run is retried.
+    if (pending_task_count_.fetch_sub(count, std::memory_order_acq_rel) !=
+        count) {
+      PostRun();
+    }
+  }
+
+  // Sequence whose task the current thread is running, if any.
+  static thread_local const SequencedTaskRunner* current_sequence_;
+
+  const std::shared_ptr<TaskRunner> task_runner_;
+  const TaskPriority priority_;
+
+  MpscFifo<Task, TFifoElementCount> tasks_;
+
+  // Number of posted tasks which did not run yet. A run is posted whenever it
+  // goes from zero to one, and by every run which leaves it above zero.
+  std::atomic<size_t> pending_task_count_{0};
+};
+
+template<size_t TFifoElementCount>
+thread_local const SequencedTaskRunner<TFifoElementCount>*
+    SequencedTaskRunner<TFifoElementCount>::current_sequence_ = nullptr;
+
+}  // namespace util
+
+#endif /* E5246998_318C_4591_BD7D_218B9E8AA2A7 */
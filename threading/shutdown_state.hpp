@@ -0,0 +1,90 @@
+#ifndef FF499AAD_82DC_4C7B_872F_E0ACB9968B28
+#define FF499AAD_82DC_4C7B_872F_E0ACB9968B28
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <limits>
+
+#include "threading/include/owning_task_runner.hpp"
+
+namespace util {
+
+// Shutdown progress of an OwningTaskRunner, shared between the thread calling
+// Shutdown() and the threads running tasks. Checking whether to keep running
+// tasks costs a relaxed load while the runner is running, and only reads the
+// clock while draining until a deadline.
+class ShutdownState {
+ public:
+  using Clock = std::chrono::steady_clock;
+
+  // Moves to the phase selected by |mode|, unless already in a later one.
+  // Returns false if the runner was already shutting down.
+  bool Begin(ShutdownMode mode, TaskRunner::Timespan timeout) {
+    int64_t deadline = kNoDeadline;
+    if (mode == ShutdownMode::kDrainUntilDeadline) {
+      deadline = (Clock::now() + timeout).time_since_epoch().count();
+    }
+
+    int64_t previous_deadline =
+        drain_deadline_.load(std::memory_order_relaxed);
+    while (deadline < previous_deadline &&
+           !drain_deadline_.compare_exchange_weak(previous_deadline, deadline,
+                                                  std::memory_order_relaxed)) {
+    }
+
+    const Phase phase =
+        mode == ShutdownMode::kDropPending ? kStopping : kDraining;
+    Phase previous_phase = phase_.load(std::memory_order_relaxed);
+    while (previous_phase < phase &&
+           !phase_.compare_exchange_weak(previous_phase, phase,
+                                         std::memory_order_release,
+                                         std::memory_order_relaxed)) {
+    }
+    return previous_phase == kRunning;
+  }
+
+  bool is_running() const {
+    return phase_.load(std::memory_order_relaxed) == kRunning;
+  }
+
+  // True once posted tasks should be dropped rather than queued.
+  bool is_stopping() const {
+    return phase_.load(std::memory_order_relaxed) == kStopping;
+  }
+
+  // True once threads should stop running tasks, be it because of
+  // ShutdownMode::kDropPending, or because the drain deadline passed.
+  bool ShouldStop() {
+    const Phase phase = phase_.load(std::memory_order_relaxed);
+    if (phase == kRunning) {
+      return false;
+    }
+    if (phase == kStopping) {
+      return true;
+    }
+
+    const int64_t deadline = drain_deadline_.load(std::memory_order_relaxed);
+    if (deadline == kNoDeadline ||
+        Clock::now().time_since_epoch().count() < deadline) {
+      return false;
+    }
+
+    Begin(ShutdownMode::kDropPending, TaskRunner::Timespan::zero());
+    return true;
+  }
+
+ private:
+  enum Phase { kRunning, kDraining, kStopping };
+
+  static constexpr int64_t kNoDeadline = std::numeric_limits<int64_t>::max();
+
+  std::atomic<Phase> phase_{kRunning};
+
+  // Steady clock time at which draining ends, as a duration since epoch.
+  std::atomic<int64_t> drain_deadline_{kNoDeadline};
+};
+
+}  // namespace util
+
+#endif /* FF499AAD_82DC_4C7B_872F_E0ACB9968B28 */
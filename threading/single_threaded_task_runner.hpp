@@ -1,40 +1,378 @@
 #ifndef B877E41A_01C3_484E_A139_4A515868FBB3
 #define B877E41A_01C3_484E_A139_4A515868FBB3
 
-#include "threading/multithreaded_task_runner.hpp"
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+#include "threading/event_count.hpp"
+#include "threading/include/owning_task_runner.hpp"
+#include "threading/shutdown_state.hpp"
+#include "threading/timer_wheel.hpp"
 
 namespace util {
 
 // A TaskRunner implementation for a single consumer thread and multiple
 // producer threads.
 //
-// TODO: Write a better optimized version for a single thread consumer that
-// uses less thread synchronization and blocks when no tasks as available
-// instead of sleeping.
-template<size_t TFifoElementCount>
-class SingleThreadedTaskRunner : public MultithreadedTaskRunner {
+// Producers push tasks onto an intrusive lock-free stack of nodes with a single
+// CAS. The consumer takes the whole stack with one exchange, reverses it into
+// posting order and runs it without any further atomic operations, then hands
+// its nodes back to producers with a single CAS. Producers keep those in a
+// thread-local cache, such that posting does not allocate in the steady state.
+// Only about |kMaxFreeNodes| nodes are handed back at a time, and the others
+// deleted, such that a burst of tasks does not leave its nodes in the cache of
+// whichever thread posts next. Delayed tasks go through the same stack, and
+// are then held in a TimerWheel only ever touched by the consumer, so no lock
+// is taken anywhere.
+//
+// The consumer either runs LoopExecution(), which blocks on an EventCount
+// while there is nothing to do, or calls RunUntilIdle() from an existing event
+// loop. Producers only pay for a wake-up when they post to an empty stack while
+// the consumer is blocked. Once shut down, LoopExecution() returns, and the
+// consumer checks whether to drop the tasks left before each task it runs.
+class SingleThreadedTaskRunner : public OwningTaskRunner {
  public:
-  SingleThreadedTaskRunner();
-  ~SingleThreadedTaskRunner() override = default;
-  
+  SingleThreadedTaskRunner() = default;
+
+  ~SingleThreadedTaskRunner() override {
+    DeleteNodes(pending_nodes_.load(std::memory_order_acquire));
+    DeleteNodes(free_nodes_.load(std::memory_order_acquire));
+  }
+
   SingleThreadedTaskRunner(const SingleThreadedTaskRunner& other) = delete;
   SingleThreadedTaskRunner(SingleThreadedTaskRunner&& other) = delete;
-  SingleThreadedTaskRunner=(const SingleThreadedTaskRunner& other) = delete;
-  SingleThreadedTaskRunner=(SingleThreadedTaskRunner&& other) = delete;
+  SingleThreadedTaskRunner& operator=(
+      const SingleThreadedTaskRunner& other) = delete;
+  SingleThreadedTaskRunner& operator=(
+      SingleThreadedTaskRunner&& other) = delete;
+
+  // Runs tasks as they are posted, blocking while there are none, until shut
+  // down.
+  //
+  // NOTE: LoopExecution() and RunUntilIdle() must only ever be called by one
+  // thread at a time.
+  void LoopExecution() {
+    std::lock_guard<std::mutex> lock(loop_lock_);
+    ScopedCurrentRunner scoped_current_runner(this);
+    while (!shutdown_state_.ShouldStop()) {
+      if (!RunPendingTasks()) {
+        if (!shutdown_state_.is_running()) {
+          break;
+        }
+        WaitForTasks();
+      }
+    }
+  }
+
+  // Runs every task which is ready, including those posted by the tasks run,
+  // then returns the number of tasks run. Never blocks, and leaves delayed
+  // tasks whose delay has not passed for later.
+  size_t RunUntilIdle() {
+    ScopedCurrentRunner scoped_current_runner(this);
+    size_t total_count = 0;
+    size_t count;
+    do {
+      count = RunPendingTasks();
+      total_count += count;
+    } while (count || pending_nodes_.load(std::memory_order_relaxed));
+    return total_count;
+  }
 
-  void LoopExecution() override {
-    assert(running_thread_id_.load() == std::thread::id{});
+  // TaskRunner implementation.
+  void PostClosure(Task task) final {
+    if (shutdown_state_.is_stopping()) {
+      dropped_task_count_.fetch_add(1, std::memory_order_relaxed);
+      return;
+    }
+    PushNode(AllocateNode(std::move(task), TimePoint::min()));
+  }
 
-    running_thread_id_.store(std::this_thread::get_id());
-    MultithreadedTaskRunner<TFifoElementCount>::LoopExecution();
+  void PostClosureWithDelay(Task task, Timespan delay) final {
+    if (shutdown_state_.is_stopping()) {
+      dropped_task_count_.fetch_add(1, std::memory_order_relaxed);
+      return;
+    }
+    PushNode(AllocateNode(std::move(task), Clock::now() + delay));
   }
 
+  // True while the calling thread is in LoopExecution() or RunUntilIdle().
   bool IsRunningOnTaskRunner() const override {
-    return std::this_thread::get_id() == running_thread_id_.load();
+    return current_runner() == this;
+  }
+
+  // Runs the tasks posted so far, leaving delayed tasks to the loop, as this
+  // may be called by a task run from the wheel.
+  bool RunPendingTask() override {
+    if (current_runner() != this) {
+      return false;
+    }
+
+    const size_t count = RunPostedTasks();
+    run_task_count_.fetch_add(count, std::memory_order_relaxed);
+    return count != 0;
+  }
+
+  // OwningTaskRunner implementation.
+  void Shutdown(ShutdownMode mode,
+                Timespan timeout = Timespan::zero()) override {
+    shutdown_state_.Begin(mode, timeout);
+    tasks_available_.NotifyAll();
+  }
+
+ protected:
+  ShutdownStats FinishShutdown() override {
+    std::lock_guard<std::mutex> lock(loop_lock_);
+
+    // Drop whatever is posted from now on, then whatever was left.
+    shutdown_state_.Begin(ShutdownMode::kDropPending, Timespan::zero());
+    uint64_t dropped_task_count = delayed_tasks_.Clear();
+    TaskNode* const first =
+        pending_nodes_.exchange(nullptr, std::memory_order_acquire);
+    for (TaskNode* node = first; node; node = node->next) {
+      node->task = Task();
+      dropped_task_count++;
+    }
+    FreeNodes(first);
+
+    ShutdownStats stats;
+    stats.tasks_run = run_task_count_.load(std::memory_order_relaxed);
+    stats.tasks_dropped =
+        dropped_task_count_.fetch_add(dropped_task_count,
+                                      std::memory_order_relaxed) +
+        dropped_task_count;
+    stats.tasks_failed = failed_task_count_.load(std::memory_order_relaxed);
+    return stats;
   }
 
  private:
-  std::atomic<std::thread::id> running_thread_id_;
+  using Clock = TimerWheel<Task>::Clock;
+  using TimePoint = TimerWheel<Task>::TimePoint;
+
+  // Maximum number of nodes in |free_nodes_|, give or take the nodes handed
+  // back while a producer takes them.
+  static constexpr size_t kMaxFreeNodes = 64;
+
+  struct TaskNode {
+    Task task;
+
+    // TimePoint::min() for tasks posted without a delay.
+    TimePoint run_time;
+
+    TaskNode* next;
+  };
+
+  // Nodes the current thread may reuse, whichever runner they came from.
+  struct NodeCache {
+    ~NodeCache() {
+      DeleteNodes(nodes);
+    }
+
+    TaskNode* nodes = nullptr;
+  };
+
+  // Marks the calling thread as the consumer while in scope.
+  class ScopedCurrentRunner {
+   public:
+    explicit ScopedCurrentRunner(const SingleThreadedTaskRunner* runner)
+        : previous_runner_(current_runner()) {
+      current_runner() = runner;
+    }
+
+    ~ScopedCurrentRunner() {
+      current_runner() = previous_runner_;
+    }
+
+   private:
+    const SingleThreadedTaskRunner* const previous_runner_;
+  };
+
+  static const SingleThreadedTaskRunner*& current_runner() {
+    static thread_local const SingleThreadedTaskRunner* runner = nullptr;
+    return runner;
+  }
+
+  static NodeCache& node_cache() {
+    static thread_local NodeCache cache;
+    return cache;
+  }
+
+  TaskNode* AllocateNode(Task task, TimePoint run_time) {
+    NodeCache& cache = node_cache();
+    if (!cache.nodes && free_nodes_.load(std::memory_order_relaxed)) {
+      cache.nodes = free_nodes_.exchange(nullptr, std::memory_order_acquire);
+      free_node_count_.store(0, std::memory_order_relaxed);
+    }
+
+    TaskNode* node = cache.nodes;
+    if (!node) {
+      return new TaskNode{std::move(task), run_time, nullptr};
+    }
+
+    cache.nodes = node->next;
+    node->task = std::move(task);
+    node->run_time = run_time;
+    return node;
+  }
+
+  void PushNode(TaskNode* node) {
+    TaskNode* top = pending_nodes_.load(std::memory_order_relaxed);
+    do {
+      node->next = top;
+    } while (!pending_nodes_.compare_exchange_weak(
+        top, node, std::memory_order_release, std::memory_order_relaxed));
+
+    // Had the stack not been empty, the consumer would not block before
+    // taking it.
+    if (!top) {
+      tasks_available_.NotifyOne();
+    }
+  }
+
+  // Hands the nodes of the list starting at |first| back to producers, up to
+  // |kMaxFreeNodes| in total, and deletes the others.
+  void FreeNodes(TaskNode* first) {
+    const size_t free_count = free_node_count_.load(std::memory_order_relaxed);
+    size_t count = 0;
+    TaskNode* last = nullptr;
+    TaskNode* node = first;
+    while (node && free_count + count < kMaxFreeNodes) {
+      last = node;
+      node = node->next;
+      count++;
+    }
+    DeleteNodes(node);
+    if (!last) {
+      return;
+    }
+
+    TaskNode* top = free_nodes_.load(std::memory_order_relaxed);
+    do {
+      last->next = top;
+    } while (!free_nodes_.compare_exchange_weak(
+        top, first, std::memory_order_release, std::memory_order_relaxed));
+    free_node_count_.fetch_add(count, std::memory_order_relaxed);
+  }
+
+  static void DeleteNodes(TaskNode* node) {
+    while (node) {
+      TaskNode* next = node->next;
+      delete node;
+      node = next;
+    }
+  }
+
+  // Runs the tasks posted so far, and the delayed tasks whose delay passed.
+  // Returns the number of tasks run.
+  size_t RunPendingTasks() {
+    const size_t count = RunPostedTasks() + RunExpiredDelayedTasks();
+    run_task_count_.fetch_add(count, std::memory_order_relaxed);
+    return count;
+  }
+
+  // Runs the tasks posted so far without a delay, and moves the others to the
+  // wheel. Returns the number of tasks run.
+  size_t RunPostedTasks() {
+    TaskNode* node =
+        pending_nodes_.exchange(nullptr, std::memory_order_acquire);
+
+    // The stack holds the most recent task first.
+    TaskNode* first = nullptr;
+    while (node) {
+      TaskNode* next = node->next;
+      node->next = first;
+      first = node;
+      node = next;
+    }
+
+    size_t count = 0;
+    size_t dropped_count = 0;
+    for (node = first; node; node = node->next) {
+      if (!shutdown_state_.is_running() && shutdown_state_.ShouldStop()) {
+        node->task = Task();
+        dropped_count++;
+      } else if (node->run_time == TimePoint::min()) {
+        if (!RunTaskCatchingExceptions(node->task)) {
+          failed_task_count_.fetch_add(1, std::memory_order_relaxed);
+        }
+        count++;
+      } else {
+        delayed_tasks_.Schedule(std::move(node->task), node->run_time);
+      }
+    }
+
+    FreeNodes(first);
+    if (dropped_count) {
+      dropped_task_count_.fetch_add(dropped_count, std::memory_order_relaxed);
+    }
+    return count;
+  }
+
+  size_t RunExpiredDelayedTasks() {
+    if (delayed_tasks_.is_empty()) {
+      return 0;
+    }
+
+    // Run once the wheel is done turning, as running them may post more.
+    delayed_tasks_.Advance(Clock::now(), [this](Task&& task) {
+      expired_tasks_.push_back(std::move(task));
+    });
+
+    size_t count = 0;
+    for (Task& task : expired_tasks_) {
+      if (!shutdown_state_.is_running() && shutdown_state_.ShouldStop()) {
+        dropped_task_count_.fetch_add(1, std::memory_order_relaxed);
+      } else {
+        if (!RunTaskCatchingExceptions(task)) {
+          failed_task_count_.fetch_add(1, std::memory_order_relaxed);
+        }
+        count++;
+      }
+    }
+    expired_tasks_.clear();
+    return count;
+  }
+
+  void WaitForTasks() {
+    const EventCount::Key key = tasks_available_.PrepareWait();
+    if (pending_nodes_.load(std::memory_order_relaxed) ||
+        !shutdown_state_.is_running()) {
+      tasks_available_.CancelWait();
+      return;
+    }
+
+    if (delayed_tasks_.is_empty()) {
+      tasks_available_.Wait(key);
+    } else {
+      tasks_available_.WaitUntil(key, delayed_tasks_.next_expiry());
+    }
+  }
+
+  // Stack of posted tasks, most recent first.
+  std::atomic<TaskNode*> pending_nodes_{nullptr};
+
+  // Nodes handed back by the consumer, taken all at once by producers, and
+  // their approximate number.
+  std::atomic<TaskNode*> free_nodes_{nullptr};
+  std::atomic<size_t> free_node_count_{0};
+
+  EventCount tasks_available_;
+
+  // Held by LoopExecution(), such that FinishShutdown() can wait for it to
+  // return.
+  std::mutex loop_lock_;
+
+  ShutdownState shutdown_state_;
+  std::atomic<uint64_t> run_task_count_{0};
+  std::atomic<uint64_t> dropped_task_count_{0};
+  std::atomic<uint64_t> failed_task_count_{0};
+
+  // Only accessed by the consumer.
+  TimerWheel<Task> delayed_tasks_;
+  std::vector<Task> expired_tasks_;
 };
 
 }  // namespace util
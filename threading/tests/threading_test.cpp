@@ -0,0 +1,245 @@
+// Checks the TaskRunners and the building blocks on top of them: that tasks
+// run, in order where promised, that shutting down accounts for every task,
+// and that Futures, parallel algorithms and MpscFifo deliver what was given to
+// them.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <future>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include "threading/include/future.hpp"
+#include "threading/include/nearly_lockless_fifo.hpp"
+#include "threading/include/owning_task_runner.hpp"
+#include "threading/include/parallel.hpp"
+#include "threading/include/task_runner_factory.hpp"
+#include "threading/include/thread_pool_options.hpp"
+
+namespace util {
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+// Generous, as the test may run on a loaded machine.
+constexpr std::chrono::seconds kTimeout{10};
+
+int failures = 0;
+
+void Expect(bool condition, const char* test, const char* what) {
+  if (!condition) {
+    std::cerr << test << ": expected " << what << "\n";
+    failures++;
+  }
+}
+
+// Waits for |future| to be ready, for at most kTimeout.
+template<typename TValue>
+bool WaitFor(const std::future<TValue>& future) {
+  return future.wait_for(kTimeout) == std::future_status::ready;
+}
+
+// Posts tasks which post tasks in turn, and delayed tasks, then checks that
+// ShutdownAndWait(kDrainAll) ran every one of them.
+void TestRunsAllTasks(const char* test,
+                      const std::shared_ptr<OwningTaskRunner>& task_runner) {
+  constexpr int kTaskCount = 1000;
+  constexpr int kDelayedTaskCount = 3;
+  constexpr std::chrono::milliseconds kDelay{20};
+
+  std::atomic<int> run_count{0};
+  for (int i = 0; i < kTaskCount; i++) {
+    task_runner->PostTask([task_runner, &run_count]() {
+      run_count++;
+      task_runner->PostTask([&run_count]() { run_count++; });
+    });
+  }
+
+  std::atomic<int> delayed_run_count{0};
+  std::atomic<bool> ran_early{false};
+  std::promise<void> delayed_tasks_ran;
+  const Clock::time_point posted_at = Clock::now();
+  for (int i = 0; i < kDelayedTaskCount; i++) {
+    task_runner->PostTaskWithDelay(
+        [&, posted_at]() {
+          if (Clock::now() - posted_at < kDelay) {
+            ran_early = true;
+          }
+          if (++delayed_run_count == kDelayedTaskCount) {
+            delayed_tasks_ran.set_value();
+          }
+        },
+        kDelay);
+  }
+
+  // Delayed tasks still waiting are dropped on shutdown, so wait for those.
+  Expect(WaitFor(delayed_tasks_ran.get_future()), test, "delayed tasks to run");
+  Expect(!ran_early, test, "delayed tasks not to run before their delay");
+
+  const ShutdownStats stats = task_runner->ShutdownAndWait(
+      ShutdownMode::kDrainAll);
+  Expect(run_count == 2 * kTaskCount, test, "every posted task to run");
+  Expect(stats.tasks_run == 2 * kTaskCount + kDelayedTaskCount, test,
+         "tasks_run to count every task");
+  Expect(stats.tasks_dropped == 0, test, "no task to be dropped");
+  Expect(stats.tasks_failed == 0, test, "no task to fail");
+}
+
+void TestMultithreadedTaskRunner(SchedulingMode scheduling_mode,
+                                 const char* test) {
+  ThreadPoolOptions options;
+  options.scheduling_mode = scheduling_mode;
+  TestRunsAllTasks(test, CreateMultithreadedTaskRunner(4, options));
+}
+
+void TestSequencedTaskRunner() {
+  constexpr int kTaskCount = 1000;
+
+  std::shared_ptr<OwningTaskRunner> pool = CreateMultithreadedTaskRunner(4);
+  std::shared_ptr<TaskRunner> sequence = CreateSequencedTaskRunner(pool);
+
+  // Only ever touched by the tasks of |sequence|, which never run at once.
+  std::vector<int> order;
+  for (int i = 0; i < kTaskCount; i++) {
+    sequence->PostTask([&order, i]() { order.push_back(i); });
+  }
+
+  std::promise<std::vector<int>> done;
+  sequence->PostTask([&order, &done]() { done.set_value(order); });
+  std::future<std::vector<int>> result = done.get_future();
+  if (WaitFor(result)) {
+    std::vector<int> expected(kTaskCount);
+    for (int i = 0; i < kTaskCount; i++) {
+      expected[i] = i;
+    }
+    Expect(result.get() == expected, "SequencedTaskRunner",
+           "tasks to run in posting order");
+  } else {
+    Expect(false, "SequencedTaskRunner", "tasks to run");
+  }
+
+  pool->ShutdownAndWait(ShutdownMode::kDrainAll);
+}
+
+void TestFutures() {
+  std::shared_ptr<OwningTaskRunner> pool = CreateMultithreadedTaskRunner(2);
+  std::shared_ptr<OwningTaskRunner> other = CreateSingleThreadedTaskRunner();
+
+  std::promise<int> result;
+  pool->PostTaskAndReturn([]() { return 20; })
+      .Then(other, [](int value) { return value + 1; })
+      .Then(pool, [&result](int value) { result.set_value(2 * value); });
+  std::future<int> value = result.get_future();
+  Expect(WaitFor(value) && value.get() == 42, "Future",
+         "continuations to chain across runners");
+
+  // An exception skips the continuations after it, and reaches the end.
+  std::atomic<bool> continuation_ran{false};
+  Future<int> failed =
+      pool->PostTaskAndReturn([]() -> int { throw std::runtime_error("x"); })
+          .Then(other, [&continuation_ran](int value) {
+            continuation_ran = true;
+            return value;
+          });
+  const Clock::time_point deadline = Clock::now() + kTimeout;
+  while (!failed.is_ready() && Clock::now() < deadline) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  Expect(failed.is_ready() && failed.exception(), "Future",
+         "the exception of a task to reach the end of the chain");
+  Expect(!continuation_ran, "Future", "continuations after it to be skipped");
+
+  pool->ShutdownAndWait(ShutdownMode::kDrainAll);
+  other->ShutdownAndWait(ShutdownMode::kDrainAll);
+}
+
+void TestParallelAlgorithms() {
+  constexpr size_t kCount = 100000;
+
+  std::shared_ptr<OwningTaskRunner> pool = CreateMultithreadedTaskRunner(4);
+
+  std::mt19937 random(1234);
+  std::vector<uint32_t> values(kCount);
+  for (uint32_t& value : values) {
+    value = random();
+  }
+  std::vector<uint32_t> expected = values;
+  std::sort(expected.begin(), expected.end());
+  ParallelSort(pool, values.begin(), values.end());
+  Expect(values == expected, "ParallelSort", "the values to be sorted");
+
+  const uint64_t sum = ParallelReduce(
+      pool, 0, kCount, 0, uint64_t{0},
+      [](size_t i) { return static_cast<uint64_t>(i); },
+      std::plus<uint64_t>());
+  Expect(sum == uint64_t{kCount} * (kCount - 1) / 2, "ParallelReduce",
+         "the sum of the indices");
+
+  pool->ShutdownAndWait(ShutdownMode::kDrainAll);
+}
+
+// Producers push far more values than the FIFO holds, such that they go
+// through the overflow queue, and each must still come out in order.
+void TestMpscFifo() {
+  constexpr int kProducerCount = 4;
+  constexpr int kValueCount = 10000;
+
+  MpscFifo<int, 8> fifo;
+  std::vector<std::thread> producers;
+  for (int producer = 0; producer < kProducerCount; producer++) {
+    producers.emplace_back([&fifo, producer]() {
+      for (int i = 0; i < kValueCount; i++) {
+        fifo.Enqueue(producer * kValueCount + i);
+      }
+    });
+  }
+
+  std::vector<int> next(kProducerCount, 0);
+  bool is_in_order = true;
+  int received = 0;
+  const Clock::time_point deadline = Clock::now() + kTimeout;
+  while (received < kProducerCount * kValueCount && Clock::now() < deadline) {
+    Optional<int> value = fifo.Dequeue();
+    if (!value.has_value()) {
+      std::this_thread::yield();
+      continue;
+    }
+
+    const int producer = value.value() / kValueCount;
+    is_in_order &= value.value() % kValueCount == next[producer];
+    next[producer] = value.value() % kValueCount + 1;
+    received++;
+  }
+
+  for (std::thread& producer : producers) {
+    producer.join();
+  }
+  Expect(received == kProducerCount * kValueCount, "MpscFifo",
+         "every value to be received");
+  Expect(is_in_order, "MpscFifo", "the values of each producer in order");
+}
+
+}  // namespace
+}  // namespace util
+
+int main() {
+  util::TestMultithreadedTaskRunner(util::SchedulingMode::kSharedQueue,
+                                    "kSharedQueue");
+  util::TestMultithreadedTaskRunner(util::SchedulingMode::kWorkStealing,
+                                    "kWorkStealing");
+  util::TestRunsAllTasks("SingleThreadedTaskRunner",
+                         util::CreateSingleThreadedTaskRunner());
+  util::TestSequencedTaskRunner();
+  util::TestFutures();
+  util::TestParallelAlgorithms();
+  util::TestMpscFifo();
+
+  return util::failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,429 @@
+#ifndef DC647ABF_28E0_4F64_B049_AB7950029774
+#define DC647ABF_28E0_4F64_B049_AB7950029774
+
+#include <cassert>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+#include "memory/include/optional.hpp"
+
+namespace util {
+
+// Hierarchical timing wheel with a resolution of one millisecond, used to hold
+// elements until a deadline.
+//
+// Elements live in one of |kLevelCount| wheels of |kSlotsPerLevel| slots, where
+// each slot of level L spans kSlotsPerLevel^L ticks. An element is placed on the
+// lowest level whose range reaches its deadline, and moves down one or more
+// levels each time the wheel turns past its slot, such that Schedule() and
+// Cancel() are O(1) and Advance() is O(1) per tick plus O(1) per element. The
+// wheels span about 4.6 hours; elements further out wait in a separate list
+// which is re-examined each time the top wheel wraps around.
+//
+// Nodes are kept in a single vector and linked by index, and freed nodes are
+// reused, such that a steady state of scheduling does not allocate.
+//
+// NOTE: Not thread-safe.
+template<typename TDataType>
+class TimerWheel {
+ public:
+  using Clock = std::chrono::steady_clock;
+  using TimePoint = Clock::time_point;
+  using Tick = std::chrono::milliseconds;
+
+  static constexpr uint32_t kInvalidIndex = UINT32_MAX;
+
+  // Identifies a scheduled element for Cancel(). Handles of elements which
+  // already expired or were cancelled are detected as stale, even once their
+  // node has been reused.
+  struct Handle {
+    uint32_t index = kInvalidIndex;
+    uint32_t generation = 0;
+  };
+
+  explicit TimerWheel(TimePoint now = Clock::now()) : start_(now) {
+    for (size_t i = 0; i < kListCount; i++) {
+      lists_[i].head = kInvalidIndex;
+      lists_[i].tail = kInvalidIndex;
+    }
+    for (size_t level = 0; level < kLevelCount; level++) {
+      occupied_slots_[level] = 0;
+    }
+  }
+
+  ~TimerWheel() = default;
+
+  TimerWheel(const TimerWheel& other) = delete;
+  TimerWheel(TimerWheel&& other) = delete;
+
+  // Holds |data| until |deadline|. The deadline is rounded up to the next tick,
+  // so elements never expire early.
+  Handle Schedule(TDataType data, TimePoint deadline);
+
+  // Removes the element identified by |handle| without running it. Returns
+  // false if it already expired or was cancelled.
+  bool Cancel(Handle handle);
+
+  // Moves the wheel forward to |now|, calling |on_expired| with every element
+  // whose deadline has passed. Returns the number of expired elements.
+  template<typename TFunctor>
+  size_t Advance(TimePoint now, TFunctor on_expired);
+
+  // Removes every element without handing it out. Returns the number of
+  // elements removed.
+  size_t Clear();
+
+  // Lower bound of the earliest deadline, or TimePoint::max() if empty.
+  TimePoint next_expiry() const;
+
+  size_t size() const {
+    return size_;
+  }
+
+  bool is_empty() const {
+    return size_ == 0;
+  }
+
+ private:
+  static constexpr size_t kSlotBits = 6;
+  static constexpr size_t kSlotsPerLevel = size_t{1} << kSlotBits;
+  static constexpr size_t kLevelCount = 4;
+
+  // Lists are numbered level * kSlotsPerLevel + slot, followed by elements
+  // which are due but were not handed out yet, then by elements beyond the
+  // range of the top level.
+  static constexpr size_t kReadyList = kLevelCount * kSlotsPerLevel;
+  static constexpr size_t kFarFutureList = kReadyList + 1;
+  static constexpr size_t kListCount = kFarFutureList + 1;
+  static constexpr uint16_t kNoList = UINT16_MAX;
+
+  struct Node {
+    Optional<TDataType> data;
+    uint64_t expiry_tick = 0;
+    uint32_t previous = kInvalidIndex;
+    uint32_t next = kInvalidIndex;
+    uint32_t generation = 0;
+    uint16_t list = kNoList;
+  };
+
+  struct List {
+    uint32_t head;
+    uint32_t tail;
+  };
+
+  uint64_t ToTick(TimePoint time, bool round_up) const;
+
+  // Links |nodes_[index]| into the list matching its expiry tick.
+  void Insert(uint32_t index);
+  void Link(uint32_t index, size_t list);
+  void Unlink(uint32_t index);
+
+  // Releases |nodes_[index]| for reuse, invalidating its handles.
+  void Free(uint32_t index);
+
+  // Re-inserts every element of |list|, relative to |current_tick_|.
+  void Redistribute(size_t list);
+
+  // Hands every element of |list| to |on_expired|.
+  template<typename TFunctor>
+  size_t Expire(size_t list, TFunctor& on_expired);
+
+  const TimePoint start_;
+
+  // Last tick processed by Advance(), counted from |start_|.
+  uint64_t current_tick_ = 0;
+
+  std::vector<Node> nodes_;
+  uint32_t free_nodes_ = kInvalidIndex;
+  size_t size_ = 0;
+
+  List lists_[kListCount];
+
+  // One bit per slot of each level, set if the slot's list is non-empty.
+  uint64_t occupied_slots_[kLevelCount];
+};
+
+template<typename TDataType>
+constexpr uint32_t TimerWheel<TDataType>::kInvalidIndex;
+
+template<typename TDataType>
+typename TimerWheel<TDataType>::Handle
+TimerWheel<TDataType>::Schedule(TDataType data, TimePoint deadline) {
+  uint32_t index = free_nodes_;
+  if (index != kInvalidIndex) {
+    free_nodes_ = nodes_[index].next;
+  } else {
+    index = static_cast<uint32_t>(nodes_.size());
+    nodes_.emplace_back();
+  }
+
+  Node& node = nodes_[index];
+  node.data = std::move(data);
+  node.expiry_tick = ToTick(deadline, true);
+  Insert(index);
+  size_++;
+
+  Handle handle;
+  handle.index = index;
+  handle.generation = node.generation;
+  return handle;
+}
+
+template<typename TDataType>
+bool TimerWheel<TDataType>::Cancel(Handle handle) {
+  if (handle.index >= nodes_.size()) {
+    return false;
+  }
+
+  Node& node = nodes_[handle.index];
+  if (node.generation != handle.generation || node.list == kNoList) {
+    return false;
+  }
+
+  Unlink(handle.index);
+  Free(handle.index);
+  return true;
+}
+
+template<typename TDataType>
+size_t TimerWheel<TDataType>::Clear() {
+  const size_t count = size_;
+  for (size_t list = 0; list < kListCount; list++) {
+    uint32_t index;
+    while ((index = lists_[list].head) != kInvalidIndex) {
+      Unlink(index);
+      Free(index);
+    }
+  }
+  return count;
+}
+
+template<typename TDataType>
+template<typename TFunctor>
+size_t TimerWheel<TDataType>::Advance(TimePoint now, TFunctor on_expired) {
+  const uint64_t target_tick = ToTick(now, false);
+  size_t count = Expire(kReadyList, on_expired);
+
+  while (current_tick_ < target_tick) {
+    if (size_ == 0) {
+      current_tick_ = target_tick;
+      break;
+    }
+
+    // Nothing can expire before the next time the lowest wheel wraps around,
+    // so skip ahead.
+    if (occupied_slots_[0] == 0) {
+      const uint64_t last_quiet_tick = current_tick_ | (kSlotsPerLevel - 1);
+      if (last_quiet_tick >= target_tick) {
+        current_tick_ = target_tick;
+        break;
+      }
+      current_tick_ = last_quiet_tick;
+    }
+
+    current_tick_++;
+
+    // Move elements down from the slots which start at this tick, from the top
+    // down such that an element can fall through several levels at once.
+    const uint64_t kWheelSpan = uint64_t{1} << (kSlotBits * kLevelCount);
+    if ((current_tick_ & (kWheelSpan - 1)) == 0) {
+      Redistribute(kFarFutureList);
+    }
+    for (size_t level = kLevelCount - 1; level > 0; level--) {
+      const size_t shift = kSlotBits * level;
+      if ((current_tick_ & ((uint64_t{1} << shift) - 1)) != 0) {
+        continue;
+      }
+
+      const size_t slot =
+          static_cast<size_t>(current_tick_ >> shift) & (kSlotsPerLevel - 1);
+      Redistribute(level * kSlotsPerLevel + slot);
+    }
+
+    // Elements moved down which expire at exactly this tick land in
+    // |kReadyList| rather than in the lowest wheel.
+    count += Expire(
+        static_cast<size_t>(current_tick_) & (kSlotsPerLevel - 1), on_expired);
+    count += Expire(kReadyList, on_expired);
+  }
+
+  return count;
+}
+
+template<typename TDataType>
+typename TimerWheel<TDataType>::TimePoint
+TimerWheel<TDataType>::next_expiry() const {
+  if (size_ == 0) {
+    return TimePoint::max();
+  }
+  if (lists_[kReadyList].head != kInvalidIndex) {
+    return start_ + Tick(current_tick_);
+  }
+
+  // Every element of a level expires after every element of the levels below
+  // it, and slots of a level are only occupied after the current position.
+  for (size_t level = 0; level < kLevelCount; level++) {
+    if (occupied_slots_[level] == 0) {
+      continue;
+    }
+
+    const size_t shift = kSlotBits * level;
+    const size_t current_slot =
+        static_cast<size_t>(current_tick_ >> shift) & (kSlotsPerLevel - 1);
+    const uint64_t later_slots =
+        current_slot + 1 == kSlotsPerLevel
+            ? 0
+            : occupied_slots_[level] & (~uint64_t{0} << (current_slot + 1));
+    assert(later_slots != 0);
+
+    const uint64_t slot = static_cast<uint64_t>(__builtin_ctzll(later_slots));
+    const uint64_t level_base =
+        current_tick_ & ~((uint64_t{1} << (shift + kSlotBits)) - 1);
+    return start_ + Tick(level_base + (slot << shift));
+  }
+
+  const uint64_t kWheelSpan = uint64_t{1} << (kSlotBits * kLevelCount);
+  return start_ + Tick((current_tick_ | (kWheelSpan - 1)) + 1);
+}
+
+template<typename TDataType>
+uint64_t TimerWheel<TDataType>::ToTick(TimePoint time, bool round_up) const {
+  if (time <= start_) {
+    return 0;
+  }
+
+  const auto elapsed =
+      std::chrono::duration_cast<std::chrono::nanoseconds>(time - start_);
+  const auto tick_length = std::chrono::duration_cast<std::chrono::nanoseconds>(
+      Tick(1));
+  uint64_t tick = static_cast<uint64_t>(elapsed.count() / tick_length.count());
+  if (round_up && elapsed.count() % tick_length.count() != 0) {
+    tick++;
+  }
+  return tick;
+}
+
+template<typename TDataType>
+void TimerWheel<TDataType>::Insert(uint32_t index) {
+  const uint64_t expiry_tick = nodes_[index].expiry_tick;
+  if (expiry_tick <= current_tick_) {
+    Link(index, kReadyList);
+    return;
+  }
+
+  // The highest group of |kSlotBits| bits in which the expiry differs from the
+  // current tick decides the level, as all lower groups wrap around before
+  // then.
+  const size_t highest_bit =
+      63 - static_cast<size_t>(__builtin_clzll(expiry_tick ^ current_tick_));
+  const size_t level = highest_bit / kSlotBits;
+  if (level >= kLevelCount) {
+    Link(index, kFarFutureList);
+    return;
+  }
+
+  const size_t slot = static_cast<size_t>(expiry_tick >> (kSlotBits * level)) &
+                      (kSlotsPerLevel - 1);
+  Link(index, level * kSlotsPerLevel + slot);
+}
+
+template<typename TDataType>
+void TimerWheel<TDataType>::Link(uint32_t index, size_t list) {
+  Node& node = nodes_[index];
+  List& target = lists_[list];
+
+  node.list = static_cast<uint16_t>(list);
+  node.previous = target.tail;
+  node.next = kInvalidIndex;
+  if (target.tail != kInvalidIndex) {
+    nodes_[target.tail].next = index;
+  } else {
+    target.head = index;
+  }
+  target.tail = index;
+
+  if (list < kReadyList) {
+    occupied_slots_[list / kSlotsPerLevel] |=
+        uint64_t{1} << (list % kSlotsPerLevel);
+  }
+}
+
+template<typename TDataType>
+void TimerWheel<TDataType>::Unlink(uint32_t index) {
+  Node& node = nodes_[index];
+  const size_t list = node.list;
+  List& source = lists_[list];
+
+  if (node.previous != kInvalidIndex) {
+    nodes_[node.previous].next = node.next;
+  } else {
+    source.head = node.next;
+  }
+  if (node.next != kInvalidIndex) {
+    nodes_[node.next].previous = node.previous;
+  } else {
+    source.tail = node.previous;
+  }
+
+  node.list = kNoList;
+  node.previous = kInvalidIndex;
+  node.next = kInvalidIndex;
+
+  if (list < kReadyList && source.head == kInvalidIndex) {
+    occupied_slots_[list / kSlotsPerLevel] &=
+        ~(uint64_t{1} << (list % kSlotsPerLevel));
+  }
+}
+
+template<typename TDataType>
+void TimerWheel<TDataType>::Free(uint32_t index) {
+  Node& node = nodes_[index];
+  node.data.reset();
+  node.generation++;
+  node.next = free_nodes_;
+  free_nodes_ = index;
+  size_--;
+}
+
+template<typename TDataType>
+void TimerWheel<TDataType>::Redistribute(size_t list) {
+  // Detach the whole list first, as elements of |kFarFutureList| may be
+  // inserted right back into it.
+  uint32_t index = lists_[list].head;
+  lists_[list].head = kInvalidIndex;
+  lists_[list].tail = kInvalidIndex;
+  if (list < kReadyList) {
+    occupied_slots_[list / kSlotsPerLevel] &=
+        ~(uint64_t{1} << (list % kSlotsPerLevel));
+  }
+
+  while (index != kInvalidIndex) {
+    const uint32_t next = nodes_[index].next;
+    Insert(index);
+    index = next;
+  }
+}
+
+template<typename TDataType>
+template<typename TFunctor>
+size_t TimerWheel<TDataType>::Expire(size_t list, TFunctor& on_expired) {
+  size_t count = 0;
+  uint32_t index;
+  while ((index = lists_[list].head) != kInvalidIndex) {
+    Unlink(index);
+    TDataType data = std::move(nodes_[index].data.value());
+    Free(index);
+
+    // Called last, such that |on_expired| may safely schedule new elements.
+    on_expired(std::move(data));
+    count++;
+  }
+  return count;
+}
+
+}  // namespace util
+
+#endif /* DC647ABF_28E0_4F64_B049_AB7950029774 */
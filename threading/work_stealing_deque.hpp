@@ -0,0 +1,189 @@
+#ifndef CF8DD282_E2BC_45CB_97BB_E159D217CAF5
+#define CF8DD282_E2BC_45CB_97BB_E159D217CAF5
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <type_traits>
+#include <vector>
+
+#include "memory/include/optional.hpp"
+#include "threading/include/queue_policies.hpp"
+
+namespace util {
+
+// Unbounded Chase-Lev work-stealing deque, following "Correct and Efficient
+// Work-Stealing for Weak Memory Models" (Le et al., 2013).
+//
+// A single owner thread pushes and pops at the bottom, while any thread may
+// steal from the top. The buffer doubles in size whenever it fills up, and is
+// never shrunk.
+//
+// Thieves may read a slot at the same time as the owner overwrites it after a
+// wrap-around, in which case the value read is discarded. For that read to be
+// well defined elements are stored in atomics, so |TDataType| must be trivially
+// copyable. Store pointers to larger objects.
+template<typename TDataType>
+class WorkStealingDeque {
+ public:
+  static_assert(std::is_trivially_copyable<TDataType>::value,
+                "WorkStealingDeque elements must be trivially copyable");
+
+  explicit WorkStealingDeque(size_t initial_capacity = 256);
+  ~WorkStealingDeque() = default;
+
+  WorkStealingDeque(const WorkStealingDeque& other) = delete;
+  WorkStealingDeque(WorkStealingDeque&& other) = delete;
+
+  // Owner operations. Must only be called by one thread at a time.
+  void Push(TDataType data);
+  Optional<TDataType> Pop();
+
+  // Removes the element at the top of the deque. May be called from any
+  // thread, including the owner. Returns nullopt if the deque was empty or
+  // another thread took the top element first.
+  Optional<TDataType> Steal();
+
+  // NOTE: Snapshots, which may be stale by the time they return.
+  bool is_empty() const {
+    return size() == 0;
+  }
+
+  size_t size() const {
+    const int64_t bottom = bottom_.load(std::memory_order_relaxed);
+    const int64_t top = top_.load(std::memory_order_relaxed);
+    return bottom > top ? static_cast<size_t>(bottom - top) : size_t{0};
+  }
+
+ private:
+  class Buffer {
+   public:
+    explicit Buffer(size_t capacity)
+        : mask_(capacity - 1), slots_(new std::atomic<TDataType>[capacity]) {}
+
+    size_t capacity() const {
+      return mask_ + 1;
+    }
+
+    TDataType Load(int64_t index) const {
+      return slots_[static_cast<size_t>(index) & mask_].load(
+          std::memory_order_relaxed);
+    }
+
+    void Store(int64_t index, TDataType data) {
+      slots_[static_cast<size_t>(index) & mask_].store(
+          data, std::memory_order_relaxed);
+    }
+
+    // Returns a buffer of twice the capacity holding elements [|top|,
+    // |bottom|) at the same indices.
+    Buffer* Grow(int64_t top, int64_t bottom) const {
+      Buffer* buffer = new Buffer(capacity() * 2);
+      for (int64_t i = top; i < bottom; i++) {
+        buffer->Store(i, Load(i));
+      }
+      return buffer;
+    }
+
+   private:
+    const size_t mask_;
+    std::unique_ptr<std::atomic<TDataType>[]> slots_;
+  };
+
+  // Written by thieves and, when taking the last element, by the owner.
+  std::atomic<int64_t> top_{0};
+
+  // Keeps |top_| and |bottom_| on separate cache lines. Padding is used rather
+  // than alignas, such that deques can be allocated with a plain new before
+  // C++17.
+  char padding_[kCacheLineSize - sizeof(std::atomic<int64_t>)];
+
+  // Only written by the owner.
+  std::atomic<int64_t> bottom_{0};
+  std::atomic<Buffer*> buffer_{nullptr};
+
+  // Every buffer used so far. Thieves may still be reading from a buffer after
+  // it was replaced, so old buffers are only freed along with the deque. Only
+  // accessed by the owner.
+  std::vector<std::unique_ptr<Buffer>> buffers_;
+};
+
+template<typename TDataType>
+WorkStealingDeque<TDataType>::WorkStealingDeque(size_t initial_capacity) {
+  size_t capacity = 1;
+  while (capacity < initial_capacity) {
+    capacity <<= 1;
+  }
+
+  buffers_.emplace_back(new Buffer(capacity));
+  buffer_.store(buffers_.back().get(), std::memory_order_relaxed);
+}
+
+template<typename TDataType>
+void WorkStealingDeque<TDataType>::Push(TDataType data) {
+  const int64_t bottom = bottom_.load(std::memory_order_relaxed);
+  const int64_t top = top_.load(std::memory_order_acquire);
+  Buffer* buffer = buffer_.load(std::memory_order_relaxed);
+
+  if (bottom - top > static_cast<int64_t>(buffer->capacity()) - 1) {
+    buffers_.emplace_back(buffer->Grow(top, bottom));
+    buffer = buffers_.back().get();
+    buffer_.store(buffer, std::memory_order_release);
+  }
+
+  buffer->Store(bottom, data);
+
+  // Publishes both the slot and whatever |data| points to.
+  bottom_.store(bottom + 1, std::memory_order_release);
+}
+
+template<typename TDataType>
+Optional<TDataType> WorkStealingDeque<TDataType>::Pop() {
+  const int64_t bottom = bottom_.load(std::memory_order_relaxed) - 1;
+  Buffer* buffer = buffer_.load(std::memory_order_relaxed);
+  bottom_.store(bottom, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  int64_t top = top_.load(std::memory_order_relaxed);
+
+  if (top > bottom) {
+    bottom_.store(bottom + 1, std::memory_order_relaxed);
+    return nullopt;
+  }
+
+  TDataType data = buffer->Load(bottom);
+  if (top == bottom) {
+    // Last element, so race any thieves for it.
+    const bool is_taken = !top_.compare_exchange_strong(
+        top, top + 1, std::memory_order_seq_cst, std::memory_order_relaxed);
+    bottom_.store(bottom + 1, std::memory_order_relaxed);
+    if (is_taken) {
+      return nullopt;
+    }
+  }
+
+  return data;
+}
+
+template<typename TDataType>
+Optional<TDataType> WorkStealingDeque<TDataType>::Steal() {
+  int64_t top = top_.load(std::memory_order_acquire);
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  const int64_t bottom = bottom_.load(std::memory_order_acquire);
+
+  if (top >= bottom) {
+    return nullopt;
+  }
+
+  TDataType data = buffer_.load(std::memory_order_acquire)->Load(top);
+  if (!top_.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst,
+                                    std::memory_order_relaxed)) {
+    return nullopt;
+  }
+
+  return data;
+}
+
+}  // namespace util
+
+#endif /* CF8DD282_E2BC_45CB_97BB_E159D217CAF5 */
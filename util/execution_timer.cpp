@@ -4,19 +4,28 @@ namespace util {
 
 #ifdef ENABLE_UTIL_EXECUTION_TIMING
 
-ExecutionTimer::ExecutionTimer(
-    const char* func_name, const char* file, int line)
-  : name_(func_name),
-    file_(file),
-    line_(line),
+ExecutionTimer::ExecutionTimer(LogSite* site, const char* func_name)
+  : site_(site),
+    name_(func_name),
     start_time_(std::chrono::system_clock::now()) {}
 
 ExecutionTimer::~ExecutionTimer() {
+#if UTIL_MIN_LOG_LEVEL <= 1
   auto end_time = std::chrono::system_clock::now();
   auto elapsed = std::chrono::duration<double,std::milli>(end_time - start_time_);
 
-  UTIL_STREAM_HELPER_IMPL(kInfo, file_, line_)
+  if (!site_->IsEnabled()) {
+    return;
+  }
+
+#ifdef ENABLE_UTIL_STRUCTURED_LOGGING
+  Logger::LogMessage(*site_).stream()
+#else
+  Logger::CreateLogMessage(Logger::LogLevel::kInfo, site_->file, site_->line)
+      .stream()
+#endif
       << name_ << " completed execution in time " << elapsed.count() << ".";
+#endif
 }
 
 #endif
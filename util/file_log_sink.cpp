@@ -0,0 +1,198 @@
+#include "util/file_log_sink.hpp"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <string>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+namespace util {
+
+FileLogSink::FileLogSink(const FileLogSinkOptions& options)
+    : options_(options),
+      buffer_(new char[options.buffer_size > 0 ? options.buffer_size : 1]) {}
+
+FileLogSink::~FileLogSink() {
+  if (fd_ < 0) {
+    return;
+  }
+
+  WriteOut(nullptr, 0);
+  if (options_.sync_policy != LogSyncPolicy::kNever) {
+    Sync(Clock::now());
+  }
+  close(fd_);
+}
+
+bool FileLogSink::Open() {
+  fd_ = open(options_.path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC,
+             0644);
+  if (fd_ < 0) {
+    return false;
+  }
+
+  struct stat file_stat;
+  file_size_ = fstat(fd_, &file_stat) == 0
+                   ? static_cast<uint64_t>(file_stat.st_size)
+                   : 0;
+  opened_at_ = Clock::now();
+  synced_at_ = opened_at_;
+  return true;
+}
+
+void FileLogSink::Write(const char* data, size_t size) {
+  if (fd_ < 0) {
+    return;
+  }
+
+  const Clock::time_point now = Clock::now();
+  if (ShouldRotate(size, now)) {
+    WriteOut(nullptr, 0);
+    Rotate(now);
+    if (fd_ < 0) {
+      return;
+    }
+  }
+
+  if (buffered_size_ + size <= options_.buffer_size) {
+    std::memcpy(&buffer_[buffered_size_], data, size);
+    buffered_size_ += size;
+    return;
+  }
+
+  WriteOut(data, size);
+  if (options_.sync_policy == LogSyncPolicy::kPeriodic &&
+      now - synced_at_ >= options_.sync_interval) {
+    Sync(now);
+  }
+}
+
+void FileLogSink::Flush() {
+  if (fd_ < 0) {
+    return;
+  }
+
+  WriteOut(nullptr, 0);
+  switch (options_.sync_policy) {
+    case LogSyncPolicy::kNever:
+      break;
+    case LogSyncPolicy::kOnFlush:
+      Sync(Clock::now());
+      break;
+    case LogSyncPolicy::kPeriodic: {
+      const Clock::time_point now = Clock::now();
+      if (now - synced_at_ >= options_.sync_interval) {
+        Sync(now);
+      }
+      break;
+    }
+  }
+}
+
+void FileLogSink::WriteOut(const char* data, size_t size) {
+  struct iovec iov[2];
+  int count = 0;
+  if (buffered_size_ > 0) {
+    iov[count].iov_base = buffer_.get();
+    iov[count].iov_len = buffered_size_;
+    count++;
+  }
+  if (size > 0) {
+    iov[count].iov_base = const_cast<char*>(data);
+    iov[count].iov_len = size;
+    count++;
+  }
+  if (count == 0) {
+    return;
+  }
+
+  WriteAll(iov, count);
+  file_size_ += buffered_size_ + size;
+  buffered_size_ = 0;
+  is_synced_ = false;
+}
+
+void FileLogSink::WriteAll(struct iovec* iov, int count) {
+  while (count > 0) {
+    const ssize_t written = writev(fd_, iov, count);
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return;
+    }
+
+    // Skip over what was written, which may end in the middle of an iovec.
+    size_t remaining = static_cast<size_t>(written);
+    while (count > 0 && remaining >= iov->iov_len) {
+      remaining -= iov->iov_len;
+      iov++;
+      count--;
+    }
+    if (count > 0) {
+      iov->iov_base = static_cast<char*>(iov->iov_base) + remaining;
+      iov->iov_len -= remaining;
+    }
+  }
+}
+
+bool FileLogSink::ShouldRotate(size_t size, Clock::time_point now) const {
+  const uint64_t current_size = file_size_ + buffered_size_;
+  if (current_size == 0) {
+    return false;
+  }
+
+  return (options_.max_file_size > 0 &&
+          current_size + size > options_.max_file_size) ||
+         (options_.max_file_age.count() > 0 &&
+          now - opened_at_ >= options_.max_file_age);
+}
+
+void FileLogSink::Rotate(Clock::time_point now) {
+  if (options_.sync_policy != LogSyncPolicy::kNever) {
+    Sync(now);
+  }
+  close(fd_);
+  fd_ = -1;
+
+  // Shift the rotated files up by one, dropping the oldest.
+  const std::string& path = options_.path;
+  if (options_.max_rotated_files == 0) {
+    unlink(path.c_str());
+  } else {
+    std::string from;
+    std::string to = path + "." + std::to_string(options_.max_rotated_files);
+    for (size_t i = options_.max_rotated_files - 1; i > 0; i--) {
+      from = path + "." + std::to_string(i);
+      std::rename(from.c_str(), to.c_str());
+      to.swap(from);
+    }
+    std::rename(path.c_str(), to.c_str());
+  }
+
+  Open();
+  is_synced_ = true;
+}
+
+void FileLogSink::Sync(Clock::time_point now) {
+  if (!is_synced_) {
+    fdatasync(fd_);
+    is_synced_ = true;
+  }
+  synced_at_ = now;
+}
+
+std::unique_ptr<LogSink> CreateFileLogSink(const FileLogSinkOptions& options) {
+  std::unique_ptr<FileLogSink> sink(new FileLogSink(options));
+  if (!sink->Open()) {
+    return nullptr;
+  }
+
+  return sink;
+}
+
+}  // namespace util
@@ -0,0 +1,67 @@
+#ifndef EC9EF91B_A3B7_471F_8B63_D5FF1A75A744
+#define EC9EF91B_A3B7_471F_8B63_D5FF1A75A744
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+#include "util/include/log_sink.hpp"
+
+struct iovec;
+
+namespace util {
+
+// LogSink appending to a file, through a buffer of its own. Whatever does not
+// fit in the buffer is written out along with it, with a single writev(),
+// rather than copied. Rotation and syncing happen on the logging thread, so
+// the threads which log never wait for them, unless their queue fills up
+// meanwhile.
+class FileLogSink : public LogSink {
+ public:
+  explicit FileLogSink(const FileLogSinkOptions& options);
+  ~FileLogSink() override;
+
+  FileLogSink(const FileLogSink& other) = delete;
+  FileLogSink& operator=(const FileLogSink& other) = delete;
+
+  // Opens the file. Returns false if it cannot be opened.
+  bool Open();
+
+  void Write(const char* data, size_t size) override;
+  void Flush() override;
+
+ private:
+  using Clock = std::chrono::steady_clock;
+
+  // Writes out the buffer, followed by |size| bytes of |data|.
+  void WriteOut(const char* data, size_t size);
+
+  // Writes all of |iov|, retrying on partial writes. Output which cannot be
+  // written is dropped, as there is nowhere left to report the error.
+  void WriteAll(struct iovec* iov, int count);
+
+  bool ShouldRotate(size_t size, Clock::time_point now) const;
+  void Rotate(Clock::time_point now);
+
+  // Syncs the file if anything was written to it since the last sync.
+  void Sync(Clock::time_point now);
+
+  const FileLogSinkOptions options_;
+
+  int fd_ = -1;
+
+  std::unique_ptr<char[]> buffer_;
+  size_t buffered_size_ = 0;
+
+  // Bytes written to the current file, not counting those still buffered.
+  uint64_t file_size_ = 0;
+  Clock::time_point opened_at_;
+
+  bool is_synced_ = true;
+  Clock::time_point synced_at_;
+};
+
+}  // namespace util
+
+#endif /* EC9EF91B_A3B7_471F_8B63_D5FF1A75A744 */
@@ -19,4 +19,17 @@
 #endif
 #endif
 
+// Hint to the CPU that the calling thread is busy-waiting, such that it may
+// save power and yield pipeline resources to a sibling hyper-thread.
+#if !defined(CPU_RELAX)
+#if (defined(__clang__) || defined(__GNUC__)) && \
+    (defined(__x86_64__) || defined(__i386__))
+#define CPU_RELAX() __builtin_ia32_pause()
+#elif (defined(__clang__) || defined(__GNUC__)) && defined(__aarch64__)
+#define CPU_RELAX() __asm__ __volatile__("yield")
+#else
+#define CPU_RELAX()
+#endif
+#endif
+
 #endif /* FE182BF4_98A4_4BFF_A9FD_FBE612C21B38 */
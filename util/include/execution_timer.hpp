@@ -24,7 +24,11 @@ namespace util {
 static_assert(false) << "Logging must be enabled for TIME_OPERATION's use.";
 #endif
 
-#define TIME_OPERATION (ExecutionTimer(__UTIL_FUNC_NAME__, __FILE__,__LINE__))
+// Each use gets a LogSite of its own, such that its timings are logged with
+// its file and line, and filtered by the level of its module.
+#define TIME_OPERATION \
+  (::util::ExecutionTimer(UTIL_LOG_SITE(kInfo, __FILE__, __LINE__), \
+                          __UTIL_FUNC_NAME__))
 
 // Define the __UTIL_FUNC_NAME__ macro based on what compiler-specific
 // function name macros are available.
@@ -44,13 +48,12 @@ static_assert(false) << "Logging must be enabled for TIME_OPERATION's use.";
 
 class ExecutionTimer {
 public:
-  ExecutionTimer(const char* func_name, const char* file, int line);
+  ExecutionTimer(LogSite* site, const char* func_name);
   ~ExecutionTimer();
 
  private:
+  LogSite* const site_;
   const char* name_;
-  const char* file_;
-  const int line_;
 
   std::chrono::time_point<std::chrono::system_clock> start_time_;
 };
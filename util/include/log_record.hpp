@@ -0,0 +1,607 @@
+#ifndef A5EC3EF1_C88D_444A_A345_C3038F571A12
+#define A5EC3EF1_C88D_444A_A345_C3038F571A12
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <ios>
+#include <limits>
+#include <ostream>
+#include <streambuf>
+#include <string>
+#include <thread>
+#include <type_traits>
+
+#include "util/include/compiler_hints.hpp"
+
+namespace util {
+
+// Static description of a logging call site, of which the LOG_UTIL_* macros
+// define one per call site. Sites are constant-initialized, so they cost
+// nothing until they first log, then register themselves for the lifetime of
+// the process, such that records only need to point to them.
+//
+// Each site holds its own copy of the minimum level set for its module, which
+// is updated whenever that level changes, such that checking whether the site
+// is enabled takes a single relaxed load, and enabling a module only affects
+// the sites of that module.
+struct LogSite {
+  // |file| must outlive the process, as a string literal does.
+  constexpr LogSite(int level, const char* file, int line)
+      : level(level), file(file), line(line) {}
+
+  LogSite(const LogSite& other) = delete;
+  LogSite& operator=(const LogSite& other) = delete;
+
+  bool IsEnabled() {
+    const int min_level = min_level_.load(std::memory_order_relaxed);
+    return level >= min_level ||
+           (UNLIKELY(min_level == kUnregistered) && Register());
+  }
+
+  // Returns the most recently registered site, from which every other site can
+  // be reached through |next|.
+  static const LogSite* registered_sites();
+
+  // Sets the minimum level of sites in modules without a level of their own.
+  static void SetDefaultMinLevel(int level);
+
+  // Sets or clears the minimum level of the sites of |module|, the name of
+  // their source file without its directory and extension.
+  static void SetModuleMinLevel(const std::string& module, int level);
+  static void ClearModuleMinLevel(const std::string& module);
+
+  // A Logger::LogLevel.
+  const int level;
+  const char* const file;
+  const int line;
+
+  // Index of the site in registration order, and site registered before this
+  // one, once registered.
+  uint32_t id = 0;
+  LogSite* next = nullptr;
+
+ private:
+  static constexpr int kUnregistered = std::numeric_limits<int>::max();
+
+  // Registers the site, then returns whether it is enabled.
+  bool Register();
+
+  // Stores the current level of its module into every registered site.
+  //
+  // NOTE: Only called with the lock of the registered sites held.
+  static void UpdateMinLevels();
+
+  std::atomic<int> min_level_{kUnregistered};
+};
+
+// Formatting state of a stream, as set by manipulators (e.g. std::hex,
+// std::setw() or std::setprecision()), recorded along with the arguments of a
+// LogRecord such that they are formatted as they would have been right away.
+struct LogFormat {
+  // State of a newly constructed stream.
+  static LogFormat Default() {
+    return LogFormat{std::ios_base::skipws | std::ios_base::dec, 6, 0, ' '};
+  }
+
+  template<typename TStream>
+  static LogFormat Of(const TStream& stream) {
+    return LogFormat{stream.flags(), stream.precision(), stream.width(),
+                     stream.fill()};
+  }
+
+  template<typename TStream>
+  void ApplyTo(TStream& stream) const {
+    stream.flags(flags);
+    stream.precision(precision);
+    stream.width(width);
+    stream.fill(fill);
+  }
+
+  bool operator==(const LogFormat& other) const {
+    return flags == other.flags && precision == other.precision &&
+           width == other.width && fill == other.fill;
+  }
+
+  bool operator!=(const LogFormat& other) const {
+    return !(*this == other);
+  }
+
+  std::ios_base::fmtflags flags;
+  std::streamsize precision;
+
+  // Only applies to the next argument, as with streams.
+  std::streamsize width;
+
+  char fill;
+};
+
+// A log statement as its call site and the raw bytes of its arguments, to be
+// formatted later by the logging thread. Records have a fixed size and hold no
+// pointer to anything but their site, such that composing and queuing one never
+// allocates. Arguments which do not fit are dropped, and strings truncated,
+// and the record is then marked as truncated.
+class LogRecord {
+ public:
+  // Encoding of an argument, stored as a single byte ahead of its value.
+  enum class ArgumentType : uint8_t {
+    kBool,
+    kChar,
+    kSigned,    // As int64_t.
+    kUnsigned,  // As uint64_t.
+    kDouble,
+    kPointer,   // As const void*.
+    kString,    // As a uint16_t size, followed by the characters.
+    kFormat,    // As the uint32_t flags, int32_t precision and width, and
+                // char fill of a LogFormat, applying to the arguments after
+                // it.
+  };
+
+  // Total size of a record, including its header.
+  static constexpr size_t kSize = 256;
+
+  LogRecord() = default;
+
+  void Reset(const LogSite* site) {
+    site_ = site;
+    thread_id_ = std::this_thread::get_id();
+    timestamp_ = std::chrono::steady_clock::now().time_since_epoch().count();
+    size_ = 0;
+    is_truncated_ = false;
+  }
+
+  void AppendBool(bool value) {
+    AppendValue(ArgumentType::kBool, value);
+  }
+
+  void AppendChar(char value) {
+    AppendValue(ArgumentType::kChar, value);
+  }
+
+  void AppendSigned(int64_t value) {
+    AppendValue(ArgumentType::kSigned, value);
+  }
+
+  void AppendUnsigned(uint64_t value) {
+    AppendValue(ArgumentType::kUnsigned, value);
+  }
+
+  void AppendDouble(double value) {
+    AppendValue(ArgumentType::kDouble, value);
+  }
+
+  void AppendPointer(const void* value) {
+    AppendValue(ArgumentType::kPointer, value);
+  }
+
+  void AppendFormat(const LogFormat& format) {
+    if (size_ + 1 + kFormatSize > kArgumentCapacity) {
+      is_truncated_ = true;
+      return;
+    }
+
+    arguments_[size_] = static_cast<char>(ArgumentType::kFormat);
+    char* out = &arguments_[size_ + 1];
+    const uint32_t flags = static_cast<uint32_t>(format.flags);
+    const int32_t precision = static_cast<int32_t>(format.precision);
+    const int32_t width = static_cast<int32_t>(format.width);
+    std::memcpy(out, &flags, sizeof(flags));
+    std::memcpy(out + 4, &precision, sizeof(precision));
+    std::memcpy(out + 8, &width, sizeof(width));
+    out[12] = format.fill;
+    size_ += static_cast<uint16_t>(1 + kFormatSize);
+  }
+
+  // Returns the number of characters appended, which is less than |size| if
+  // the string was truncated.
+  size_t AppendString(const char* data, size_t size) {
+    constexpr size_t kHeaderSize = 1 + sizeof(uint16_t);
+    if (size_ + kHeaderSize >= kArgumentCapacity) {
+      is_truncated_ = true;
+      return 0;
+    }
+
+    const size_t available = kArgumentCapacity - size_ - kHeaderSize;
+    if (size > available) {
+      size = available;
+      is_truncated_ = true;
+    }
+
+    const uint16_t stored_size = static_cast<uint16_t>(size);
+    arguments_[size_] = static_cast<char>(ArgumentType::kString);
+    std::memcpy(&arguments_[size_ + 1], &stored_size, sizeof(stored_size));
+    std::memcpy(&arguments_[size_ + kHeaderSize], data, size);
+    size_ += static_cast<uint16_t>(kHeaderSize + size);
+    return size;
+  }
+
+  // Calls |visitor| with each argument in order, as a bool, char, int64_t,
+  // uint64_t, double or const void*, or as a (const char*, size_t) pair for
+  // strings, and with the LogFormat applying to the arguments after it. Stops
+  // at the first argument which does not fit in the record, such that records
+  // read back from a damaged file are safe to visit.
+  template<typename TVisitor>
+  void VisitArguments(TVisitor&& visitor) const {
+    size_t offset = 0;
+    while (offset < size_) {
+      const ArgumentType type = static_cast<ArgumentType>(arguments_[offset]);
+      offset++;
+      const size_t value_size = ValueSize(type);
+      if (value_size == 0 || offset + value_size > size_) {
+        return;
+      }
+
+      switch (type) {
+        case ArgumentType::kBool:
+          visitor(ReadValue<uint8_t>(offset) != 0);
+          break;
+        case ArgumentType::kChar:
+          visitor(ReadValue<char>(offset));
+          break;
+        case ArgumentType::kSigned:
+          visitor(ReadValue<int64_t>(offset));
+          break;
+        case ArgumentType::kUnsigned:
+          visitor(ReadValue<uint64_t>(offset));
+          break;
+        case ArgumentType::kDouble:
+          visitor(ReadValue<double>(offset));
+          break;
+        case ArgumentType::kPointer:
+          visitor(ReadValue<const void*>(offset));
+          break;
+        case ArgumentType::kString: {
+          const uint16_t size = ReadValue<uint16_t>(offset);
+          if (offset + size > size_) {
+            return;
+          }
+          visitor(&arguments_[offset], static_cast<size_t>(size));
+          offset += size;
+          break;
+        }
+        case ArgumentType::kFormat: {
+          LogFormat format;
+          format.flags =
+              static_cast<std::ios_base::fmtflags>(ReadValue<uint32_t>(offset));
+          format.precision = ReadValue<int32_t>(offset);
+          format.width = ReadValue<int32_t>(offset);
+          format.fill = ReadValue<char>(offset);
+          visitor(format);
+          break;
+        }
+      }
+    }
+  }
+
+  // Encoded arguments of the record, as copied as they are by binary sinks.
+  const char* encoded_arguments() const { return arguments_; }
+  size_t encoded_arguments_size() const { return size_; }
+
+  // Replaces the arguments of the record with |size| bytes of |data|, as
+  // returned by encoded_arguments(). Returns false, leaving the record
+  // unchanged, if they do not fit.
+  bool SetEncodedArguments(const char* data, size_t size, bool is_truncated) {
+    if (size > kArgumentCapacity) {
+      return false;
+    }
+
+    std::memcpy(arguments_, data, size);
+    size_ = static_cast<uint16_t>(size);
+    is_truncated_ = is_truncated;
+    return true;
+  }
+
+  // Number of leading bytes of the record in use, which are all a copy of the
+  // record needs.
+  size_t used_size() const {
+    return static_cast<size_t>(arguments_ -
+                               reinterpret_cast<const char*>(this)) +
+           size_;
+  }
+
+  // Accessors.
+  const LogSite* site() const { return site_; }
+  const std::thread::id& thread_id() const { return thread_id_; }
+  bool is_truncated() const { return is_truncated_; }
+
+  // Time at which the record was composed, in std::chrono::steady_clock ticks.
+  int64_t timestamp() const { return timestamp_; }
+
+ private:
+  static constexpr size_t kHeaderSize =
+      sizeof(const LogSite*) + sizeof(std::thread::id) + sizeof(int64_t) +
+      sizeof(uint16_t) + sizeof(bool);
+  static constexpr size_t kArgumentCapacity = kSize - kHeaderSize;
+
+  // Size of an encoded LogFormat.
+  static constexpr size_t kFormatSize = 13;
+
+  template<typename TValue>
+  void AppendValue(ArgumentType type, const TValue& value) {
+    if (size_ + 1 + sizeof(TValue) > kArgumentCapacity) {
+      is_truncated_ = true;
+      return;
+    }
+
+    arguments_[size_] = static_cast<char>(type);
+    std::memcpy(&arguments_[size_ + 1], &value, sizeof(TValue));
+    size_ += static_cast<uint16_t>(1 + sizeof(TValue));
+  }
+
+  // Returns the size of the values of |type|, or of their size for strings,
+  // or zero if |type| is not an ArgumentType.
+  static size_t ValueSize(ArgumentType type) {
+    switch (type) {
+      case ArgumentType::kBool:
+        return sizeof(bool);
+      case ArgumentType::kChar:
+        return sizeof(char);
+      case ArgumentType::kSigned:
+        return sizeof(int64_t);
+      case ArgumentType::kUnsigned:
+        return sizeof(uint64_t);
+      case ArgumentType::kDouble:
+        return sizeof(double);
+      case ArgumentType::kPointer:
+        return sizeof(const void*);
+      case ArgumentType::kString:
+        return sizeof(uint16_t);
+      case ArgumentType::kFormat:
+        return kFormatSize;
+    }
+    return 0;
+  }
+
+  template<typename TValue>
+  TValue ReadValue(size_t& offset) const {
+    TValue value;
+    std::memcpy(&value, &arguments_[offset], sizeof(TValue));
+    offset += sizeof(TValue);
+    return value;
+  }
+
+  const LogSite* site_ = nullptr;
+  std::thread::id thread_id_;
+  int64_t timestamp_ = 0;
+  uint16_t size_ = 0;
+  bool is_truncated_ = false;
+  char arguments_[kArgumentCapacity];
+};
+
+namespace internal {
+
+// Stream buffer appending what is written to it to a LogRecord as strings, for
+// streaming arguments of types which LogRecord cannot store as they are.
+class LogRecordStreambuf : public std::streambuf {
+ public:
+  explicit LogRecordStreambuf(LogRecord& record) : record_(record) {
+    setp(buffer_, buffer_ + sizeof(buffer_));
+  }
+
+  ~LogRecordStreambuf() override {
+    sync();
+  }
+
+ protected:
+  int sync() override {
+    if (pptr() != pbase()) {
+      record_.AppendString(pbase(), static_cast<size_t>(pptr() - pbase()));
+      setp(buffer_, buffer_ + sizeof(buffer_));
+    }
+    return 0;
+  }
+
+  int_type overflow(int_type c) override {
+    sync();
+    if (!traits_type::eq_int_type(c, traits_type::eof())) {
+      *pptr() = traits_type::to_char_type(c);
+      pbump(1);
+    }
+    return traits_type::not_eof(c);
+  }
+
+ private:
+  LogRecord& record_;
+  char buffer_[64];
+};
+
+}  // namespace internal
+
+// Writes the arguments of LogRecords to |stream| as operator<<() would have.
+// The formatting state of |stream| is restored once the writer is destroyed,
+// such that the manipulators of a record do not leak into what follows it.
+template<typename TStream>
+class LogRecordArgumentWriter {
+ public:
+  explicit LogRecordArgumentWriter(TStream& stream)
+      : stream_(stream), initial_format_(LogFormat::Of(stream)) {}
+
+  ~LogRecordArgumentWriter() {
+    initial_format_.ApplyTo(stream_);
+  }
+
+  template<typename TValue>
+  void operator()(const TValue& value) {
+    stream_ << value;
+  }
+
+  void operator()(const LogFormat& format) {
+    format.ApplyTo(stream_);
+  }
+
+  void operator()(const char* data, size_t size) {
+    if (stream_.width() > 0) {
+      stream_ << std::string(data, size);
+    } else {
+      stream_.write(data, static_cast<std::streamsize>(size));
+    }
+  }
+
+ private:
+  TStream& stream_;
+  const LogFormat initial_format_;
+};
+
+// Serializes streamed arguments into a LogRecord. Arithmetic types, enums,
+// pointers and strings are stored as they are, preceded by the formatting
+// state set by manipulators whenever it changed. Anything else, manipulators
+// included, is streamed right away into a std::ostream holding that state,
+// whatever it writes going into the record.
+class LogRecordStream {
+ public:
+  explicit LogRecordStream(LogRecord& record)
+      : record_(record),
+        format_(LogFormat::Default()),
+        recorded_format_(format_) {}
+
+  LogRecordStream(const LogRecordStream& other) = delete;
+  LogRecordStream& operator=(const LogRecordStream& other) = delete;
+
+  LogRecordStream& operator<<(bool value) {
+    RecordFormat();
+    record_.AppendBool(value);
+    return *this;
+  }
+
+  LogRecordStream& operator<<(char value) {
+    RecordFormat();
+    record_.AppendChar(value);
+    return *this;
+  }
+
+  LogRecordStream& operator<<(signed char value) {
+    RecordFormat();
+    record_.AppendChar(static_cast<char>(value));
+    return *this;
+  }
+
+  LogRecordStream& operator<<(unsigned char value) {
+    RecordFormat();
+    record_.AppendChar(static_cast<char>(value));
+    return *this;
+  }
+
+  LogRecordStream& operator<<(const char* value) {
+    if (!value) {
+      value = "(null)";
+    }
+    RecordFormat();
+    record_.AppendString(value, std::strlen(value));
+    return *this;
+  }
+
+  LogRecordStream& operator<<(const std::string& value) {
+    RecordFormat();
+    record_.AppendString(value.data(), value.size());
+    return *this;
+  }
+
+  LogRecordStream& operator<<(const void* value) {
+    RecordFormat();
+    record_.AppendPointer(value);
+    return *this;
+  }
+
+  template<typename TValue>
+  typename std::enable_if<(std::is_integral<TValue>::value &&
+                           std::is_signed<TValue>::value) ||
+                              std::is_enum<TValue>::value,
+                          LogRecordStream&>::type
+  operator<<(TValue value) {
+    RecordFormat();
+
+    // Streams print negative values in hex or octal as the unsigned value of
+    // the same size, rather than of int64_t.
+    const int64_t signed_value = static_cast<int64_t>(value);
+    const std::ios_base::fmtflags base =
+        format_.flags & std::ios_base::basefield;
+    if (signed_value < 0 &&
+        (base == std::ios_base::hex || base == std::ios_base::oct)) {
+      record_.AppendUnsigned(static_cast<uint64_t>(
+          static_cast<typename std::make_unsigned<TValue>::type>(value)));
+    } else {
+      record_.AppendSigned(signed_value);
+    }
+    return *this;
+  }
+
+  template<typename TValue>
+  typename std::enable_if<std::is_integral<TValue>::value &&
+                              std::is_unsigned<TValue>::value,
+                          LogRecordStream&>::type
+  operator<<(TValue value) {
+    RecordFormat();
+    record_.AppendUnsigned(static_cast<uint64_t>(value));
+    return *this;
+  }
+
+  template<typename TValue>
+  typename std::enable_if<std::is_floating_point<TValue>::value,
+                          LogRecordStream&>::type
+  operator<<(TValue value) {
+    RecordFormat();
+    record_.AppendDouble(static_cast<double>(value));
+    return *this;
+  }
+
+  // Manipulators, such as std::endl, std::hex or std::boolalpha.
+  LogRecordStream& operator<<(std::ostream& (*manipulator)(std::ostream&)) {
+    return Format(manipulator);
+  }
+
+  LogRecordStream& operator<<(std::ios& (*manipulator)(std::ios&)) {
+    return Format(manipulator);
+  }
+
+  LogRecordStream& operator<<(
+      std::ios_base& (*manipulator)(std::ios_base&)) {
+    return Format(manipulator);
+  }
+
+  template<typename TValue>
+  typename std::enable_if<!std::is_arithmetic<TValue>::value &&
+                              !std::is_enum<TValue>::value &&
+                              !std::is_pointer<TValue>::value &&
+                              !std::is_array<TValue>::value,
+                          LogRecordStream&>::type
+  operator<<(const TValue& value) {
+    return Format(value);
+  }
+
+ private:
+  // Records |format_| ahead of the next argument, unless it was already.
+  void RecordFormat() {
+    if (format_ != recorded_format_) {
+      record_.AppendFormat(format_);
+      recorded_format_ = format_;
+    }
+
+    // The width only applies to the next argument.
+    format_.width = 0;
+    recorded_format_.width = 0;
+  }
+
+  // Streams |value| into the record right away, with the current formatting
+  // state, which |value| may change.
+  template<typename TValue>
+  LogRecordStream& Format(const TValue& value) {
+    internal::LogRecordStreambuf buffer(record_);
+    std::ostream stream(&buffer);
+    format_.ApplyTo(stream);
+    stream << value;
+    format_ = LogFormat::Of(stream);
+    return *this;
+  }
+
+  LogRecord& record_;
+
+  // Formatting state set by manipulators so far, and as last recorded.
+  LogFormat format_;
+  LogFormat recorded_format_;
+};
+
+}  // namespace util
+
+#endif /* A5EC3EF1_C88D_444A_A345_C3038F571A12 */
@@ -0,0 +1,132 @@
+#ifndef D4202534_063E_4672_8855_F2994F29DD57
+#define D4202534_063E_4672_8855_F2994F29DD57
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <ios>
+#include <memory>
+#include <string>
+#include <utility>
+
+#include "util/include/log_record.hpp"
+
+namespace util {
+
+// Destination of the output of a Logger. Sinks are only ever called by the
+// logging thread, so they need no synchronization of their own, and may take
+// their time without ever blocking the threads which log.
+class LogSink {
+ public:
+  virtual ~LogSink() = default;
+
+  // Writes |size| bytes of formatted records, which always end with a complete
+  // line. Sinks are free to buffer them until the next Flush().
+  virtual void Write(const char* data, size_t size) = 0;
+
+  // Called whenever the logger runs out of records to write, such that sinks
+  // do not hold on to buffered output while nothing else is logged.
+  virtual void Flush() = 0;
+
+  // Whether the sink stores records as they are, through WriteRecord(), rather
+  // than formatted, through Write(). Only honoured with structured logging.
+  virtual bool takes_records() const { return false; }
+
+  virtual void WriteRecord(const LogRecord&) {}
+};
+
+// LogSink writing to a std::ostream-like stream, which it owns unless
+// |TStream| is a reference type.
+template<typename TStream>
+class StreamLogSink : public LogSink {
+ public:
+  explicit StreamLogSink(TStream stream)
+      : stream_(std::forward<TStream>(stream)) {}
+
+  void Write(const char* data, size_t size) override {
+    stream_.write(data, static_cast<std::streamsize>(size));
+  }
+
+  void Flush() override {
+    stream_.flush();
+  }
+
+ private:
+  TStream stream_;
+};
+
+// When a file LogSink makes sure that what it wrote reached the disk, with
+// fdatasync().
+enum class LogSyncPolicy {
+  // Leaves it to the OS.
+  kNever,
+
+  // Whenever the logger runs out of records to write.
+  kOnFlush,
+
+  // At most once per FileLogSinkOptions::sync_interval, while logging.
+  kPeriodic,
+};
+
+// Options for CreateFileLogSink().
+struct FileLogSinkOptions {
+  // File written to, which is appended to if it exists.
+  std::string path;
+
+  // Records are coalesced into a buffer of this size, which is written out
+  // with a single system call once full or flushed.
+  size_t buffer_size = 256 * 1024;
+
+  // Unless zero, the file is rotated before writing a batch of records which
+  // would take it past |max_file_size| bytes, or once it has been open for
+  // |max_file_age|, whichever comes first. Files are only rotated in between
+  // batches, so they stay under |max_file_size| unless a single batch is
+  // larger.
+  uint64_t max_file_size = 0;
+  std::chrono::seconds max_file_age{0};
+
+  // Rotated files are renamed "<path>.1", "<path>.2" and so on, the oldest
+  // having the highest index, and only the newest |max_rotated_files| are
+  // kept.
+  size_t max_rotated_files = 5;
+
+  LogSyncPolicy sync_policy = LogSyncPolicy::kNever;
+  std::chrono::milliseconds sync_interval{1000};
+};
+
+// Creates a LogSink writing to the file at |options.path|, or returns nullptr
+// if the file cannot be opened.
+std::unique_ptr<LogSink> CreateFileLogSink(const FileLogSinkOptions& options);
+
+// Options for CreateRingFileLogSink().
+struct RingFileLogSinkOptions {
+  // File written to, which is overwritten if it exists.
+  std::string path;
+
+  // Space for records, rounded down to a whole number of 64 KiB blocks, of at
+  // least one block. Once full, the oldest block of records is overwritten.
+  uint64_t ring_size = 64 * 1024 * 1024;
+
+  // Space for the descriptions of the call sites and threads which records
+  // refer to. Records of sites or threads described once it is full are
+  // decoded without their file, line, level or thread.
+  uint64_t metadata_size = 1024 * 1024;
+
+  // Changes to the mapping are scheduled to be written back with msync() at
+  // most this often, while logging. They survive a crash of the process
+  // either way, as soon as they are made.
+  std::chrono::milliseconds sync_interval{1000};
+};
+
+// Creates a LogSink storing records in binary, without formatting them, in a
+// preallocated file mapped in memory, as described in ring_file_log_format.hpp.
+// The file can then be decoded to text with the decode_log tool, including
+// after a crash. Returns nullptr if the file cannot be created.
+//
+// NOTE: Requires structured logging. Formatted output is dropped.
+std::unique_ptr<LogSink> CreateRingFileLogSink(
+    const RingFileLogSinkOptions& options);
+
+}  // namespace util
+
+#endif /* D4202534_063E_4672_8855_F2994F29DD57 */
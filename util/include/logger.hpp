@@ -1,12 +1,16 @@
 #ifndef DBC3B62B_4E2A_49CB_8598_AFE1922E4916
 #define DBC3B62B_4E2A_49CB_8598_AFE1922E4916
 
+#include <memory>
 #include <ostream>
 #include <sstream>
 #include <string>
 #include <thread>
 #include <utility>
 
+#include "util/include/log_record.hpp"
+#include "util/include/log_sink.hpp"
+
 namespace util {
 
 // This class defines a number of thread-safe logging utilities. To use the
@@ -18,15 +22,34 @@ namespace util {
 //      written.
 //
 // Logging can be enabled / disabled by defining the ENABLE_UTIL_LOGGING
-// constant. Note that (AFTER the INITIALIZE LOGGER call), all functions defined
-// by this class are thread-safe.
+// constant, and restricted to some levels as described below. Note that (AFTER
+// the INITIALIZE LOGGER call), all functions defined by this class are
+// thread-safe.
 //
 // TODO: Move this to a build flag.
 #define ENABLE_UTIL_LOGGING
 
+// When defined, the LOG_UTIL_* macros serialize their arguments into a
+// fixed-size LogRecord pointing to a static LogSite for the call site, and
+// formatting is left to the logging thread, such that logging does not
+// allocate. Otherwise, each message is formatted into its own
+// std::stringstream by the logging thread's caller. See log_record.hpp.
+#define ENABLE_UTIL_STRUCTURED_LOGGING
+
+// Minimum level of the LOG_UTIL_* statements compiled in, as a
+// Logger::LogLevel value. Statements below it compile to nothing, and their
+// arguments are never evaluated. Set through the UTIL_MIN_LOG_LEVEL CMake
+// option.
+#ifndef UTIL_MIN_LOG_LEVEL
+#define UTIL_MIN_LOG_LEVEL 0
+#endif
+
 // Logging Macros to be used by the library user.
 //
-// TODO: Add fine-grained log level controls.
+// Statements compiled in are further filtered at runtime, by the levels set
+// through Logger::SetLogLevel() and Logger::SetModuleLogLevel(). Each call
+// site checks its own copy of its module's level, with a single relaxed load,
+// before evaluating any argument.
 #ifdef ENABLE_UTIL_LOGGING
 
 // TODO: This call leaks memory. Change the design to make it a user-defined
@@ -34,29 +57,93 @@ namespace util {
 #define INITIALIZE_LOGGER(info_stream, error_stream) \
     util::Logger::CreateGlobalInstance(std::move(info_stream), \
                                        std::move(error_stream))
+
+#if UTIL_MIN_LOG_LEVEL <= 0
 #define LOG_UTIL_VERBOSE UTIL_STREAM_HELPER(kVerbose)
+#else
+#define LOG_UTIL_VERBOSE UTIL_STREAM_HELPER_DISABLED
+#endif
+
+#if UTIL_MIN_LOG_LEVEL <= 1
 #define LOG_UTIL_INFO UTIL_STREAM_HELPER(kInfo)
+#else
+#define LOG_UTIL_INFO UTIL_STREAM_HELPER_DISABLED
+#endif
+
+#if UTIL_MIN_LOG_LEVEL <= 2
 #define LOG_UTIL_WARNING UTIL_STREAM_HELPER(kWarning)
+#else
+#define LOG_UTIL_WARNING UTIL_STREAM_HELPER_DISABLED
+#endif
+
+#if UTIL_MIN_LOG_LEVEL <= 3
 #define LOG_UTIL_ERROR UTIL_STREAM_HELPER(kError)
-#define LOG_UTIL_CRITICAL UTIL_STREAM_HELPER(kCritical)
+#else
+#define LOG_UTIL_ERROR UTIL_STREAM_HELPER_DISABLED
+#endif
+
+#if UTIL_MIN_LOG_LEVEL <= 4
+#define LOG_UTIL_FATAL UTIL_STREAM_HELPER(kFatal)
+#else
+#define LOG_UTIL_FATAL UTIL_STREAM_HELPER_DISABLED
+#endif
 
 #else
 
 #define INITIALIZE_LOGGER(info_stream, error_stream)
-#define LOG_UTIL_VERBOSE
-#define LOG_UTIL_INFO 
-#define LOG_UTIL_WARNING
-#define LOG_UTIL_ERROR 
-#define LOG_UTIL_CRITICAL
+#define LOG_UTIL_VERBOSE UTIL_STREAM_HELPER_DISABLED
+#define LOG_UTIL_INFO UTIL_STREAM_HELPER_DISABLED
+#define LOG_UTIL_WARNING UTIL_STREAM_HELPER_DISABLED
+#define LOG_UTIL_ERROR UTIL_STREAM_HELPER_DISABLED
+#define LOG_UTIL_FATAL UTIL_STREAM_HELPER_DISABLED
 
 #endif
 
+// Former name of LOG_UTIL_FATAL.
+#define LOG_UTIL_CRITICAL LOG_UTIL_FATAL
+
 #define UTIL_STREAM_HELPER(level_enum) \
   UTIL_STREAM_HELPER_IMPL(level_enum, __FILE__, __LINE__)
 
+// Statement which type-checks what is streamed to it, but never runs.
+#define UTIL_STREAM_HELPER_DISABLED \
+  while (false) ::util::internal::NullLogStream()
+
+// Address of the LogSite of the call site. The site is constant-initialized,
+// so getting it costs nothing, and only registers itself the first time it is
+// checked.
+//
+// NOTE: |file| and |line| must be constants.
+#define UTIL_LOG_SITE(level_enum, file, line) \
+  []() -> ::util::LogSite* { \
+    static ::util::LogSite site(::util::Logger::LogLevel::level_enum, file, \
+                                line); \
+    return &site; \
+  }()
+
+// Runs the statement streaming to the LogMessage at most once, and only if
+// the call site is enabled. Being a loop rather than an if, it cannot capture
+// the else of an enclosing if.
+#define UTIL_STREAM_HELPER_LOOP(level_enum, file, line) \
+  for (::util::LogSite* util_log_site = \
+           UTIL_LOG_SITE(level_enum, file, line); \
+       util_log_site && util_log_site->IsEnabled(); \
+       util_log_site = nullptr)
+
+#ifdef ENABLE_UTIL_STRUCTURED_LOGGING
+
+#define UTIL_STREAM_HELPER_IMPL(level_enum, file, line) \
+  UTIL_STREAM_HELPER_LOOP(level_enum, file, line) \
+    ::util::Logger::LogMessage(*util_log_site).stream()
+
+#else
+
 #define UTIL_STREAM_HELPER_IMPL(level_enum, file, line) \
-  internal::Voidify() & (Logger::CreateLogMessage( \
-      Logger::LogLevel::level_enum, file, line).stream())
+  UTIL_STREAM_HELPER_LOOP(level_enum, file, line) \
+    ::util::Logger::CreateLogMessage( \
+        ::util::Logger::LogLevel::level_enum, file, line).stream()
+
+#endif
 
 // Top-level of the class responsible for handling thread-safe logging. Children
 // must complete its implementation and handle reading to the provided streams.
@@ -82,6 +169,32 @@ class Logger {
     kFatal = 4,
   };
   
+#ifdef ENABLE_UTIL_STRUCTURED_LOGGING
+
+  // Composes a LogRecord from the arguments streamed to it, then hands it to
+  // the global Logger once destroyed, at the end of the log statement.
+  class LogMessage {
+   public:
+    explicit LogMessage(const LogSite& site) : stream_(record_) {
+      record_.Reset(&site);
+    }
+
+    LogMessage(const LogMessage& other) = delete;
+    LogMessage& operator=(const LogMessage& other) = delete;
+
+    ~LogMessage() {
+      Logger::GetGlobalInstance()->LogRecordImpl(std::move(record_));
+    }
+
+    LogRecordStream& stream() { return stream_; }
+
+   private:
+    LogRecord record_;
+    LogRecordStream stream_;
+  };
+
+#else
+
   class LogMessage {
    public:
     LogMessage(LogLevel level, const char* file, int line,
@@ -128,6 +241,8 @@ class Logger {
     std::stringstream stream_;
   };
 
+#endif
+
   Logger() = default;
   virtual ~Logger() = default;
 
@@ -137,26 +252,55 @@ class Logger {
   // types.
   static void CreateGlobalInstance(std::ostream& info_stream, std::ostream& error_stream);
 
+  // Creates the singleton Logger instance, writing every message to |sink|, or
+  // messages below kWarning to |info_sink| and the others to |error_sink|.
+  // May only be called once.
+  static void CreateGlobalInstance(std::shared_ptr<LogSink> sink);
+  static void CreateGlobalInstance(std::shared_ptr<LogSink> info_sink,
+                                   std::shared_ptr<LogSink> error_sink);
+
   // Gets the global instance of the logger for this process.
   static Logger* GetGlobalInstance();
 
+  // Sets the minimum level logged by call sites in modules without a level of
+  // their own. Defaults to kVerbose.
+  static void SetLogLevel(LogLevel level);
+
+  // Sets the minimum level logged by call sites in |module|, the name of a
+  // source file without its directory and extension (e.g. "logger_impl"),
+  // whatever the level set by SetLogLevel().
+  static void SetModuleLogLevel(const std::string& module, LogLevel level);
+
+  // Makes |module| use the level set by SetLogLevel() again.
+  static void ClearModuleLogLevel(const std::string& module);
+
+#ifndef ENABLE_UTIL_STRUCTURED_LOGGING
   // Logs a message.
   static LogMessage CreateLogMessage(LogLevel level, const char* file, int line) {
     return LogMessage(level, file, line, std::this_thread::get_id());
   }
+#endif
 
   virtual void StopSoon() = 0;
 
  protected:
   // Implementation-specific logging function.
+#ifdef ENABLE_UTIL_STRUCTURED_LOGGING
+  virtual void LogRecordImpl(LogRecord&& record) = 0;
+#else
   virtual void LogMessageImpl(LogMessage&& msg) = 0;
+#endif
 };
 
 namespace internal {
 
-class Voidify {
+// Stream of the LOG_UTIL_* statements compiled out.
+class NullLogStream {
  public:
-  void operator&(std::ostream&) {}
+  template<typename TValue>
+  NullLogStream& operator<<(const TValue&) {
+    return *this;
+  }
 };
 
 }  // namespace internal
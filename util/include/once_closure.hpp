@@ -0,0 +1,186 @@
+#ifndef F039F3FE_681F_40E3_958C_8B5F552F104F
+#define F039F3FE_681F_40E3_958C_8B5F552F104F
+
+#include <cassert>
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+namespace util {
+
+// Move-only, type-erased wrapper of a callable taking no arguments, which may
+// be run at most once. Running it destroys the wrapped callable and leaves the
+// OnceClosure empty. Any return value of the callable is discarded.
+//
+// Callables of up to |kInlineSize| bytes with a non-throwing move constructor,
+// which covers most lambdas capturing a few pointers or values, are stored
+// inline such that creating, moving and running a OnceClosure never allocates.
+// Larger callables are moved to the heap.
+class OnceClosure {
+ public:
+  static constexpr size_t kInlineSize = 48;
+
+  OnceClosure() = default;
+  OnceClosure(std::nullptr_t) {}
+
+  template<typename TFunctor,
+           typename = typename std::enable_if<!std::is_same<
+               typename std::decay<TFunctor>::type, OnceClosure>::value>::type>
+  OnceClosure(TFunctor&& functor) {
+    using TStored = typename std::decay<TFunctor>::type;
+    Construct<TStored>(std::forward<TFunctor>(functor),
+                       std::integral_constant<bool, IsInline<TStored>()>());
+  }
+
+  OnceClosure(OnceClosure&& other) noexcept {
+    MoveFrom(other);
+  }
+
+  OnceClosure& operator=(OnceClosure&& other) noexcept {
+    if (this != &other) {
+      Reset();
+      MoveFrom(other);
+    }
+    return *this;
+  }
+
+  ~OnceClosure() {
+    Reset();
+  }
+
+  OnceClosure(const OnceClosure& other) = delete;
+  OnceClosure& operator=(const OnceClosure& other) = delete;
+
+  // Runs the wrapped callable, which must exist, then destroys it.
+  void operator()() {
+    assert(operations_);
+
+    const Operations* operations = operations_;
+    operations_ = nullptr;
+    operations->run(storage_);
+  }
+
+  explicit operator bool() const {
+    return operations_ != nullptr;
+  }
+
+ private:
+  // Type-specific behavior of the wrapped callable, stored in |storage_|.
+  struct Operations {
+    // Runs the callable, then destroys it.
+    void (*run)(void* storage);
+
+    // Move-constructs the callable from |from| into |to|, then destroys the
+    // callable left in |from|.
+    void (*relocate)(void* from, void* to);
+
+    void (*destroy)(void* storage);
+  };
+
+  // Destroys a callable when going out of scope, such that it is destroyed
+  // even if running it throws.
+  struct ScopedDestroy {
+    ~ScopedDestroy() {
+      destroy(storage);
+    }
+
+    void* storage;
+    void (*destroy)(void* storage);
+  };
+
+  template<typename TStored>
+  struct InlineStorage {
+    static TStored& Get(void* storage) {
+      return *static_cast<TStored*>(storage);
+    }
+
+    static void Run(void* storage) {
+      ScopedDestroy scoped_destroy{storage, &Destroy};
+      Get(storage)();
+    }
+
+    static void Relocate(void* from, void* to) {
+      new (to) TStored(std::move(Get(from)));
+      Get(from).~TStored();
+    }
+
+    static void Destroy(void* storage) {
+      Get(storage).~TStored();
+    }
+
+    static const Operations kOperations;
+  };
+
+  template<typename TStored>
+  struct HeapStorage {
+    static TStored*& Get(void* storage) {
+      return *static_cast<TStored**>(storage);
+    }
+
+    static void Run(void* storage) {
+      std::unique_ptr<TStored> functor(Get(storage));
+      (*functor)();
+    }
+
+    static void Relocate(void* from, void* to) {
+      new (to) TStored*(Get(from));
+    }
+
+    static void Destroy(void* storage) {
+      delete Get(storage);
+    }
+
+    static const Operations kOperations;
+  };
+
+  template<typename TStored>
+  static constexpr bool IsInline() {
+    return sizeof(TStored) <= kInlineSize &&
+           alignof(TStored) <= alignof(std::max_align_t) &&
+           std::is_nothrow_move_constructible<TStored>::value;
+  }
+
+  template<typename TStored, typename TFunctor>
+  void Construct(TFunctor&& functor, std::true_type /* is_inline */) {
+    new (storage_) TStored(std::forward<TFunctor>(functor));
+    operations_ = &InlineStorage<TStored>::kOperations;
+  }
+
+  template<typename TStored, typename TFunctor>
+  void Construct(TFunctor&& functor, std::false_type /* is_inline */) {
+    new (storage_) TStored*(new TStored(std::forward<TFunctor>(functor)));
+    operations_ = &HeapStorage<TStored>::kOperations;
+  }
+
+  void MoveFrom(OnceClosure& other) {
+    if (other.operations_) {
+      other.operations_->relocate(other.storage_, storage_);
+      operations_ = other.operations_;
+      other.operations_ = nullptr;
+    }
+  }
+
+  void Reset() {
+    if (operations_) {
+      operations_->destroy(storage_);
+      operations_ = nullptr;
+    }
+  }
+
+  alignas(std::max_align_t) unsigned char storage_[kInlineSize];
+  const Operations* operations_ = nullptr;
+};
+
+template<typename TStored>
+const OnceClosure::Operations OnceClosure::InlineStorage<TStored>::kOperations =
+    {&Run, &Relocate, &Destroy};
+
+template<typename TStored>
+const OnceClosure::Operations OnceClosure::HeapStorage<TStored>::kOperations =
+    {&Run, &Relocate, &Destroy};
+
+}  // namespace util
+
+#endif /* F039F3FE_681F_40E3_958C_8B5F552F104F */
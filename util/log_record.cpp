@@ -0,0 +1,108 @@
+#include "util/include/log_record.hpp"
+
+#include <mutex>
+#include <utility>
+#include <vector>
+
+namespace util {
+namespace {
+
+// Levels of the LogSites, only accessed under |g_log_sites_lock_|.
+std::mutex g_log_sites_lock_;
+int g_default_min_level_ = 0;
+std::vector<std::pair<std::string, int>> g_module_min_levels_;
+uint32_t g_log_site_count_ = 0;
+
+std::atomic<LogSite*> g_log_sites_{nullptr};
+
+// Returns the name of the module of a site logging from |file|, which is the
+// name of the file without its directory and extension.
+std::string ModuleOf(const char* file) {
+  const char* begin = file;
+  const char* end = nullptr;
+  for (const char* c = file; *c; c++) {
+    if (*c == '/' || *c == '\\') {
+      begin = c + 1;
+      end = nullptr;
+    } else if (*c == '.') {
+      end = c;
+    }
+  }
+  return end ? std::string(begin, end) : std::string(begin);
+}
+
+int MinLevelOf(const char* file) {
+  if (!g_module_min_levels_.empty()) {
+    const std::string module = ModuleOf(file);
+    for (const std::pair<std::string, int>& module_level :
+         g_module_min_levels_) {
+      if (module_level.first == module) {
+        return module_level.second;
+      }
+    }
+  }
+  return g_default_min_level_;
+}
+
+}  // namespace
+
+bool LogSite::Register() {
+  std::lock_guard<std::mutex> lock(g_log_sites_lock_);
+
+  // Another thread may have registered the site meanwhile.
+  if (min_level_.load(std::memory_order_relaxed) == kUnregistered) {
+    id = g_log_site_count_++;
+    next = g_log_sites_.load(std::memory_order_relaxed);
+    g_log_sites_.store(this, std::memory_order_release);
+    min_level_.store(MinLevelOf(file), std::memory_order_relaxed);
+  }
+  return level >= min_level_.load(std::memory_order_relaxed);
+}
+
+// static
+void LogSite::UpdateMinLevels() {
+  for (LogSite* site = g_log_sites_.load(std::memory_order_relaxed); site;
+       site = site->next) {
+    site->min_level_.store(MinLevelOf(site->file), std::memory_order_relaxed);
+  }
+}
+
+// static
+const LogSite* LogSite::registered_sites() {
+  return g_log_sites_.load(std::memory_order_acquire);
+}
+
+// static
+void LogSite::SetDefaultMinLevel(int level) {
+  std::lock_guard<std::mutex> lock(g_log_sites_lock_);
+  g_default_min_level_ = level;
+  UpdateMinLevels();
+}
+
+// static
+void LogSite::SetModuleMinLevel(const std::string& module, int level) {
+  std::lock_guard<std::mutex> lock(g_log_sites_lock_);
+  for (std::pair<std::string, int>& module_level : g_module_min_levels_) {
+    if (module_level.first == module) {
+      module_level.second = level;
+      UpdateMinLevels();
+      return;
+    }
+  }
+  g_module_min_levels_.emplace_back(module, level);
+  UpdateMinLevels();
+}
+
+// static
+void LogSite::ClearModuleMinLevel(const std::string& module) {
+  std::lock_guard<std::mutex> lock(g_log_sites_lock_);
+  for (size_t i = 0; i < g_module_min_levels_.size(); i++) {
+    if (g_module_min_levels_[i].first == module) {
+      g_module_min_levels_.erase(g_module_min_levels_.begin() + i);
+      UpdateMinLevels();
+      return;
+    }
+  }
+}
+
+}  // namespace util
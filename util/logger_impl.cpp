@@ -1,4 +1,8 @@
 #include <cassert>
+#include <iterator>
+#include <memory>
+#include <utility>
+#include <vector>
 
 #include "util/logger_impl.hpp"
 
@@ -13,6 +17,21 @@ void Logger::CreateGlobalInstance(std::ostream& info_stream, std::ostream& error
   g_logger_singleton_ = CreateLogger(info_stream, error_stream).release();
 }
 
+// static
+void Logger::CreateGlobalInstance(std::shared_ptr<LogSink> sink) {
+  CreateGlobalInstance(sink, sink);
+}
+
+// static
+void Logger::CreateGlobalInstance(std::shared_ptr<LogSink> info_sink,
+                                  std::shared_ptr<LogSink> error_sink) {
+  assert(!g_logger_singleton_);
+  assert(info_sink && error_sink);
+
+  g_logger_singleton_ =
+      new LoggerImpl(std::move(info_sink), std::move(error_sink));
+}
+
 // static
 Logger* Logger::GetGlobalInstance() {
   assert(g_logger_singleton_);
@@ -20,4 +39,130 @@ Logger* Logger::GetGlobalInstance() {
   return g_logger_singleton_;
 }
 
-}  // namespace
\ No newline at end of file
+// static
+void Logger::SetLogLevel(LogLevel level) {
+  LogSite::SetDefaultMinLevel(level);
+}
+
+// static
+void Logger::SetModuleLogLevel(const std::string& module, LogLevel level) {
+  LogSite::SetModuleMinLevel(module, level);
+}
+
+// static
+void Logger::ClearModuleLogLevel(const std::string& module) {
+  LogSite::ClearModuleMinLevel(module);
+}
+
+LoggerImpl::LoggerImpl(std::shared_ptr<LogSink> info_sink,
+                       std::shared_ptr<LogSink> error_sink)
+    : info_sink_(std::move(info_sink)),
+      error_sink_(std::move(error_sink)),
+      stream_(&buffer_),
+      logging_thread_([this]() { this->ReadAll(); }) {}
+
+LoggerImpl::~LoggerImpl() {
+  StopSoon();
+  logging_thread_.join();
+}
+
+void LoggerImpl::StopSoon() {
+  log_messages_.Close();
+}
+
+void LoggerImpl::WriteBuffer() {
+  if (buffer_.size() > 0) {
+    buffered_sink_->Write(buffer_.data(), buffer_.size());
+    buffer_.Clear();
+  }
+}
+
+void LoggerImpl::Flush() {
+  WriteBuffer();
+  info_sink_->Flush();
+  if (error_sink_ != info_sink_) {
+    error_sink_->Flush();
+  }
+}
+
+#ifdef ENABLE_UTIL_STRUCTURED_LOGGING
+
+// Reads all records from the queue in timestamp order, waiting for more when
+// the queue is empty, until the queue is closed and empty.
+void LoggerImpl::ReadAll() {
+  std::unique_ptr<LogRecord[]> batch(new LogRecord[kMaxMessageBatchSize]);
+  while (log_messages_.WaitForRecords()) {
+    size_t count;
+    while ((count = log_messages_.PopMerged(batch.get(),
+                                            kMaxMessageBatchSize))) {
+      for (size_t i = 0; i < count; i++) {
+        Write(batch[i]);
+      }
+      WriteBuffer();
+    }
+    Flush();
+  }
+}
+
+void LoggerImpl::WriteLog(const LogRecord& record) {
+  if (buffered_sink_->takes_records()) {
+    buffered_sink_->WriteRecord(record);
+    return;
+  }
+
+  const LogSite& site = *record.site();
+  stream_ << "[" << site.level << ":" << site.file << "(" << site.line
+          << "):" << record.thread_id() << "] ";
+  record.VisitArguments(LogRecordArgumentWriter<std::ostream>(stream_));
+  if (record.is_truncated()) {
+    stream_ << "...";
+  }
+  stream_ << '\n';
+}
+
+void LoggerImpl::LogRecordImpl(LogRecord&& record) {
+  log_messages_.Push(record);
+}
+
+#else
+
+// Reads all messages from the queue, waiting for more when the queue is
+// empty, until the queue is closed and empty.
+void LoggerImpl::ReadAll() {
+  std::vector<LogMessage> batch;
+  batch.reserve(kMaxMessageBatchSize);
+
+  while (log_messages_.PopBulk(std::back_inserter(batch),
+                               kMaxMessageBatchSize)) {
+    for (auto& msg : batch) {
+      Write(msg);
+    }
+    batch.clear();
+    if (log_messages_.is_empty()) {
+      Flush();
+    } else {
+      WriteBuffer();
+    }
+  }
+  Flush();
+}
+
+void LoggerImpl::WriteLog(LogMessage& msg) {
+  stream_ << "[" << msg.level() << ":" << msg.file() << "(" << msg.line()
+          << "):" << msg.thread_id() << "] ";
+
+  // Streaming an empty buffer would fail |stream_|, and every message after.
+  if (msg.stream().rdbuf()->in_avail() > 0) {
+    stream_ << msg.stream().rdbuf();
+  }
+  stream_ << '\n';
+  msg.IsDoneLogging();
+}
+
+void LoggerImpl::LogMessageImpl(LogMessage&& message) {
+  log_messages_.Push(std::move(message));
+}
+
+#endif
+
+}  // namespace util
\ No newline at end of file
@@ -1,182 +1,162 @@
 #ifndef C6957D25_A8B8_49A2_AB97_EF6DCEB5EAE4
 #define C6957D25_A8B8_49A2_AB97_EF6DCEB5EAE4
 
-#include <atomic>
-#include <condition_variable>
 #include <memory>
-#include <mutex>
-
-#include "threading/include/nearly_lockless_fifo.hpp"
+#include <ostream>
+#include <streambuf>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "threading/include/blocking_fifo.hpp"
+#include "util/include/log_sink.hpp"
 #include "util/include/logger.hpp"
+#include "util/per_thread_log_queue.hpp"
 
 namespace util {
+namespace internal {
 
-// Creates a new LoggerImpl.
-template<typename TInfoStream, typename TErrorStream>
-std::unique_ptr<Logger> CreateLogger(TInfoStream&& info_stream,
-                                     TErrorStream&& error_stream);
+// Growable in-memory stream buffer, into which the logging thread formats
+// records before handing them to a LogSink all at once.
+class LogFormatBuffer : public std::streambuf {
+ public:
+  LogFormatBuffer() : buffer_(kInitialSize) {
+    setp(buffer_.data(), buffer_.data() + buffer_.size());
+  }
+
+  const char* data() const { return pbase(); }
+  size_t size() const { return static_cast<size_t>(pptr() - pbase()); }
+
+  void Clear() {
+    setp(buffer_.data(), buffer_.data() + buffer_.size());
+  }
+
+ protected:
+  int_type overflow(int_type c) override {
+    const size_t size = this->size();
+    buffer_.resize(buffer_.size() * 2);
+    setp(buffer_.data(), buffer_.data() + buffer_.size());
+    pbump(static_cast<int>(size));
+    if (!traits_type::eq_int_type(c, traits_type::eof())) {
+      *pptr() = traits_type::to_char_type(c);
+      pbump(1);
+    }
+    return traits_type::not_eof(c);
+  }
+
+ private:
+  static constexpr size_t kInitialSize = 64 * 1024;
+
+  std::vector<char> buffer_;
+};
+
+}  // namespace internal
 
 // Implementation of Logger. Reads log messages on any thread, then queues them
-// up in a thread-safe queue. When available the logger dequeues them and writes
-// to the provided streams from a dedicated thread created in the class's ctor.
-template<typename TInfoStream, typename TErrorStream>
+// up in a thread-safe queue. The messages are dequeued by a dedicated thread
+// created in the class's ctor, which blocks on the queue while it is empty.
+//
+// That thread formats each batch of messages into a single buffer, and hands
+// it to the sinks with a single LogSink::Write() call, then flushes the sinks
+// whenever it runs out of messages. Sinks which take records as they are get
+// them one by one, unformatted.
 class LoggerImpl : public Logger {
  public:
-  LoggerImpl(TInfoStream& info_stream, TErrorStream& error_stream)
-    : info_stream_(info_stream),
-      error_stream_(error_stream),
-      logging_thread_([this]() { this->ReadAll(); }) {}
+  // Messages below Logger::LogLevel::kWarning go to |info_sink|, and the
+  // others to |error_sink|, which may be the same sink.
+  LoggerImpl(std::shared_ptr<LogSink> info_sink,
+             std::shared_ptr<LogSink> error_sink);
 
   LoggerImpl(LoggerImpl&& other) = delete;
   LoggerImpl(const LoggerImpl& other) = delete;
 
   // Dtor blocks on completing reading of all queued messages.
-  ~LoggerImpl() override {
-    StopSoon();
+  ~LoggerImpl() override;
 
-    std::unique_lock<std::mutex> lock(should_stop_mutex_);
-    while(is_running_.load() == true) {
-      should_stop_cv_.wait(lock);
-    }
-  }
+  // Causes the logger to exit once all messages have been read. Messages
+  // logged from then on are dropped.
+  void StopSoon() override;
 
-  // Causes the logger to exit once all messages have been read.
-  void StopSoon() override {
-    should_stop_.store(true);
-  }
-  
  private:
-  // Reads all messages from the queue, waiting for more when the queue is
-  // empty.
-  void ReadAll() {
-    while (!should_stop_.load()) {
-      if (log_messages_.is_empty()) {
-        // NOTE: It is possible for "deadlock" to occur here if the queue
-        // becomes non-empty after the is_empty() check and before the
-        // wait_for() call. In practice though, because this is a logger,
-        // waiting up to 10 ms for the timer to run out is not a "bad" outcome,
-        // as it will not affect the execution threads. This could be avoided by
-        // locking |can_read_mutex_| prior to the can_read_.notify_one() call in
-        // LogMessageImpl(), but that introduces locking on the producer side,
-        // which is worse than a few extra ms delay in logging (in an edge
-        // case).
-        std::unique_lock<std::mutex> lock(can_read_mutex_);
-        while(log_messages_.is_empty()) {
-          can_read_.wait_for(lock, std::chrono::milliseconds(10));
-        }
-      }
-
-      for(auto message = log_messages_.Dequeue();
-          !!message;
-          message = log_messages_.Dequeue()) {
-        auto& msg = message.value();
-        if (msg.level() <= Logger::LogLevel::kInfo) {
-          WriteLog(msg, info_stream_);
-        } else {
-          WriteLog(msg, error_stream_);
-        }
-      }
+  // Maximum number of messages dequeued by ReadAll() at once.
+  static constexpr size_t kMaxMessageBatchSize = 64;
+
+  void ReadAll();
+
+  // Formats |msg| into |buffer_|, after handing what it holds to the sink it
+  // was formatted for if |msg| goes to another one, such that sinks shared by
+  // several levels get messages in order.
+  template<typename TMessage>
+  void Write(TMessage& msg) {
+    LogSink* const sink = Level(msg) <= Logger::LogLevel::kInfo
+                              ? info_sink_.get()
+                              : error_sink_.get();
+    if (sink != buffered_sink_) {
+      WriteBuffer();
+      buffered_sink_ = sink;
     }
-
-    is_running_.store(false);
-
-    std::unique_lock<std::mutex> lock(can_read_mutex_);
-    should_stop_cv_.notify_all();
+    WriteLog(msg);
   }
 
-  template<typename TStream>
-  void WriteLog(LogMessage& msg, TStream& stream) {
-    stream << "[" << msg.level() << ":" << msg.file() << "(" << msg.line()
-           << "):" << msg.thread_id() << "] " << msg.stream().rdbuf() << '\n';
-    msg.IsDoneLogging();
-  }
+  // Hands what |buffer_| holds to |buffered_sink_|.
+  void WriteBuffer();
 
-  void LogMessageImpl(LogMessage&& message) override {
-    log_messages_.Enqueue(std::move(message));
+  // Writes out the buffer, then flushes the sinks.
+  void Flush();
 
-    can_read_.notify_one();
+#ifdef ENABLE_UTIL_STRUCTURED_LOGGING
+  static int Level(const LogRecord& record) {
+    return record.site()->level;
   }
 
-  std::atomic_bool is_running_{ true };
+  // Records are only formatted here, on the logging thread, unless their
+  // sink takes them as they are.
+  void WriteLog(const LogRecord& record);
 
-  NearlyLocklessFifo<LogMessage> log_messages_;
+  void LogRecordImpl(LogRecord&& record) override;
 
-  // Streams for writing logs.
-  TInfoStream& info_stream_;
-  TErrorStream& error_stream_;
+  // Each producer thread pushes to a ring of its own, which only
+  // |logging_thread_| reads. Producers only wake it up while it is waiting.
+  PerThreadLogQueue log_messages_;
+#else
+  static int Level(const LogMessage& msg) {
+    return msg.level();
+  }
 
-  // Tracks if any messages are available to be read.
-  std::mutex can_read_mutex_;
-  std::condition_variable can_read_;
+  void WriteLog(LogMessage& msg);
 
-  // Control stopping the logger.
-  std::atomic_bool should_stop_{ false };
-  std::mutex should_stop_mutex_;
-  std::condition_variable should_stop_cv_;
+  void LogMessageImpl(LogMessage&& message) override;
 
-  // Thread running ReadAll(), as created in the ctor.
-  const std::thread logging_thread_;
-};
+  // Messages are only ever read by |logging_thread_|, which is woken up by
+  // the queue itself whenever it is waiting.
+  MpscBlockingFifo<LogMessage> log_messages_;
+#endif
 
-template<typename TInfoStream, typename TErrorStream>
-class LoggerImplWithOwnership : public Logger {
- public:
-  template<typename TFirst, typename TSecond>
-  LoggerImplWithOwnership(TFirst&& first, TSecond&& second) 
-    : info_stream_(std::forward(first)),
-      error_stream_(std::forward(second)),
-      logger_impl_(info_stream_, error_stream_) {}
+  std::shared_ptr<LogSink> info_sink_;
+  std::shared_ptr<LogSink> error_sink_;
 
- private:
-  inline void StopSoon() override {
-    logger_impl_.StopSoon();
-  }
+  // Messages formatted since the buffer was last written to
+  // |buffered_sink_|, only accessed by |logging_thread_|.
+  internal::LogFormatBuffer buffer_;
+  std::ostream stream_;
+  LogSink* buffered_sink_ = nullptr;
 
-  inline void LogMessageImpl(LogMessage&& msg) override {
-    logger_impl_.LogMessageImpl(std::move(msg));
-  } 
-
-  TInfoStream info_stream_;
-  TErrorStream error_stream_;
-
-  LoggerImpl<TInfoStream, TErrorStream> logger_impl_;
+  // Thread running ReadAll(), as created in the ctor.
+  std::thread logging_thread_;
 };
 
-template<typename TInfoStream, typename TErrorStream>
-std::unique_ptr<Logger> CreateLoggerImpl(
-    TInfoStream&& info_stream, TErrorStream&& error_stream) {
-  // Force SFINAE
-  static_assert(std::is_move_constructible<TInfoStream>::value ||
-                std::is_copy_constructible<TInfoStream>::value);
-  static_assert(std::is_move_constructible<TErrorStream>::value ||
-                std::is_copy_constructible<TErrorStream>::value);
-
-  return std::unique_ptr<Logger>(
-      new LoggerImplWithOwnership<
-          std::decay<TInfoStream>, std::decay<TErrorStream>>(
-              std::forward<TInfoStream>(info_stream),
-              std::forward<TErrorStream>(error_stream)));
-}
-
-template<typename TInfoStream, typename TErrorStream>
-std::unique_ptr<Logger> CreateLoggerImpl(
-    TInfoStream& info_stream, TErrorStream& error_stream) {
-  // Force SFINAE
-  static_assert(!std::is_move_constructible<TInfoStream>::value &&
-                !std::is_copy_constructible<TInfoStream>::value &&
-                !std::is_move_constructible<TErrorStream>::value &&
-                !std::is_copy_constructible<TErrorStream>::value);
-  return std::unique_ptr<Logger>(
-      new LoggerImpl<TInfoStream, TErrorStream>(info_stream, error_stream));
-}
-
+// Creates a LoggerImpl writing to |info_stream| and |error_stream|, which it
+// takes ownership of when they are passed as rvalues.
 template<typename TInfoStream, typename TErrorStream>
 std::unique_ptr<Logger> CreateLogger(TInfoStream&& info_stream,
                                      TErrorStream&& error_stream) {
-  return CreateLoggerImpl(std::forward<TInfoStream>(info_stream),
-                          std::forward<TErrorStream>(error_stream));
+  return std::unique_ptr<Logger>(new LoggerImpl(
+      std::make_shared<StreamLogSink<TInfoStream>>(
+          std::forward<TInfoStream>(info_stream)),
+      std::make_shared<StreamLogSink<TErrorStream>>(
+          std::forward<TErrorStream>(error_stream))));
 }
 
-}  // namespace
+}  // namespace util
 
 #endif /* C6957D25_A8B8_49A2_AB97_EF6DCEB5EAE4 */
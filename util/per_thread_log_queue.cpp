@@ -0,0 +1,300 @@
+#include "util/per_thread_log_queue.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <thread>
+
+namespace util {
+namespace {
+
+std::atomic<uint64_t> g_next_queue_id_{0};
+
+}  // namespace
+
+// Byte ring written by a single producer thread and read by the consumer.
+// Each record is stored as its size, followed by the bytes of the record in
+// use, wrapping around the end of the ring.
+class PerThreadLogQueue::Ring {
+ public:
+  Ring() = default;
+
+  Ring(const Ring& other) = delete;
+  Ring& operator=(const Ring& other) = delete;
+
+  // Returns false if the ring does not have space for |record|.
+  //
+  // NOTE: Only ever called by the thread owning the ring.
+  bool TryWrite(const LogRecord& record) {
+    const uint32_t size = static_cast<uint32_t>(record.used_size());
+    const uint64_t write_position =
+        write_position_.load(std::memory_order_relaxed);
+    const uint64_t end_position = write_position + sizeof(size) + size;
+    if (end_position - cached_read_position_ > kRingSize) {
+      cached_read_position_ = read_position_.load(std::memory_order_acquire);
+      if (end_position - cached_read_position_ > kRingSize) {
+        return false;
+      }
+    }
+
+    CopyIn(write_position, &size, sizeof(size));
+    CopyIn(write_position + sizeof(size), &record, size);
+    write_position_.store(end_position, std::memory_order_release);
+    return true;
+  }
+
+  // Moves the next record out of the ring into front(), unless front() already
+  // holds a record. Returns false if there is none.
+  //
+  // NOTE: The methods below are only ever called by the consumer.
+  bool LoadFront() {
+    if (has_front_) {
+      return true;
+    }
+
+    const uint64_t read_position =
+        read_position_.load(std::memory_order_relaxed);
+    if (read_position == cached_write_position_) {
+      cached_write_position_ =
+          write_position_.load(std::memory_order_acquire);
+      if (read_position == cached_write_position_) {
+        return false;
+      }
+    }
+
+    uint32_t size;
+    CopyOut(read_position, &size, sizeof(size));
+    CopyOut(read_position + sizeof(size), &front_, size);
+
+    // The record is out of the ring, so its space can already be reused.
+    read_position_.store(read_position + sizeof(size) + size,
+                         std::memory_order_release);
+    has_front_ = true;
+    return true;
+  }
+
+  const LogRecord& front() const {
+    return front_;
+  }
+
+  void PopFront() {
+    has_front_ = false;
+  }
+
+  // Set once the thread which owned the ring exited, until another thread
+  // adopts it.
+  std::atomic_bool is_abandoned{false};
+
+  // Set once the queue is destroyed, such that threads drop the ring.
+  std::atomic_bool is_orphaned{false};
+
+ private:
+  static_assert((kRingSize & (kRingSize - 1)) == 0,
+                "The ring size must be a power of two.");
+
+  void CopyIn(uint64_t position, const void* data, size_t size) {
+    const size_t offset = static_cast<size_t>(position & (kRingSize - 1));
+    const size_t first_size = std::min(size, kRingSize - offset);
+    std::memcpy(&data_[offset], data, first_size);
+    std::memcpy(&data_[0], static_cast<const char*>(data) + first_size,
+                size - first_size);
+  }
+
+  void CopyOut(uint64_t position, void* data, size_t size) const {
+    const size_t offset = static_cast<size_t>(position & (kRingSize - 1));
+    const size_t first_size = std::min(size, kRingSize - offset);
+    std::memcpy(data, &data_[offset], first_size);
+    std::memcpy(static_cast<char*>(data) + first_size, &data_[0],
+                size - first_size);
+  }
+
+  // Written by the producer. |cached_read_position_| is a possibly stale copy
+  // of |read_position_|, only reloaded when the ring looks full.
+  std::atomic<uint64_t> write_position_{0};
+  uint64_t cached_read_position_ = 0;
+  char producer_padding_[kCacheLineSize - 2 * sizeof(uint64_t)];
+
+  // Written by the consumer, which likewise caches |write_position_|.
+  std::atomic<uint64_t> read_position_{0};
+  uint64_t cached_write_position_ = 0;
+  char consumer_padding_[kCacheLineSize - 2 * sizeof(uint64_t)];
+
+  LogRecord front_;
+  bool has_front_ = false;
+
+  char data_[kRingSize];
+};
+
+struct PerThreadLogQueue::ThreadRings {
+  struct Entry {
+    uint64_t queue_id;
+    std::shared_ptr<Ring> ring;
+  };
+
+  ~ThreadRings() {
+    is_destroyed = true;
+    for (Entry& entry : entries) {
+      entry.ring->is_abandoned.store(true, std::memory_order_release);
+    }
+  }
+
+  std::vector<Entry> entries;
+
+  // Set once the thread exits, as it may still log from the destructors of
+  // other thread-local objects.
+  static thread_local bool is_destroyed;
+};
+
+thread_local bool PerThreadLogQueue::ThreadRings::is_destroyed = false;
+
+PerThreadLogQueue::PerThreadLogQueue()
+    : id_(g_next_queue_id_.fetch_add(1, std::memory_order_relaxed)) {}
+
+PerThreadLogQueue::~PerThreadLogQueue() {
+  for (const std::shared_ptr<Ring>& ring : rings_) {
+    ring->is_orphaned.store(true, std::memory_order_relaxed);
+  }
+}
+
+bool PerThreadLogQueue::Push(const LogRecord& record) {
+  if (is_closed_.load(std::memory_order_relaxed)) {
+    return false;
+  }
+
+  Ring* const ring = GetThreadRing();
+  if (!ring) {
+    return false;
+  }
+
+  while (!ring->TryWrite(record)) {
+    if (is_closed_.load(std::memory_order_relaxed)) {
+      return false;
+    }
+    records_available_.NotifyOne();
+    std::this_thread::yield();
+  }
+
+  records_available_.NotifyOne();
+  return true;
+}
+
+size_t PerThreadLogQueue::PopMerged(LogRecord* out, size_t max) {
+  UpdateConsumerRings();
+
+  // Min-heap of the rings holding a record, by the timestamp of that record.
+  const auto is_newer = [](const Ring* first, const Ring* second) {
+    return first->front().timestamp() > second->front().timestamp();
+  };
+  merge_heap_.clear();
+  for (Ring* ring : consumer_rings_) {
+    if (ring->LoadFront()) {
+      merge_heap_.push_back(ring);
+    }
+  }
+  std::make_heap(merge_heap_.begin(), merge_heap_.end(), is_newer);
+
+  size_t count = 0;
+  while (count < max && !merge_heap_.empty()) {
+    std::pop_heap(merge_heap_.begin(), merge_heap_.end(), is_newer);
+    Ring* const ring = merge_heap_.back();
+    out[count++] = ring->front();
+    ring->PopFront();
+    if (ring->LoadFront()) {
+      std::push_heap(merge_heap_.begin(), merge_heap_.end(), is_newer);
+    } else {
+      merge_heap_.pop_back();
+    }
+  }
+  return count;
+}
+
+bool PerThreadLogQueue::WaitForRecords() {
+  while (true) {
+    if (HasRecords()) {
+      return true;
+    }
+
+    const EventCount::Key key = records_available_.PrepareWait();
+    if (HasRecords()) {
+      records_available_.CancelWait();
+      return true;
+    }
+    if (is_closed_.load(std::memory_order_acquire)) {
+      records_available_.CancelWait();
+      return false;
+    }
+
+    records_available_.Wait(key);
+  }
+}
+
+void PerThreadLogQueue::Close() {
+  is_closed_.store(true, std::memory_order_release);
+  records_available_.NotifyAll();
+}
+
+PerThreadLogQueue::Ring* PerThreadLogQueue::GetThreadRing() {
+  if (ThreadRings::is_destroyed) {
+    return nullptr;
+  }
+
+  static thread_local ThreadRings thread_rings;
+  for (const ThreadRings::Entry& entry : thread_rings.entries) {
+    if (entry.queue_id == id_) {
+      return entry.ring.get();
+    }
+  }
+
+  // First push of the thread to this queue. Drop the rings of destroyed
+  // queues meanwhile.
+  std::vector<ThreadRings::Entry>& entries = thread_rings.entries;
+  entries.erase(std::remove_if(entries.begin(), entries.end(),
+                               [](const ThreadRings::Entry& entry) {
+                                 return entry.ring->is_orphaned.load(
+                                     std::memory_order_relaxed);
+                               }),
+                entries.end());
+  entries.push_back(ThreadRings::Entry{id_, AdoptRing()});
+  return entries.back().ring.get();
+}
+
+std::shared_ptr<PerThreadLogQueue::Ring> PerThreadLogQueue::AdoptRing() {
+  std::lock_guard<std::mutex> lock(rings_lock_);
+
+  // The records left by the previous owner of a ring stay ahead of those of
+  // the new one, which were necessarily composed later.
+  for (const std::shared_ptr<Ring>& ring : rings_) {
+    if (ring->is_abandoned.load(std::memory_order_acquire)) {
+      ring->is_abandoned.store(false, std::memory_order_relaxed);
+      return ring;
+    }
+  }
+
+  rings_.push_back(std::make_shared<Ring>());
+  ring_count_.store(rings_.size(), std::memory_order_release);
+  return rings_.back();
+}
+
+void PerThreadLogQueue::UpdateConsumerRings() {
+  if (ring_count_.load(std::memory_order_acquire) == consumer_rings_.size()) {
+    return;
+  }
+
+  std::lock_guard<std::mutex> lock(rings_lock_);
+  consumer_rings_.clear();
+  for (const std::shared_ptr<Ring>& ring : rings_) {
+    consumer_rings_.push_back(ring.get());
+  }
+  merge_heap_.reserve(consumer_rings_.size());
+}
+
+bool PerThreadLogQueue::HasRecords() {
+  UpdateConsumerRings();
+  for (Ring* ring : consumer_rings_) {
+    if (ring->LoadFront()) {
+      return true;
+    }
+  }
+  return false;
+}
+
+}  // namespace util
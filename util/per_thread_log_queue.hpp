@@ -0,0 +1,99 @@
+#ifndef D9A780A6_EA94_4B50_A49F_541697CDAB6E
+#define D9A780A6_EA94_4B50_A49F_541697CDAB6E
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "threading/event_count.hpp"
+#include "threading/include/queue_policies.hpp"
+#include "util/include/log_record.hpp"
+
+namespace util {
+
+// Queue of LogRecords from any number of producer threads to a single
+// consumer, the logging thread, built from one single-producer single-consumer
+// byte ring per producer thread.
+//
+// Producers only ever write to their own ring, so logging threads never
+// contend with each other. Each record only takes as many bytes of the ring as
+// its arguments use. After each push, a producer signals the consumer through
+// an EventCount, which costs a fence and a load unless the consumer is parked.
+//
+// The consumer polls the rings round-robin, and merges their records by
+// timestamp, such that records are popped in the order in which they were
+// composed, as far as it can tell from the records already pushed.
+//
+// A thread gets a ring the first time it pushes. When it exits, its ring is
+// handed back to the queue with whatever records are left in it, and handed
+// over to the next thread needing one, behind those records. The number of
+// rings is thus bounded by the number of threads logging at once.
+class PerThreadLogQueue {
+ public:
+  // Capacity of each producer's ring, in bytes.
+  static constexpr size_t kRingSize = 64 * 1024;
+
+  PerThreadLogQueue();
+  ~PerThreadLogQueue();
+
+  PerThreadLogQueue(const PerThreadLogQueue& other) = delete;
+  PerThreadLogQueue& operator=(const PerThreadLogQueue& other) = delete;
+
+  // Pushes |record| to the calling thread's ring, waiting for the consumer to
+  // make space if it is full. Returns false, dropping |record|, if the queue
+  // is closed.
+  bool Push(const LogRecord& record);
+
+  // Pops up to |max| records to |out|, oldest first across all rings, and
+  // returns how many were popped. Never blocks.
+  //
+  // NOTE: Only ever called by the consumer.
+  size_t PopMerged(LogRecord* out, size_t max);
+
+  // Blocks until records may be available, then returns true. Returns false
+  // once the queue is closed and empty.
+  //
+  // NOTE: Only ever called by the consumer.
+  bool WaitForRecords();
+
+  // Rejects any further push, and wakes up the consumer.
+  void Close();
+
+ private:
+  class Ring;
+
+  // Rings of the calling thread, by queue.
+  struct ThreadRings;
+
+  Ring* GetThreadRing();
+  std::shared_ptr<Ring> AdoptRing();
+
+  // Refreshes |consumer_rings_| if rings were added since the last call.
+  void UpdateConsumerRings();
+
+  bool HasRecords();
+
+  // Identifies the queue in ThreadRings, unlike its address, which may be
+  // reused once it is destroyed.
+  const uint64_t id_;
+
+  std::atomic_bool is_closed_{false};
+  EventCount records_available_;
+
+  // Every ring, whether in use by a thread or waiting to be adopted.
+  std::mutex rings_lock_;
+  std::vector<std::shared_ptr<Ring>> rings_;
+  std::atomic<size_t> ring_count_{0};
+
+  // Snapshot of |rings_|, and the heap merging their records, only accessed
+  // by the consumer.
+  std::vector<Ring*> consumer_rings_;
+  std::vector<Ring*> merge_heap_;
+};
+
+}  // namespace util
+
+#endif /* D9A780A6_EA94_4B50_A49F_541697CDAB6E */
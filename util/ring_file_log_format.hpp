@@ -0,0 +1,86 @@
+#ifndef E084E98B_CC8B_46E5_BFEA_F89925A5ED35
+#define E084E98B_CC8B_46E5_BFEA_F89925A5ED35
+
+#include <cstddef>
+#include <cstdint>
+
+namespace util {
+namespace ring_file_log {
+
+// Layout of the files written by the sinks of CreateRingFileLogSink(), in the
+// byte order of the machine which wrote them:
+//
+//   1. A FileHeader, padded to kHeaderSize.
+//   2. |metadata_capacity| bytes of metadata, of which the first
+//      |metadata_size| are in use: a sequence of entries, each starting with a
+//      MetadataKind byte.
+//      - kSite: uint32_t id, int32_t level, int32_t line, uint16_t file size,
+//        then the characters of the file.
+//      - kThread: uint32_t index, uint16_t size, then the characters of the
+//        thread id, as streamed by std::thread::id's operator<<().
+//   3. |ring_size| bytes of records, split into blocks of |block_size| bytes.
+//      Each record is a RecordHeader followed by the encoded arguments of the
+//      record, as returned by LogRecord::encoded_arguments(). Records never
+//      straddle two blocks. When the next record does not fit in what is left
+//      of a block, a RecordHeader with kEndOfBlock set marks the end of the
+//      block, if there is space left for one.
+//
+// |write_position| is the number of bytes ever written to the ring, such that
+// the block being written is block |write_position / block_size|, stored at
+// offset |write_position % ring_size| of the ring, and overwriting the oldest
+// block. Every other block of the ring holds whole records. The metadata and
+// the records are always written before the sizes covering them are updated,
+// so a file left by a crashed process only misses the record being written.
+
+constexpr char kMagic[8] = {'U', 'T', 'I', 'L', 'R', 'L', 'O', 'G'};
+constexpr uint32_t kVersion = 1;
+
+constexpr size_t kHeaderSize = 4096;
+constexpr uint32_t kBlockSize = 64 * 1024;
+
+struct FileHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t block_size;
+
+  uint64_t metadata_offset;
+  uint64_t metadata_capacity;
+  uint64_t metadata_size;
+
+  uint64_t ring_offset;
+  uint64_t ring_size;
+  uint64_t write_position;
+};
+
+static_assert(sizeof(FileHeader) <= kHeaderSize,
+              "The header must fit in its page.");
+
+enum MetadataKind : uint8_t {
+  kSite = 1,
+  kThread = 2,
+};
+
+enum RecordFlags : uint32_t {
+  kTruncated = 1 << 0,
+  kEndOfBlock = 1 << 1,
+};
+
+struct RecordHeader {
+  // std::chrono::steady_clock ticks at which the record was composed.
+  int64_t timestamp;
+
+  // LogSite::id of the site of the record, and index of its thread.
+  uint32_t site_id;
+  uint32_t thread_index;
+
+  uint32_t flags;
+  uint32_t arguments_size;
+};
+
+static_assert(sizeof(RecordHeader) == 24,
+              "Record headers must not have any padding.");
+
+}  // namespace ring_file_log
+}  // namespace util
+
+#endif /* E084E98B_CC8B_46E5_BFEA_F89925A5ED35 */
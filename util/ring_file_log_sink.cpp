@@ -0,0 +1,223 @@
+#include "util/ring_file_log_sink.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <sstream>
+#include <string>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+namespace util {
+namespace {
+
+using ring_file_log::FileHeader;
+using ring_file_log::RecordHeader;
+
+template<typename TValue>
+void AppendValue(std::string& entry, const TValue& value) {
+  entry.append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+// Appends |size| characters of |data| preceded by their size, truncated to
+// what the size can hold.
+void AppendString(std::string& entry, const char* data, size_t size) {
+  const uint16_t stored_size =
+      static_cast<uint16_t>(std::min<size_t>(size, UINT16_MAX));
+  AppendValue(entry, stored_size);
+  entry.append(data, stored_size);
+}
+
+}  // namespace
+
+RingFileLogSink::RingFileLogSink(const RingFileLogSinkOptions& options)
+    : options_(options) {}
+
+RingFileLogSink::~RingFileLogSink() {
+  if (mapping_) {
+    msync(mapping_, mapping_size_, MS_SYNC);
+    munmap(mapping_, mapping_size_);
+  }
+  if (fd_ >= 0) {
+    close(fd_);
+  }
+}
+
+bool RingFileLogSink::Open() {
+  using ring_file_log::kBlockSize;
+  using ring_file_log::kHeaderSize;
+
+  ring_size_ =
+      std::max<uint64_t>(options_.ring_size / kBlockSize, 1) * kBlockSize;
+  metadata_capacity_ =
+      (options_.metadata_size + kHeaderSize - 1) / kHeaderSize * kHeaderSize;
+  mapping_size_ = static_cast<size_t>(kHeaderSize + metadata_capacity_ +
+                                      ring_size_);
+
+  fd_ = open(options_.path.c_str(),
+             O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd_ < 0) {
+    return false;
+  }
+
+  // Allocate the whole file up front, such that writing to the mapping can
+  // never fail for lack of space.
+  if (posix_fallocate(fd_, 0, static_cast<off_t>(mapping_size_)) != 0) {
+    return false;
+  }
+
+  void* const mapping = mmap(nullptr, mapping_size_, PROT_READ | PROT_WRITE,
+                             MAP_SHARED, fd_, 0);
+  if (mapping == MAP_FAILED) {
+    return false;
+  }
+
+  mapping_ = static_cast<char*>(mapping);
+  header_ = reinterpret_cast<FileHeader*>(mapping_);
+  metadata_ = mapping_ + kHeaderSize;
+  ring_ = metadata_ + metadata_capacity_;
+
+  header_->version = ring_file_log::kVersion;
+  header_->block_size = kBlockSize;
+  header_->metadata_offset = kHeaderSize;
+  header_->metadata_capacity = metadata_capacity_;
+  header_->metadata_size = 0;
+  header_->ring_offset = kHeaderSize + metadata_capacity_;
+  header_->ring_size = ring_size_;
+  header_->write_position = 0;
+
+  // The file is only recognized once complete.
+  std::atomic_signal_fence(std::memory_order_release);
+  std::memcpy(header_->magic, ring_file_log::kMagic, sizeof(header_->magic));
+
+  synced_at_ = Clock::now();
+  return true;
+}
+
+void RingFileLogSink::Flush() {
+  if (mapping_) {
+    MaybeSync();
+  }
+}
+
+void RingFileLogSink::WriteRecord(const LogRecord& record) {
+  using ring_file_log::kBlockSize;
+
+  if (!mapping_) {
+    return;
+  }
+
+  DescribeSite(*record.site());
+
+  RecordHeader record_header;
+  record_header.timestamp = record.timestamp();
+  record_header.site_id = record.site()->id;
+  record_header.thread_index = ThreadIndexOf(record);
+  record_header.flags =
+      record.is_truncated() ? static_cast<uint32_t>(ring_file_log::kTruncated)
+                            : 0;
+  record_header.arguments_size =
+      static_cast<uint32_t>(record.encoded_arguments_size());
+
+  const size_t size = sizeof(record_header) + record_header.arguments_size;
+  const uint64_t block_offset = write_position_ % kBlockSize;
+  if (block_offset + size > kBlockSize) {
+    if (kBlockSize - block_offset >= sizeof(RecordHeader)) {
+      RecordHeader end_of_block = RecordHeader();
+      end_of_block.flags = ring_file_log::kEndOfBlock;
+      std::memcpy(&ring_[write_position_ % ring_size_], &end_of_block,
+                  sizeof(end_of_block));
+    }
+    write_position_ += kBlockSize - block_offset;
+
+    // The next block takes the place of the oldest one, which must be left
+    // out of the file before any of it is overwritten.
+    std::atomic_signal_fence(std::memory_order_release);
+    header_->write_position = write_position_;
+    MaybeSync();
+  }
+
+  char* const out = &ring_[write_position_ % ring_size_];
+  std::memcpy(out, &record_header, sizeof(record_header));
+  std::memcpy(out + sizeof(record_header), record.encoded_arguments(),
+              record_header.arguments_size);
+  write_position_ += size;
+
+  std::atomic_signal_fence(std::memory_order_release);
+  header_->write_position = write_position_;
+}
+
+uint32_t RingFileLogSink::ThreadIndexOf(const LogRecord& record) {
+  const auto it = thread_indices_.find(record.thread_id());
+  if (it != thread_indices_.end()) {
+    return it->second;
+  }
+
+  const uint32_t index = static_cast<uint32_t>(thread_indices_.size());
+  thread_indices_.emplace(record.thread_id(), index);
+
+  std::ostringstream thread_id;
+  thread_id << record.thread_id();
+  const std::string formatted = thread_id.str();
+
+  std::string entry;
+  AppendValue(entry, ring_file_log::kThread);
+  AppendValue(entry, index);
+  AppendString(entry, formatted.data(), formatted.size());
+  AppendMetadata(entry.data(), entry.size());
+  return index;
+}
+
+void RingFileLogSink::DescribeSite(const LogSite& site) {
+  if (site.id < described_sites_.size() && described_sites_[site.id]) {
+    return;
+  }
+
+  if (site.id >= described_sites_.size()) {
+    described_sites_.resize(site.id + 1, false);
+  }
+  described_sites_[site.id] = true;
+
+  std::string entry;
+  AppendValue(entry, ring_file_log::kSite);
+  AppendValue(entry, site.id);
+  AppendValue(entry, static_cast<int32_t>(site.level));
+  AppendValue(entry, static_cast<int32_t>(site.line));
+  AppendString(entry, site.file, std::strlen(site.file));
+  AppendMetadata(entry.data(), entry.size());
+}
+
+void RingFileLogSink::AppendMetadata(const char* entry, size_t size) {
+  if (metadata_size_ + size > metadata_capacity_) {
+    return;
+  }
+
+  std::memcpy(&metadata_[metadata_size_], entry, size);
+  metadata_size_ += size;
+
+  std::atomic_signal_fence(std::memory_order_release);
+  header_->metadata_size = metadata_size_;
+}
+
+void RingFileLogSink::MaybeSync() {
+  const Clock::time_point now = Clock::now();
+  if (now - synced_at_ >= options_.sync_interval) {
+    msync(mapping_, mapping_size_, MS_ASYNC);
+    synced_at_ = now;
+  }
+}
+
+std::unique_ptr<LogSink> CreateRingFileLogSink(
+    const RingFileLogSinkOptions& options) {
+  std::unique_ptr<RingFileLogSink> sink(new RingFileLogSink(options));
+  if (!sink->Open()) {
+    return nullptr;
+  }
+
+  return sink;
+}
+
+}  // namespace util
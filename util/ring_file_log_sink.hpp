@@ -0,0 +1,83 @@
+#ifndef FD79F0A2_2A65_42DB_A4D2_B62EC44A1493
+#define FD79F0A2_2A65_42DB_A4D2_B62EC44A1493
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "util/include/log_record.hpp"
+#include "util/include/log_sink.hpp"
+#include "util/ring_file_log_format.hpp"
+
+namespace util {
+
+// LogSink copying records as they are into a file mapped in memory, laid out
+// as described in ring_file_log_format.hpp. The file is allocated up front, so
+// writing a record is a copy into the mapping, and never a system call but for
+// the periodic msync().
+class RingFileLogSink : public LogSink {
+ public:
+  explicit RingFileLogSink(const RingFileLogSinkOptions& options);
+  ~RingFileLogSink() override;
+
+  RingFileLogSink(const RingFileLogSink& other) = delete;
+  RingFileLogSink& operator=(const RingFileLogSink& other) = delete;
+
+  // Creates, allocates and maps the file. Returns false if any of it fails.
+  bool Open();
+
+  // Formatted output has nowhere to go.
+  void Write(const char*, size_t) override {}
+
+  void Flush() override;
+
+  bool takes_records() const override { return true; }
+  void WriteRecord(const LogRecord& record) override;
+
+ private:
+  using Clock = std::chrono::steady_clock;
+
+  // Returns the index of the thread of |record|, describing the thread in the
+  // metadata the first time it is seen.
+  uint32_t ThreadIndexOf(const LogRecord& record);
+
+  // Describes |site| in the metadata, unless already done.
+  void DescribeSite(const LogSite& site);
+
+  // Appends |size| bytes of |entry| to the metadata, unless it is full.
+  void AppendMetadata(const char* entry, size_t size);
+
+  // Schedules the write-back of the mapping if |sync_interval| elapsed since
+  // the last one.
+  void MaybeSync();
+
+  const RingFileLogSinkOptions options_;
+
+  int fd_ = -1;
+  char* mapping_ = nullptr;
+  size_t mapping_size_ = 0;
+
+  ring_file_log::FileHeader* header_ = nullptr;
+  char* metadata_ = nullptr;
+  char* ring_ = nullptr;
+
+  // Mirrors of the header fields, such that the header is only ever written.
+  uint64_t metadata_capacity_ = 0;
+  uint64_t metadata_size_ = 0;
+  uint64_t ring_size_ = 0;
+  uint64_t write_position_ = 0;
+
+  // Whether each site, by LogSite::id, was described, and index of each
+  // thread described.
+  std::vector<bool> described_sites_;
+  std::unordered_map<std::thread::id, uint32_t> thread_indices_;
+
+  Clock::time_point synced_at_;
+};
+
+}  // namespace util
+
+#endif /* FD79F0A2_2A65_42DB_A4D2_B62EC44A1493 */
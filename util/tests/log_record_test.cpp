@@ -0,0 +1,155 @@
+// Checks that statements streamed to the LOG_UTIL_* macros are formatted the
+// same with structured logging, where LogRecordStream records them to be
+// formatted later, as with a std::ostream, as without it.
+
+#include <cstdint>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+
+#include "util/include/log_record.hpp"
+#include "util/include/logger.hpp"
+
+namespace util {
+namespace {
+
+struct Point {
+  int x;
+  int y;
+};
+
+std::ostream& operator<<(std::ostream& stream, const Point& point) {
+  return stream << "(" << point.x << ", " << point.y << ")";
+}
+
+enum Color { kRed = 1, kGreen = 2 };
+
+// Statements run against both a std::ostream and a LogRecordStream.
+template<typename TStream>
+void StreamStatements(int index, TStream& stream) {
+  switch (index) {
+    case 0:
+      stream << "plain " << 42 << ' ' << -7 << ' ' << 3.25 << ' ' << true;
+      break;
+    case 1:
+      stream << std::hex << 255 << ' ' << -1 << ' ' << std::uppercase << 48879u
+             << std::dec << ' ' << 255;
+      break;
+    case 2:
+      stream << std::oct << 8 << ' ' << std::showbase << std::hex << 16;
+      break;
+    case 3:
+      stream << "[" << std::setw(6) << 42 << "][" << std::left
+             << std::setw(6) << "ab" << "][" << std::setfill('*')
+             << std::setw(4) << 'c' << "][" << 7 << "]";
+      break;
+    case 4:
+      stream << std::setprecision(3) << 3.14159 << ' ' << std::fixed << 2.5
+             << ' ' << std::scientific << 1234.5;
+      break;
+    case 5:
+      stream << std::boolalpha << true << ' ' << false << ' '
+             << std::noboolalpha << true;
+      break;
+    case 6:
+      stream << "line" << std::endl << "next" << std::ends << std::flush;
+      break;
+    case 7:
+      stream << std::setw(12) << Point{1, -2} << "|" << std::hex
+             << Point{31, 32} << "|" << std::showpos << 5 << std::noshowpos
+             << std::dec << "|" << kGreen;
+      break;
+    case 8:
+      stream << std::setw(8) << std::internal << -42 << ' ' << std::right
+             << std::setw(5) << std::string("str") << ' '
+             << static_cast<int16_t>(-2);
+      break;
+  }
+}
+
+constexpr int kStatementCount = 9;
+
+std::string FormatWithOstream(int index) {
+  std::ostringstream stream;
+  StreamStatements(index, stream);
+  return stream.str();
+}
+
+std::string FormatWithRecord(int index) {
+  static const LogSite site(Logger::LogLevel::kInfo, __FILE__, __LINE__);
+  LogRecord record;
+  record.Reset(&site);
+  {
+    LogRecordStream stream(record);
+    StreamStatements(index, stream);
+  }
+
+  std::ostringstream out;
+  record.VisitArguments(LogRecordArgumentWriter<std::ostream>(out));
+  return out.str();
+}
+
+// Statement logged with LOG_UTIL_INFO after the others, and what it should
+// log.
+#define MACRO_STATEMENT LOG_UTIL_INFO << std::hex << 255 << std::endl
+constexpr char kMacroStatementOutput[] = "ff\n";
+
+// Runs the statements through the global Logger, as the LOG_UTIL_* macros do.
+std::string FormatWithLogger() {
+  std::ostringstream info;
+  std::ostringstream error;
+  Logger::CreateGlobalInstance(info, error);
+  for (int i = 0; i < kStatementCount; i++) {
+#ifdef ENABLE_UTIL_STRUCTURED_LOGGING
+    static const LogSite site(Logger::LogLevel::kInfo, __FILE__, __LINE__);
+    Logger::LogMessage message(site);
+#else
+    Logger::LogMessage message = Logger::CreateLogMessage(
+        Logger::LogLevel::kInfo, __FILE__, __LINE__);
+#endif
+    StreamStatements(i, message.stream());
+  }
+  MACRO_STATEMENT;
+  delete Logger::GetGlobalInstance();
+  return info.str();
+}
+
+}  // namespace
+}  // namespace util
+
+int main() {
+  int failures = 0;
+
+  std::string expected_log;
+  for (int i = 0; i < util::kStatementCount; i++) {
+    const std::string expected = util::FormatWithOstream(i);
+    const std::string actual = util::FormatWithRecord(i);
+    if (actual != expected) {
+      std::cerr << "Statement " << i << ": expected \"" << expected
+                << "\", got \"" << actual << "\"\n";
+      failures++;
+    }
+    expected_log += expected;
+  }
+  expected_log += util::kMacroStatementOutput;
+
+  // Strip the prefix of each line logged, and compare what remains.
+  const std::string log = util::FormatWithLogger();
+  std::string logged;
+  size_t begin = 0;
+  while (begin < log.size()) {
+    const size_t prefix_end = log.find("] ", begin);
+    const size_t next = log.find("\n[", prefix_end);
+    const size_t end = next == std::string::npos ? log.size() - 1 : next;
+    logged += log.substr(prefix_end + 2, end - prefix_end - 2);
+    begin = end + 1;
+  }
+  if (logged != expected_log) {
+    std::cerr << "Logger: expected \"" << expected_log << "\", got \""
+              << logged << "\"\n";
+    failures++;
+  }
+
+  return failures == 0 ? 0 : 1;
+}
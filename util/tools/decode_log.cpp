@@ -0,0 +1,292 @@
+// Decodes the binary log files written by the sinks of CreateRingFileLogSink()
+// into the text LoggerImpl writes, oldest record first.
+//
+// Usage: decode_log [--min-level=<level>] [--file=<text>] [--thread=<id>]
+//                   <log file>
+//
+// Only records of sites of at least |level|, from files whose path contains
+// |text|, or from the thread printed as |id|, are decoded.
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "util/include/log_record.hpp"
+#include "util/ring_file_log_format.hpp"
+
+namespace util {
+namespace {
+
+using ring_file_log::FileHeader;
+using ring_file_log::RecordHeader;
+
+struct Options {
+  int min_level = 0;
+  std::string file;
+  std::string thread;
+  std::string path;
+};
+
+struct Site {
+  bool is_described = false;
+  int32_t level = 0;
+  int32_t line = 0;
+  std::string file;
+};
+
+// Whether the |size| bytes at |offset| lie within the first |limit| bytes of
+// a file. Offsets and sizes read off a file are only ever compared this way,
+// such that corrupted ones cannot overflow.
+bool IsWithin(uint64_t offset, uint64_t size, uint64_t limit) {
+  return offset <= limit && size <= limit - offset;
+}
+
+// Reads values off the metadata of a file, failing once past its end.
+class MetadataReader {
+ public:
+  MetadataReader(const char* data, size_t size) : data_(data), size_(size) {}
+
+  template<typename TValue>
+  bool Read(TValue* value) {
+    if (size_ - offset_ < sizeof(TValue)) {
+      return false;
+    }
+    std::memcpy(value, &data_[offset_], sizeof(TValue));
+    offset_ += sizeof(TValue);
+    return true;
+  }
+
+  bool ReadString(std::string* value) {
+    uint16_t size;
+    if (!Read(&size) || size_ - offset_ < size) {
+      return false;
+    }
+    value->assign(&data_[offset_], size);
+    offset_ += size;
+    return true;
+  }
+
+  bool is_done() const { return offset_ == size_; }
+
+ private:
+  const char* const data_;
+  const size_t size_;
+  size_t offset_ = 0;
+};
+
+class Decoder {
+ public:
+  Decoder(const Options& options, std::ostream& out)
+      : options_(options), out_(out) {}
+
+  // Decodes the |size| bytes of the file at |data|. Returns false if they do
+  // not hold a log file.
+  bool Decode(const char* data, size_t size) {
+    if (size < sizeof(FileHeader)) {
+      return false;
+    }
+
+    FileHeader header;
+    std::memcpy(&header, data, sizeof(header));
+    if (std::memcmp(header.magic, ring_file_log::kMagic,
+                    sizeof(header.magic)) != 0 ||
+        header.version != ring_file_log::kVersion ||
+        header.block_size == 0 ||
+        header.metadata_size > header.metadata_capacity ||
+        !IsWithin(header.metadata_offset, header.metadata_capacity, size) ||
+        !IsWithin(header.ring_offset, header.ring_size, size) ||
+        header.ring_size % header.block_size != 0) {
+      return false;
+    }
+
+    ReadMetadata(data + header.metadata_offset,
+                 static_cast<size_t>(header.metadata_size));
+
+    // The block being written took the place of the oldest one, and every
+    // other block is whole.
+    const uint64_t block_count = header.ring_size / header.block_size;
+    const uint64_t last_block = header.write_position / header.block_size;
+    const uint64_t first_block =
+        last_block >= block_count ? last_block - block_count + 1 : 0;
+    const char* const ring = data + header.ring_offset;
+    for (uint64_t block = first_block; block - first_block < block_count;
+         block++) {
+      const uint64_t begin = block * header.block_size;
+      if (begin >= header.write_position) {
+        break;
+      }
+      const uint64_t length = std::min<uint64_t>(
+          header.block_size, header.write_position - begin);
+      DecodeBlock(ring + begin % header.ring_size,
+                  static_cast<size_t>(length));
+    }
+    return true;
+  }
+
+ private:
+  void ReadMetadata(const char* data, size_t size) {
+    MetadataReader reader(data, size);
+    while (!reader.is_done()) {
+      uint8_t kind;
+      uint32_t index;
+      if (!reader.Read(&kind) || !reader.Read(&index)) {
+        return;
+      }
+
+      if (kind == ring_file_log::kSite) {
+        Site site;
+        if (!reader.Read(&site.level) || !reader.Read(&site.line) ||
+            !reader.ReadString(&site.file)) {
+          return;
+        }
+        site.is_described = true;
+        if (index >= sites_.size()) {
+          sites_.resize(index + 1);
+        }
+        sites_[index] = std::move(site);
+      } else if (kind == ring_file_log::kThread) {
+        std::string thread;
+        if (!reader.ReadString(&thread)) {
+          return;
+        }
+        if (index >= threads_.size()) {
+          threads_.resize(index + 1, "?");
+        }
+        threads_[index] = std::move(thread);
+      } else {
+        return;
+      }
+    }
+  }
+
+  void DecodeBlock(const char* data, size_t size) {
+    size_t offset = 0;
+    while (size - offset >= sizeof(RecordHeader)) {
+      RecordHeader header;
+      std::memcpy(&header, &data[offset], sizeof(header));
+      offset += sizeof(header);
+      if ((header.flags & ring_file_log::kEndOfBlock) ||
+          size - offset < header.arguments_size) {
+        return;
+      }
+
+      DecodeRecord(header, &data[offset]);
+      offset += header.arguments_size;
+    }
+  }
+
+  void DecodeRecord(const RecordHeader& header, const char* arguments) {
+    static const Site kUnknownSite;
+    const Site& site =
+        header.site_id < sites_.size() ? sites_[header.site_id] : kUnknownSite;
+    const std::string& thread = header.thread_index < threads_.size()
+                                    ? threads_[header.thread_index]
+                                    : kUnknownThread;
+    if ((site.is_described && site.level < options_.min_level) ||
+        (!options_.file.empty() &&
+         site.file.find(options_.file) == std::string::npos) ||
+        (!options_.thread.empty() && thread != options_.thread)) {
+      return;
+    }
+
+    if (site.is_described) {
+      out_ << "[" << site.level << ":" << site.file << "(" << site.line
+           << "):" << thread << "] ";
+    } else {
+      out_ << "[?:?(?):" << thread << "] ";
+    }
+    if (record_.SetEncodedArguments(
+            arguments, header.arguments_size,
+            (header.flags & ring_file_log::kTruncated) != 0)) {
+      record_.VisitArguments(LogRecordArgumentWriter<std::ostream>(out_));
+    }
+    if (record_.is_truncated()) {
+      out_ << "...";
+    }
+    out_ << '\n';
+  }
+
+  const std::string kUnknownThread = "?";
+
+  const Options& options_;
+  std::ostream& out_;
+
+  // Sites by LogSite::id, and threads by index.
+  std::vector<Site> sites_;
+  std::vector<std::string> threads_;
+
+  LogRecord record_;
+};
+
+bool ParseOptions(int argc, char** argv, Options* options) {
+  for (int i = 1; i < argc; i++) {
+    const std::string arg = argv[i];
+    if (arg.compare(0, 12, "--min-level=") == 0) {
+      options->min_level = std::atoi(arg.c_str() + 12);
+    } else if (arg.compare(0, 7, "--file=") == 0) {
+      options->file = arg.substr(7);
+    } else if (arg.compare(0, 9, "--thread=") == 0) {
+      options->thread = arg.substr(9);
+    } else if (options->path.empty() && arg.compare(0, 2, "--") != 0) {
+      options->path = arg;
+    } else {
+      return false;
+    }
+  }
+  return !options->path.empty();
+}
+
+}  // namespace
+}  // namespace util
+
+int main(int argc, char** argv) {
+  util::Options options;
+  if (!util::ParseOptions(argc, argv, &options)) {
+    std::cerr << "Usage: " << argv[0]
+              << " [--min-level=<level>] [--file=<text>] [--thread=<id>]"
+                 " <log file>\n";
+    return 2;
+  }
+
+  const int fd = open(options.path.c_str(), O_RDONLY | O_CLOEXEC);
+  struct stat file_stat;
+  if (fd < 0 || fstat(fd, &file_stat) != 0) {
+    std::cerr << "Cannot open " << options.path << ": " << std::strerror(errno)
+              << "\n";
+    return 1;
+  }
+
+  const size_t size = static_cast<size_t>(file_stat.st_size);
+  void* const data =
+      size > 0 ? mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0) : nullptr;
+  close(fd);
+  if (data == MAP_FAILED) {
+    std::cerr << "Cannot map " << options.path << ": " << std::strerror(errno)
+              << "\n";
+    return 1;
+  }
+
+  std::ios::sync_with_stdio(false);
+  util::Decoder decoder(options, std::cout);
+  const bool is_log_file =
+      data && decoder.Decode(static_cast<const char*>(data), size);
+  if (data) {
+    munmap(data, size);
+  }
+  if (!is_log_file) {
+    std::cerr << options.path << " is not a log file\n";
+    return 1;
+  }
+  return 0;
+}